@@ -24,39 +24,464 @@
 
 #include "small-scope.h"
 
+//-----------------------------------------------------------------------------
+// Oversampling
+//-----------------------------------------------------------------------------
+// Sums 4^k 10-bit conversions, k being oversampleShift, and returns true when
+// the sum is complete. The sum has 10+2k bits, it is rounded to the nearest
+// 12-bit sample (half an LSB is added before the shift) with 10+k effective
+// bits: the high 8 bits go to *sample, the low 4 to *low.
+static inline boolean oversample( uint8_t *sample, uint8_t *low )
+{
+	oversampleSum += ( (uint16_t)*sample << 2 ) | *low;
+	if ( --oversampleCount ) return false;
+
+	uint8_t shift = ( oversampleShift - 1 ) << 1;
+	uint16_t value = ( oversampleSum + ( ( 1 << shift ) >> 1 ) ) >> shift;
+	oversampleSum = 0;
+	oversampleCount = 1 << ( oversampleShift << 1 );
+
+	*sample = value >> 4;
+	*low = value & 0x0F;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Decimation
+//-----------------------------------------------------------------------------
+// Feeds one conversion into the decimation state. Returns true when a sample
+// is to be stored and replaces *sample with it:
+//	DECIMATE_SKIP		first conversion of every block
+//	DECIMATE_AVERAGE	mean of the block
+//	DECIMATE_PEAK		minimum at the end of the block and maximum with
+//				the next conversion, so min/max pairs are stored
+static inline boolean decimate( uint8_t *sample )
+{
+	boolean store = false;
+	uint8_t value = *sample;
+
+	switch (decimateMode)
+	{
+	case DECIMATE_SKIP:
+		store = ( decimateCount == 0 );
+		break;
+	case DECIMATE_AVERAGE:
+		decimateSum += value;
+		if ( decimateCount == decimateFactor - 1 ) {
+			*sample = decimateSum >> decimateShift;
+			decimateSum = 0;
+			store = true;
+		}
+		break;
+	case DECIMATE_PEAK:
+		if ( value < decimateMin ) decimateMin = value;
+		if ( value > decimateMax ) decimateMax = value;
+		if ( decimateCount == decimateFactor - 1 ) {
+			*sample = decimateMin;
+			decimatePending = decimateMax;
+			decimateMin = 255;
+			decimateMax = 0;
+			store = true;
+		}
+		else if ( decimateCount == 0 ) {
+			// Maximum of the previous block
+			*sample = decimatePending;
+			store = true;
+		}
+		break;
+	}
+
+	decimateCount = ( decimateCount + 1 ) & ( decimateFactor - 1 );
+
+	return store;
+}
+
+//-----------------------------------------------------------------------------
+// Digital trigger
+//-----------------------------------------------------------------------------
+// Follows the samples with a Schmitt trigger: the level goes high at
+// triggerHigh and above and low below triggerLow. Returns true for the
+// sample that completes a trigger:
+//	PULSE_OFF	a crossing in one of the directions of triggerEdges
+//	PULSE_WIDER	the crossing that ends a pulse started by such a
+//			crossing, when it lasted more than pulseWidth samples
+//	PULSE_NARROWER	the same for less than pulseWidth samples
+static inline boolean digitalTrigger( uint8_t sample )
+{
+	uint8_t previous = triggerLevel;
+	uint8_t level;
+
+	if ( previous != LEVEL_HIGH && sample >= triggerHigh ) {
+		level = LEVEL_HIGH;
+	}
+	else if ( previous != LEVEL_LOW && sample < triggerLow ) {
+		level = LEVEL_LOW;
+	}
+	else {
+		// No crossing, the current pulse is one sample longer
+		if ( pulseCount < PULSE_UNMEASURED - 1 ) pulseCount++;
+		return false;
+	}
+
+	triggerLevel = level;
+	uint16_t width = pulseCount;
+
+	// The first level found is not a crossing and the width of the pulse
+	// it starts is not known.
+	if ( previous == LEVEL_UNKNOWN ) {
+		pulseCount = PULSE_UNMEASURED;
+		return false;
+	}
+	pulseCount = 1;
+
+	if ( pulseMode == PULSE_OFF ) {
+		return triggerEdges & ( level == LEVEL_HIGH ? EDGE_RISING : EDGE_FALLING );
+	}
+
+	// The pulse that ends here started with the opposite crossing
+	if (!( triggerEdges & ( level == LEVEL_HIGH ? EDGE_FALLING : EDGE_RISING ) )) {
+		return false;
+	}
+	if ( width == PULSE_UNMEASURED ) return false;
+	if ( pulseMode == PULSE_WIDER ) return width > pulseWidth;
+	return width < pulseWidth;
+}
+
+//-----------------------------------------------------------------------------
+// rearmCapture
+//-----------------------------------------------------------------------------
+// Starts the capture in the new captureBuffer without stopping the ADC, for
+// the ping-pong and segmented memory modes. The trigger counts again once the
+// prebuffer is filled.
+static inline void rearmCapture( void )
+{
+	waitRemaining = captureSize - waitDuration;
+	if (!isContinuous) {
+		stopIndex = Capture::disarmed;
+		resumeTrigger();
+	}
+	else {
+		triggerContinuous();
+	}
+}
+
 //-----------------------------------------------------------------------------
 // ADC Conversion Complete Interrupt
 //-----------------------------------------------------------------------------
+#if FASTISR == 1
+// Entered from the hand scheduled ISR below whenever it can not handle the
+// conversion itself.
+ISR(ADC_C_vect)
+#else
 ISR(ADC_vect)
+#endif
 {
-	// When ADCL is read, the ADC Data Register is not updated until ADCH
-	// is read. Consequently, if the result is left adjusted and no more
-	// than 8-bit precision is required, it is sufficient to read ADCH.
-	// Otherwise, ADCL must be read first, then ADCH.
-	ADCBuffer[ADCCounter] = ADCH;
-
-	// Incerase counter.
-	if (++ADCCounter >= ADCBUFFERSIZE) ADCCounter = 0;
+	#if BENCHMARK == 1
+	// The stamp is taken after the prologue, the probe in printBenchmark()
+	// measures what comes before it and after the exit stamp.
+	uint16_t benchEntry = TCNT1;
+	#endif
+
+	// The plain capture, single channel at 8 bits with the comparator
+	// trigger, skips the checks of the other modes.
+	boolean plain = bit_is_set( GPIOR0, FASTPATH );
+	uint8_t low = 0;
+	uint8_t sample;
+	uint8_t channel = 0;
+	boolean store = true;
+
+	if (plain) {
+		sample = ADCH;
+	}
+	else {
+		// When ADCL is read, the ADC Data Register is not updated until
+		// ADCH is read. Consequently, if the result is left adjusted and
+		// no more than 8-bit precision is required, it is sufficient to
+		// read ADCH. Otherwise, ADCL must be read first, then ADCH.
+		if (lowBits) low = ADCL >> 6;
+		sample = ADCH;
+
+		// The sample clock starts a conversion on the rising edge of OCF1B
+		if (isClocked) TIFR1 = _BV(OCF1B);
+
+		// Multichannel capture: index in channelList of this sample. In
+		// free running mode the next conversion has already started with
+		// the input set now, so a new input only applies to the
+		// conversion after it. The sample clock starts the next
+		// conversion after this ISR.
+		if ( muxChannels > 1 ) {
+			channel = channelResult;
+			uint8_t next = channelMux + 1;
+			if ( next >= muxChannels ) next = 0;
+			ADMUX = ( ADMUX & 0xF8 ) | channelList[next];
+			channelResult = isClocked ? next : channelMux;
+			channelMux = next;
+		}
+
+		store = ( channel != CHANNEL_DISCARD ) &&
+			( isEquivalentTime || ( decimateMode == DECIMATE_OFF ) || decimate( &sample ) ) &&
+			( oversampleShift == 0 || oversample( &sample, &low ) );
+	}
+
+	if (!store) {
+		// Conversion only went into the decimation or oversampling state
+	}
+	else if ( !plain && isEquivalentTime ) {
+		// Conversions outside of a pass are discarded
+		if ( etsPosition < captureSize ) {
+			captureBuffer[etsPosition] = sample;
+			etsPosition += ETSPASSES;
+
+			if ( etsPosition >= captureSize ) {
+				if ( ++etsPhase < ETSPASSES ) {
+					// Wait for the trigger of the next pass
+					etsRemaining = ( captureSize - etsPhase + ETSPASSES - 1 ) / ETSPASSES;
+					TIFR1 = _BV(ICF1);
+					sbi( TIMSK1,ICIE1 );
+				}
+				else {
+					// All slots are filled, slot 0 was sampled
+					// ETSDELAY cycles and the 2 ADC clocks of
+					// the sample and hold after the edge.
+					frozenBuffer = captureBuffer;
+					frozenStopIndex = 0;
+					frozenTriggerIndex = 0;
+					freeze = true;
+				}
+			}
+		}
+	}
+	else if ( !plain && isStreaming ) {
+		// Roll mode: ADCBuffer is a ring drained by loop() from
+		// streamTail. A full ring drops the sample instead of
+		// overwriting data that was not sent yet.
+		index_t next = Capture::next( ADCCounter, ADCBUFFERSIZE );
+		if (next == streamTail) {
+			streamOverruns++;
+		}
+		else {
+			ADCBuffer[ADCCounter] = sample;
+			ADCCounter = next;
+		}
+	}
+	else {
+		index_t position = ADCCounter;
+		captureBuffer[position] = sample;
+
+		if (!plain) {
+			// The low bits of a 10 or 12-bit capture go to the plane
+			// behind the samples, four or two to a byte.
+			if (lowBits) {
+				uint8_t perByte = ( lowBits == 2 ) ? 2 : 1;
+				volatile uint8_t *plane = captureBuffer + captureSize + ( position >> perByte );
+				uint8_t shift = ( position & ( ( 1 << perByte ) - 1 ) ) * lowBits;
+				uint8_t mask = ( 1 << lowBits ) - 1;
+				*plane = ( *plane & ~( mask << shift ) ) | ( low << shift );
+			}
+
+			// The digital trigger follows every stored sample, so the
+			// level is known when it is armed again. The trigger is
+			// placed on the sample that completed it; like the Analog
+			// Comparator it moves with every new trigger until the
+			// prebuffer is full.
+			if ( triggerSource == TRIGGER_DIGITAL && channel == 0 &&
+				digitalTrigger(sample) && triggerArmed ) {
+				triggerIndex = position;
+				stopIndex = Capture::advance( position, waitDuration, captureSize );
+				stampTrigger();
+				if (waitRemaining <= 0) triggerArmed = false;
+			}
+		}
+
+		// Incerase counter.
+		ADCCounter = Capture::next( position, captureSize );
 	
-	// Wait for prebuffer to be filled.
-	if (waitRemaining-- <= 0) {
+		// Wait for prebuffer to be filled. The counter stops at zero, so
+		// it does not wrap around while waiting for a trigger.
+		if (waitRemaining > 0) {
+			waitRemaining--;
+		}
 		// When stop position is reached.
-		if ( stopIndex == ADCCounter )
+		else if ( stopIndex == ADCCounter )
 		{
-			// Freeze situation
-			// Disable ADC and stop Free Running Conversion Mode
-			cbi( ADCSRA, ADEN );
+			// Time and samples from the trigger to here
+			teleElapsed = micros() - teleTrigger;
+			teleCaptured = teleSamples;
+			stopChannel = channel;
+			stopDecimation = decimateCount;
+
+			if ( memoryMode == MEMORY_SEGMENTED ) {
+				segmentStop[segment] = stopIndex;
+				segmentChannel[segment] = channel;
+				segmentDecimation[segment] = decimateCount;
+				segmentTime[segment] = teleTrigger;
+			}
+
+			if ( memoryMode == MEMORY_PINGPONG && !freeze ) {
+				// Hand the filled half over to loop() and rearm on the
+				// other half without stopping the ADC.
+				frozenBuffer = captureBuffer;
+				frozenStopIndex = stopIndex;
+				frozenTriggerIndex = triggerIndex;
+				frozenChannel = stopChannel;
+				frozenDecimation = stopDecimation;
+				freeze = true;
+
+				captureBuffer = ( captureBuffer == ADCBuffer ) ? ADCBuffer + ADCBUFFERSIZE / 2 : ADCBuffer;
+				rearmCapture();
+			}
+			else if ( memoryMode == MEMORY_SEGMENTED && ++segment < segmentCount ) {
+				// Go on in the next segment at once, loop() sends the
+				// segments when the last one is full.
+				captureBuffer += segmentStride;
+				rearmCapture();
+			}
+			else {
+				// Freeze situation
+				// Disable ADC and stop Free Running Conversion Mode
+				cbi( ADCSRA, ADEN );
 
-			freeze = true;
+				if (freeze) {
+					// Previous half is still being sent, loop() takes
+					// this one over when it is done. Conversions stop
+					// until then.
+					captureDone = true;
+					teleMissed++;
+				}
+				else {
+					frozenBuffer = captureBuffer;
+					frozenStopIndex = stopIndex;
+					frozenTriggerIndex = triggerIndex;
+					frozenChannel = stopChannel;
+					frozenDecimation = stopDecimation;
+					freeze = true;
+				}
+			}
 		}
 	}
+
+	#if BENCHMARK == 1
+	uint16_t benchCycles = benchSpan( benchEntry, TCNT1 );
+	benchADCCycles += benchCycles;
+	benchADCLast = benchCycles;
+	if (benchCycles > benchADCMaxCycles) benchADCMaxCycles = benchCycles;
+	benchADCCount++;
+	benchLatency( benchEntry );
+	#endif
 }
 
+#if FASTISR == 1
+//-----------------------------------------------------------------------------
+// ADC Conversion Complete Interrupt, hand scheduled
+//-----------------------------------------------------------------------------
+// Stores ADCH at ADCCounter with a power of two wrap and counts down the
+// prebuffer, saving only the registers it uses. It runs while the FASTPATH
+// bit in GPIOR0 is set (single capture, no roll mode, no decimation); else,
+// and for the conversion that reaches stopIndex, it jumps to the C handler
+// with nothing changed. The common path takes at most 78 cycles on the
+// ATmega328P, below the 104 cycles of a conversion at prescaler 8:
+//
+//	interrupt response and jmp from the vector	 7
+//	sbis skipping the jmp				 3
+//	push of 6 registers and SREG			15
+//	next ADCCounter					 9
+//	prebuffer count down, or the stop compare	15
+//	store						10
+//	pop of 6 registers and SREG			15
+//	reti						 4
+//
+// The ATmega1280/2560 push a 3 byte return address, which adds 2 cycles.
+
+#if ( ADCBUFFERSIZE & ( ADCBUFFERSIZE - 1 ) ) != 0 || ADCBUFFERSIZE <= 256
+#error "FASTISR needs 16-bit positions and a power of two ADCBUFFERSIZE"
+#endif
+#if BENCHMARK == 1
+#error "BENCHMARK instruments the C ADC handler only, disable FASTISR"
+#endif
+
+#define FASTPOP \
+	"pop r31"		"\n\t" \
+	"pop r30"		"\n\t" \
+	"pop r23"		"\n\t" \
+	"pop r22"		"\n\t" \
+	"pop r25"		"\n\t" \
+	"pop r24"		"\n\t" \
+	"out __SREG__, r24"	"\n\t" \
+	"pop r24"		"\n\t"
+
+ISR(ADC_vect, ISR_NAKED)
+{
+	asm volatile (
+		"sbis %[gpior], %[fastpath]"	"\n\t"
+		"jmp %x[slow]"			"\n\t"
+		"push r24"			"\n\t"
+		"in r24, __SREG__"		"\n\t"
+		"push r24"			"\n\t"
+		"push r25"			"\n\t"
+		"push r22"			"\n\t"
+		"push r23"			"\n\t"
+		"push r30"			"\n\t"
+		"push r31"			"\n\t"
+
+		// Z = ADCCounter, r25:r24 = next ADCCounter
+		"lds r30, %[counter]"		"\n\t"
+		"lds r31, %[counter]+1"		"\n\t"
+		"movw r24, r30"			"\n\t"
+		"adiw r24, 1"			"\n\t"
+		"andi r24, lo8(%[mask])"	"\n\t"
+		"andi r25, hi8(%[mask])"	"\n\t"
+
+		// Count down the prebuffer while waitRemaining is above zero
+		"lds r22, %[wait]"		"\n\t"
+		"lds r23, %[wait]+1"		"\n\t"
+		"subi r22, 1"			"\n\t"
+		"sbci r23, 0"			"\n\t"
+		"brlt 1f"			"\n\t"
+		"sts %[wait]+1, r23"		"\n\t"
+		"sts %[wait], r22"		"\n\t"
+		"rjmp 2f"			"\n\t"
+
+		// Reaching the stop position is left to the C handler
+	"1:"	"lds r22, %[stop]"		"\n\t"
+		"lds r23, %[stop]+1"		"\n\t"
+		"cp r22, r24"			"\n\t"
+		"cpc r23, r25"			"\n\t"
+		"breq 3f"			"\n\t"
+
+		// ADCBuffer[ADCCounter] = ADCH, ADCCounter = next
+	"2:"	"sts %[counter]+1, r25"		"\n\t"
+		"sts %[counter], r24"		"\n\t"
+		"subi r30, lo8(-(%[buffer]))"	"\n\t"
+		"sbci r31, hi8(-(%[buffer]))"	"\n\t"
+		"lds r24, %[adch]"		"\n\t"
+		"st Z, r24"			"\n\t"
+		FASTPOP
+		"reti"				"\n\t"
+
+	"3:"	FASTPOP
+		"jmp %x[slow]"			"\n\t"
+		:
+		: [gpior] "I" (_SFR_IO_ADDR(GPIOR0)),
+		  [fastpath] "I" (FASTPATH),
+		  [slow] "i" (ADC_C_vect),
+		  [counter] "i" (&ADCCounter),
+		  [wait] "i" (&waitRemaining),
+		  [stop] "i" (&stopIndex),
+		  [buffer] "i" (ADCBuffer),
+		  [mask] "n" (ADCBUFFERSIZE - 1),
+		  [adch] "n" (_SFR_MEM_ADDR(ADCH))
+	);
+}
+#endif
+
 //-----------------------------------------------------------------------------
 // Analog Comparator interrupt
 //-----------------------------------------------------------------------------
 ISR(ANALOG_COMP_vect)
 {
+	#if BENCHMARK == 1
+	uint16_t benchEntry = TCNT1;
+	#endif
 
 	// When wait is over disable Analog Comparator interrupt
 	if (waitRemaining <= 0) cbi( ACSR,ACIE );
@@ -64,6 +489,107 @@ ISR(ANALOG_COMP_vect)
 
 	// Save position of trigger and calculate the position of end of sample
 	triggerIndex = ADCCounter;
-	stopIndex = triggerIndex + waitDuration;
-	if (stopIndex >= ADCBUFFERSIZE) stopIndex -= ADCBUFFERSIZE;
+	stopIndex = Capture::advance( triggerIndex, waitDuration, captureSize );
+	stampTrigger();
+
+	#if BENCHMARK == 1
+	uint16_t benchCycles = benchSpan( benchEntry, TCNT1 );
+	if (benchCycles > benchACMaxCycles) benchACMaxCycles = benchCycles;
+	benchACCount++;
+	#endif
+}
+
+//-----------------------------------------------------------------------------
+// Timer1 Input Capture interrupt
+//-----------------------------------------------------------------------------
+// Starts an equivalent time pass at the comparator edge captured in ICR1.
+ISR(TIMER1_CAPT_vect)
+{
+	uint16_t start = ICR1 + ETSDELAY + etsPhase * etsStep;
+
+	OCR1B = start;
+	// The pending flag would start a conversion on the next match
+	TIFR1 = _BV(OCF1B);
+
+	if ( (int16_t)( start - TCNT1 ) < ETSMARGIN ) {
+		// Entered too late to meet the first conversion, take the next
+		// edge instead.
+		TIFR1 = _BV(ICF1);
+		teleMissed++;
+		return;
+	}
+
+	cbi( TIMSK1,ICIE1 );
+	etsPosition = etsPhase;
+	// The last match of a pass leaves OCF1B set, so no further
+	// conversions are started.
+	if ( etsRemaining > 1 ) sbi( TIMSK1,OCIE1B );
+}
+
+//-----------------------------------------------------------------------------
+// Timer1 Compare Match B interrupt
+//-----------------------------------------------------------------------------
+// Schedules the next conversion of an equivalent time pass. Executing the
+// vector clears OCF1B, so the next match is a new rising edge for the ADC.
+ISR(TIMER1_COMPB_vect)
+{
+	OCR1B += etsPeriod;
+	if ( --etsRemaining <= 1 ) cbi( TIMSK1,OCIE1B );
+}
+
+//-----------------------------------------------------------------------------
+// USART Transmit Complete interrupt
+//-----------------------------------------------------------------------------
+ISR(USART_TX_vect)
+{
+	// Both the shift register and the data register are empty now, load
+	// up to two bytes to keep the line busy until the next interrupt.
+	for ( uint8_t i = 0; i < 2; i++ ) {
+		// The first byte moves on to the shift register right away and
+		// frees the data register for the second one. Should it not be
+		// free yet, the next interrupt goes on from here instead of the
+		// ISR waiting for it.
+		if ( !( UCSR0A & _BV(UDRE0) ) ) return;
+		UDR0 = *txPointer++;
+
+		// The last byte has been handed to the UART, so no further
+		// Transmit Complete is taken: TXC0 stays set when it has left,
+		// as Serial.flush() expects.
+		if ( --txRemaining == 0 && !nextTransmitRegion() ) {
+			cbi( UCSR0B, TXCIE0 );
+			txBusy = false;
+			return;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Trigger timer
+//-----------------------------------------------------------------------------
+// Timer0 Compare Match B; Timer0 keeps running as the millis() timer of the
+// Arduino core. The match comes once per Timer0 period until the holdoff or
+// the auto trigger timeout is nearly over and then at its end.
+ISR(TIMER0_COMPB_vect)
+{
+	unsigned long elapsed = micros() - triggerTimerStart;
+	if ( elapsed < triggerTimerLength &&
+		scheduleTriggerTimer( triggerTimerLength - elapsed ) ) return;
+
+	if ( triggerTimer == TIMER_HOLDOFF ) {
+		// Goes on with the auto trigger timeout, if any
+		armTrigger();
+		return;
+	}
+
+	stopTriggerTimer();
+
+	// No trigger came in time: stop like a continuous capture does, the
+	// frame shows the input as it is.
+	if ( stopIndex == Capture::disarmed ) {
+		stopAnalogComparator();
+		triggerArmed = false;
+		triggerIndex = ADCCounter;
+		stopIndex = Capture::advance( triggerIndex, waitDuration, captureSize );
+		stampTrigger();
+	}
 }
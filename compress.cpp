@@ -0,0 +1,300 @@
+//-----------------------------------------------------------------------------
+// Compress.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "small-scope.h"
+
+//-----------------------------------------------------------------------------
+// Compressed frames
+//-----------------------------------------------------------------------------
+// Samples are coded as differences to the previous sample (the one before
+// the first is 0), one byte per code:
+//
+//	code		meaning
+//	00nnnnnn	n+1 samples equal to the previous one
+//	01aaabbb	two samples, deltas a and b in -4..3
+//	10dddddd	one sample, delta d in -32..31
+//	11nnnnnn	n+1 samples follow as raw bytes
+//
+// Deltas are the difference of the two samples as an int8_t, that is modulo
+// 256: a step from 250 to 5 is coded as +11 and one from 0 to 255 as -1, so
+// a decoder adds them to the previous sample modulo 256 as well.
+//
+// A compressed frame starts with the sync word FRAMESYNC0, FRAMESYNCZ and the
+// header of a framed frame, followed by the payload length as a word, the
+// payload and the CRC of everything after the sync word. Frames that would
+// not get smaller are sent as plain framed frames.
+//
+// There is no memory for a second copy of the frame, so the codes are
+// produced by encodeFrame() in the main loop, no more than fit into the
+// Serial TX buffer at a time.
+
+static uint8_t *encodeBuffer;
+static uint16_t encodeSize;
+static uint16_t encodeStop;
+static uint16_t encodePosition;
+static uint8_t encodePrevious;
+static uint16_t encodeCrc;
+static boolean encoding = false;
+
+static uint8_t token[LITERALMAX + 1];
+static uint8_t tokenLength;
+
+// Buffer index of the sample at position in the order of sending
+static uint16_t encodeIndex( uint16_t position )
+{
+	uint16_t i = encodeStop + position;
+	if ( i >= encodeSize ) i -= encodeSize;
+	return i;
+}
+
+// Sample at position in the order of sending
+static uint8_t encodeSample( uint16_t position )
+{
+	return encodeBuffer[encodeIndex( position )];
+}
+
+static boolean smallDelta( int8_t delta )
+{
+	return delta >= -4 && delta <= 3;
+}
+
+static boolean shortDelta( int8_t delta )
+{
+	return delta >= -32 && delta <= 31;
+}
+
+// Codes the samples from position into token and returns how many it took
+static uint16_t nextToken( uint16_t position, uint8_t previous )
+{
+	uint8_t sample = encodeSample( position );
+	int8_t delta = sample - previous;
+	uint16_t left = encodeSize - position;
+	uint8_t n = 1;
+
+	if ( delta == 0 ) {
+		while ( n < left && n < RUNMAX && encodeSample( position + n ) == sample ) n++;
+		token[0] = CODE_RUN | ( n - 1 );
+		tokenLength = 1;
+	}
+	else if ( left > 1 && smallDelta( delta ) &&
+		smallDelta( encodeSample( position + 1 ) - sample ) ) {
+		int8_t next = encodeSample( position + 1 ) - sample;
+		token[0] = CODE_PAIR | ( ( delta & 0x07 ) << 3 ) | ( next & 0x07 );
+		tokenLength = 1;
+		n = 2;
+	}
+	else if ( shortDelta( delta ) ) {
+		token[0] = CODE_DELTA | ( delta & 0x3F );
+		tokenLength = 1;
+	}
+	else {
+		// Literal run of the samples that do not fit a delta code
+		token[1] = sample;
+		while ( n < left && n < LITERALMAX ) {
+			uint8_t next = encodeSample( position + n );
+			if ( shortDelta( next - sample ) ) break;
+			sample = next;
+			token[++n] = sample;
+		}
+		token[0] = CODE_LITERAL | ( n - 1 );
+		tokenLength = n + 1;
+	}
+
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+// sendCompressedFrame
+//-----------------------------------------------------------------------------
+// Sends the header of the frozen capture as a compressed frame and leaves the
+// payload to encodeFrame(). Returns false, without sending anything, when
+// compression would not make the frame smaller.
+
+boolean sendCompressedFrame( void )
+{
+	encodeBuffer = (uint8_t *)frozenBuffer;
+	encodeSize = captureSize;
+	encodeStop = frozenStopIndex;
+
+	// Dry run for the payload length
+	uint16_t length = 0;
+	uint8_t previous = 0;
+	for ( uint16_t position = 0; position < encodeSize; ) {
+		position += nextToken( position, previous );
+		length += tokenLength;
+		previous = encodeSample( position - 1 );
+		if ( length >= encodeSize ) return false;
+	}
+
+	uint8_t header[FRAMEHEADERMAX + 2];
+	uint8_t headerLength = buildFrameHeader( header, &encodeCrc );
+	header[1] = FRAMESYNCZ;
+	putWord( header + headerLength, length, &encodeCrc );
+	Serial.write( header, headerLength + 2 );
+
+	encodePosition = 0;
+	encodePrevious = 0;
+	tokenLength = 0;
+	encoding = true;
+	txBusy = true;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Packed frames
+//-----------------------------------------------------------------------------
+// A 10 or 12-bit capture keeps the 8 high bits of its samples in the capture
+// like an 8-bit one and their 2 or 4 low bits (lowBits) in a plane behind it,
+// four or two samples to a byte, the first one in the lowest bits. The
+// samples are sent in groups of as many, the high bytes of the group followed
+// by the byte with their low bits:
+//
+//	bits	group	bytes
+//	10	4	high 0..3, low bits 1..0 of sample 0 in bits 1..0, of
+//			sample 1 in bits 3..2, and so on
+//	12	2	high 0..1, low bits 3..0 of sample 0 in bits 3..0, of
+//			sample 1 in bits 7..4
+//
+// A sample is (high << lowBits) | low. Framed, the groups follow the header
+// of a framed frame with FRAMEPACKED set and are followed by the CRC of all
+// bytes after the sync word, as the samples of a plain framed frame are.
+//
+// The oldest sample is not at a group boundary of the plane, so the groups
+// are put together by packFrame() in the main loop, no more than fit into the
+// Serial TX buffer at a time.
+
+static boolean packing = false;
+static boolean packFramed;
+static uint8_t packBits;
+static uint8_t packGroup;
+
+//-----------------------------------------------------------------------------
+// sendPackedFrame
+//-----------------------------------------------------------------------------
+// Sends the header of the frozen 10 or 12-bit capture and leaves the samples
+// to packFrame().
+
+void sendPackedFrame( void )
+{
+	encodeBuffer = (uint8_t *)frozenBuffer;
+	encodeSize = captureSize;
+	encodeStop = frozenStopIndex;
+	packFramed = framed;
+	packBits = lowBits;
+	packGroup = 8 / packBits;
+
+	if (packFramed) {
+		uint8_t header[FRAMEHEADERMAX];
+		uint8_t headerLength = buildFrameHeader( header, &encodeCrc );
+		Serial.write( header, headerLength );
+	}
+
+	encodePosition = 0;
+	packing = true;
+	txBusy = true;
+}
+
+// Continues the packed frame in progress, never blocks. txBusy is cleared
+// when the last group, or the CRC, has been queued.
+static void packFrame( void )
+{
+	uint8_t perByte = ( packBits == 2 ) ? 2 : 1;
+	uint8_t mask = ( 1 << packBits ) - 1;
+	int room = Serial.availableForWrite();
+
+	while ( encodePosition < encodeSize ) {
+		if ( room < packGroup + 1 ) return;
+
+		uint8_t group[4 + 1];
+		uint8_t low = 0;
+		for ( uint8_t j = 0; j < packGroup; j++ ) {
+			uint16_t i = encodeIndex( encodePosition + j );
+			uint8_t plane = encodeBuffer[encodeSize + ( i >> perByte )];
+			uint8_t shift = ( i & ( packGroup - 1 ) ) * packBits;
+			group[j] = encodeBuffer[i];
+			low |= ( ( plane >> shift ) & mask ) << ( j * packBits );
+		}
+		group[packGroup] = low;
+
+		if (packFramed) {
+			for ( uint8_t j = 0; j <= packGroup; j++ ) {
+				encodeCrc = _crc_ccitt_update( encodeCrc, group[j] );
+			}
+		}
+		Serial.write( group, packGroup + 1 );
+		room -= packGroup + 1;
+		encodePosition += packGroup;
+	}
+
+	if (packFramed) {
+		if ( room < 2 ) return;
+
+		Serial.write( lowByte(encodeCrc) );
+		Serial.write( highByte(encodeCrc) );
+	}
+
+	packing = false;
+	txBusy = false;
+}
+
+//-----------------------------------------------------------------------------
+// encodeFrame
+//-----------------------------------------------------------------------------
+// Continues the compressed or packed frame in progress, never blocks. txBusy
+// is cleared when the CRC has been queued.
+
+void encodeFrame( void )
+{
+	if (packing) {
+		packFrame();
+		return;
+	}
+	if ( !encoding ) return;
+
+	int room = Serial.availableForWrite();
+
+	while ( encodePosition < encodeSize || tokenLength ) {
+		if ( !tokenLength ) {
+			encodePosition += nextToken( encodePosition, encodePrevious );
+			encodePrevious = encodeSample( encodePosition - 1 );
+		}
+		if ( tokenLength > room ) return;
+
+		for ( uint8_t i = 0; i < tokenLength; i++ ) {
+			encodeCrc = _crc_ccitt_update( encodeCrc, token[i] );
+		}
+		Serial.write( token, tokenLength );
+		room -= tokenLength;
+		tokenLength = 0;
+	}
+
+	if ( room < 2 ) return;
+
+	Serial.write( lowByte(encodeCrc) );
+	Serial.write( highByte(encodeCrc) );
+
+	encoding = false;
+	txBusy = false;
+}
@@ -0,0 +1,354 @@
+//-----------------------------------------------------------------------------
+// Arduino.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Host stand-in for the Arduino core and avr-libc headers the sketch uses.
+// Every register access goes to the simulated ATmega328P in host/sim, which
+// keeps its own clock: see device.h.
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+//-----------------------------------------------------------------------------
+// Types and constants of the core
+//-----------------------------------------------------------------------------
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define F_CPU	16000000UL
+
+#define HIGH	1
+#define LOW	0
+#define INPUT	0
+#define OUTPUT	1
+
+#define DEC	10
+#define HEX	16
+#define OCT	8
+#define BIN	2
+
+#define clockCyclesPerMicrosecond()	( F_CPU / 1000000L )
+#define lowByte(w)	( (uint8_t)( (w) & 0xFF ) )
+#define highByte(w)	( (uint8_t)( (w) >> 8 ) )
+
+#define PROGMEM
+#define pgm_read_byte(p)	( *(const uint8_t *)(p) )
+#define pgm_read_word(p)	( *(const uint16_t *)(p) )
+#define F(s)	(s)
+
+#define SERIAL_TX_BUFFER_SIZE	64
+#define SERIAL_RX_BUFFER_SIZE	64
+
+//-----------------------------------------------------------------------------
+// Registers
+//-----------------------------------------------------------------------------
+// A register is an object whose reads and writes are handled by the device,
+// so reading ADCSRA tells whether a conversion runs and writing a one to a
+// flag clears it, as on the chip.
+
+namespace sim {
+
+enum Register {
+	REG_SREG, REG_GPIOR0, REG_GPIOR1, REG_GPIOR2,
+	REG_ADCSRA, REG_ADCSRB, REG_ADMUX, REG_ADCL, REG_ADCH, REG_DIDR0,
+	REG_ACSR, REG_DIDR1,
+	REG_TCCR0A, REG_TCCR0B, REG_TCNT0, REG_OCR0A, REG_OCR0B, REG_TIMSK0, REG_TIFR0,
+	REG_TCCR1A, REG_TCCR1B, REG_TCCR1C, REG_TIMSK1, REG_TIFR1,
+	REG_TCCR2A, REG_TCCR2B, REG_TCNT2, REG_OCR2A, REG_OCR2B, REG_TIMSK2, REG_TIFR2,
+	REG_UCSR0A, REG_UCSR0B, REG_UCSR0C, REG_UBRR0L, REG_UBRR0H, REG_UDR0,
+	REG_PORTB, REG_DDRB, REG_PINB, REG_PORTD, REG_DDRD, REG_PIND,
+	REG_COUNT,
+
+	// 16-bit registers
+	REG_ADC = REG_COUNT, REG_TCNT1, REG_OCR1A, REG_OCR1B, REG_ICR1, REG_UBRR0
+};
+
+uint8_t readRegister( uint8_t reg );
+void writeRegister( uint8_t reg, uint8_t value );
+uint16_t readRegister16( uint8_t reg );
+void writeRegister16( uint8_t reg, uint16_t value );
+
+class Register8 {
+public:
+	explicit constexpr Register8( uint8_t reg ) : reg(reg) {}
+
+	// Assignments take the int of the expression and keep its low bits,
+	// as a store to a volatile uint8_t does
+	operator uint8_t() const { return readRegister( reg ); }
+	const Register8 &operator=( int value ) const { writeRegister( reg, value & 0xFF ); return *this; }
+	const Register8 &operator|=( int value ) const { return *this = *this | value; }
+	const Register8 &operator&=( int value ) const { return *this = *this & value; }
+	const Register8 &operator^=( int value ) const { return *this = *this ^ value; }
+
+private:
+	uint8_t reg;
+};
+
+class Register16 {
+public:
+	explicit constexpr Register16( uint8_t reg ) : reg(reg) {}
+
+	operator uint16_t() const { return readRegister16( reg ); }
+	const Register16 &operator=( long value ) const { writeRegister16( reg, value & 0xFFFF ); return *this; }
+	const Register16 &operator+=( long value ) const { return *this = *this + value; }
+	const Register16 &operator-=( long value ) const { return *this = *this - value; }
+
+private:
+	uint8_t reg;
+};
+
+} // namespace sim
+
+#define REGISTER8(name)		constexpr sim::Register8 name( sim::REG_##name );
+#define REGISTER16(name)	constexpr sim::Register16 name( sim::REG_##name );
+
+REGISTER8(SREG) REGISTER8(GPIOR0) REGISTER8(GPIOR1) REGISTER8(GPIOR2)
+REGISTER8(ADCSRA) REGISTER8(ADCSRB) REGISTER8(ADMUX) REGISTER8(ADCL) REGISTER8(ADCH)
+REGISTER8(DIDR0) REGISTER8(ACSR) REGISTER8(DIDR1)
+REGISTER8(TCCR0A) REGISTER8(TCCR0B) REGISTER8(TCNT0) REGISTER8(OCR0A) REGISTER8(OCR0B)
+REGISTER8(TIMSK0) REGISTER8(TIFR0)
+REGISTER8(TCCR1A) REGISTER8(TCCR1B) REGISTER8(TCCR1C) REGISTER8(TIMSK1) REGISTER8(TIFR1)
+REGISTER8(TCCR2A) REGISTER8(TCCR2B) REGISTER8(TCNT2) REGISTER8(OCR2A) REGISTER8(OCR2B)
+REGISTER8(TIMSK2) REGISTER8(TIFR2)
+REGISTER8(UCSR0A) REGISTER8(UCSR0B) REGISTER8(UCSR0C) REGISTER8(UBRR0L) REGISTER8(UBRR0H)
+REGISTER8(UDR0)
+REGISTER8(PORTB) REGISTER8(DDRB) REGISTER8(PINB) REGISTER8(PORTD) REGISTER8(DDRD) REGISTER8(PIND)
+REGISTER16(ADC) REGISTER16(TCNT1) REGISTER16(OCR1A) REGISTER16(OCR1B) REGISTER16(ICR1)
+REGISTER16(UBRR0)
+
+#undef REGISTER8
+#undef REGISTER16
+
+// Bits, as named in the ATmega328P datasheet
+#define SREG_I	7
+
+#define ADPS0	0
+#define ADPS1	1
+#define ADPS2	2
+#define ADIE	3
+#define ADIF	4
+#define ADATE	5
+#define ADSC	6
+#define ADEN	7
+
+#define ADTS0	0
+#define ADTS1	1
+#define ADTS2	2
+#define ACME	6
+
+#define MUX0	0
+#define MUX1	1
+#define MUX2	2
+#define MUX3	3
+#define ADLAR	5
+#define REFS0	6
+#define REFS1	7
+
+#define ADC0D	0
+#define ADC1D	1
+#define ADC2D	2
+#define ADC3D	3
+#define ADC4D	4
+#define ADC5D	5
+
+#define ACIS0	0
+#define ACIS1	1
+#define ACIC	2
+#define ACIE	3
+#define ACI	4
+#define ACO	5
+#define ACBG	6
+#define ACD	7
+
+#define AIN0D	0
+#define AIN1D	1
+
+#define WGM00	0
+#define WGM01	1
+#define CS00	0
+#define CS01	1
+#define CS02	2
+#define WGM02	3
+#define TOIE0	0
+#define OCIE0A	1
+#define OCIE0B	2
+#define TOV0	0
+#define OCF0A	1
+#define OCF0B	2
+
+#define WGM10	0
+#define WGM11	1
+#define COM1B0	4
+#define COM1B1	5
+#define COM1A0	6
+#define COM1A1	7
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define WGM12	3
+#define WGM13	4
+#define ICES1	6
+#define ICNC1	7
+#define TOIE1	0
+#define OCIE1A	1
+#define OCIE1B	2
+#define ICIE1	5
+#define TOV1	0
+#define OCF1A	1
+#define OCF1B	2
+#define ICF1	5
+
+#define WGM20	0
+#define WGM21	1
+#define COM2B0	4
+#define COM2B1	5
+#define COM2A0	6
+#define COM2A1	7
+#define CS20	0
+#define CS21	1
+#define CS22	2
+#define WGM22	3
+#define FOC2B	6
+#define FOC2A	7
+
+#define MPCM0	0
+#define U2X0	1
+#define UPE0	2
+#define DOR0	3
+#define FE0	4
+#define UDRE0	5
+#define TXC0	6
+#define RXC0	7
+#define TXB80	0
+#define RXB80	1
+#define UCSZ02	2
+#define TXEN0	3
+#define RXEN0	4
+#define UDRIE0	5
+#define TXCIE0	6
+#define RXCIE0	7
+#define UCSZ00	1
+#define UCSZ01	2
+
+#define _BV(bit)	( 1 << (bit) )
+#define _SFR_BYTE(sfr)	(sfr)
+#define bit_is_set(sfr, bit)	( (sfr) & _BV(bit) )
+#define bit_is_clear(sfr, bit)	( !( (sfr) & _BV(bit) ) )
+
+//-----------------------------------------------------------------------------
+// Interrupts
+//-----------------------------------------------------------------------------
+// ISR(vector) defines a plain function the device calls when the interrupt
+// is taken. Hand written assembly handlers (FASTISR) have no host build.
+
+#define ISR(vector, ...)	extern "C" void vector( void )
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+#define ADC_vect		sim_isr_adc
+#define ANALOG_COMP_vect	sim_isr_analog_comp
+#define TIMER0_COMPB_vect	sim_isr_timer0_compb
+#define TIMER1_CAPT_vect	sim_isr_timer1_capt
+#define TIMER1_COMPB_vect	sim_isr_timer1_compb
+#define USART_TX_vect		sim_isr_usart_tx
+
+namespace sim {
+void interrupts( boolean enable );
+}
+
+inline void sei( void ) { sim::interrupts( true ); }
+inline void cli( void ) { sim::interrupts( false ); }
+
+//-----------------------------------------------------------------------------
+// Core functions
+//-----------------------------------------------------------------------------
+
+unsigned long millis( void );
+unsigned long micros( void );
+void delay( unsigned long ms );
+void delayMicroseconds( unsigned int us );
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t value );
+int digitalRead( uint8_t pin );
+void analogWrite( uint8_t pin, int value );
+
+//-----------------------------------------------------------------------------
+// HardwareSerial
+//-----------------------------------------------------------------------------
+// The buffered USART driver of the core, on the simulated USART. Printing
+// follows Print: integers in the given base, no floats.
+
+class HardwareSerial {
+public:
+	void begin( unsigned long baud );
+	void end( void );
+	int available( void );
+	int availableForWrite( void );
+	int peek( void );
+	int read( void );
+	void flush( void );
+	operator bool() { return true; }
+
+	size_t write( uint8_t c );
+	size_t write( const uint8_t *buffer, size_t size );
+	size_t write( const char *s ) { return write( (const uint8_t *)s, strlen( s ) ); }
+
+	size_t print( const char *s ) { return write( s ); }
+	size_t print( char c ) { return write( (uint8_t)c ); }
+	size_t print( unsigned char n, int base = DEC ) { return printNumber( n, base ); }
+	size_t print( int n, int base = DEC ) { return printSigned( n, base ); }
+	size_t print( unsigned int n, int base = DEC ) { return printNumber( n, base ); }
+	size_t print( long n, int base = DEC ) { return printSigned( n, base ); }
+	size_t print( unsigned long n, int base = DEC ) { return printNumber( n, base ); }
+
+	template <class T> size_t println( T value ) { size_t n = print( value ); return n + println(); }
+	template <class T> size_t println( T value, int base ) { size_t n = print( value, base ); return n + println(); }
+	size_t println( void ) { return write( "\r\n" ); }
+
+	// The core's data register empty and receive handlers, and the
+	// state after power on
+	void udrEmptyInterrupt( void );
+	void rxCompleteInterrupt( void );
+	void reset( void );
+
+private:
+	size_t printSigned( long n, int base );
+	size_t printNumber( unsigned long n, int base );
+
+	volatile uint8_t rxHead = 0;
+	volatile uint8_t rxTail = 0;
+	volatile uint8_t txHead = 0;
+	volatile uint8_t txTail = 0;
+	boolean written = false;
+	uint8_t rxBuffer[SERIAL_RX_BUFFER_SIZE];
+	uint8_t txBuffer[SERIAL_TX_BUFFER_SIZE];
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,37 @@
+//-----------------------------------------------------------------------------
+// crc16.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// The C equivalent avr-libc gives for its _crc_ccitt_update().
+
+#ifndef UTIL_CRC16_H
+#define UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update( uint16_t crc, uint8_t data )
+{
+	data ^= crc & 0xFF;
+	data ^= data << 4;
+
+	return ( ( (uint16_t)data << 8 ) | ( crc >> 8 ) ) ^ (uint8_t)( data >> 4 ) ^ ( (uint16_t)data << 3 );
+}
+
+#endif
@@ -0,0 +1,409 @@
+//-----------------------------------------------------------------------------
+// avr_bench.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Benchmark of the firmware on a cycle accurate ATmega328P
+//-----------------------------------------------------------------------------
+// Runs the firmware as built for the board in simavr, one instruction at a
+// time, with a sawtooth on ADC0 and AIN0 and the threshold of thresholdPin
+// on AIN1:
+//
+//	avr_bench [--check] [--prescaler N] firmware.elf...
+//
+// For every ADC prescaler it sends f1;p<N>;e4;s; and reports, over
+// WINDOW seconds of continuous captures:
+//
+//	cycles		ADC ISR cycles from the vector to the end of reti,
+//			average and most
+//	latency		cycles from ADIF to the vector, most; it holds the
+//			interrupt response, other ISRs and cli() in loop()
+//	lost		conversions that completed while ADIF was still set,
+//			from the conversion grid of 13 ADC cycles
+//	frames/s	frames received from the USART
+//
+// then the highest rate without a lost conversion, the ADC ISR at prescaler
+// 32 in the 10-bit, oversampling, ping-pong and roll modes, and the
+// comparator trigger at prescaler 32 with e3 (cycles and latency of the
+// ANALOG_COMP ISR). The ISRs are found by the program counter: a run starts when it
+// reaches a vector and ends with the reti of the same depth, so no
+// instrumentation is needed and the FASTISR handler is measured as well.
+// --check exits non-zero when a firmware loses a conversion at --prescaler
+// (16 by default) or any slower one, or in one of the modes.
+
+#include "stream.h"
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_adc.h>
+#include <simavr/avr_uart.h>
+#if __has_include(<simavr/avr_acomp.h>)
+#include <simavr/avr_acomp.h>
+#define HAVE_ACOMP 1
+#else
+#define HAVE_ACOMP 0
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const uint32_t CLOCK = 16000000;
+static const double WINDOW = 0.25;		// seconds measured per setting
+static const double SETTLE = 0.05;		// seconds before, for boot and commands
+static const uint32_t INPUTSTEP = 32;		// cycles between input updates
+static const double SAWTOOTH = 500;		// Hz
+
+// ATmega328P data space addresses and vectors
+static const uint16_t ACSR = 0x50;
+static const uint16_t ADCSRA = 0x7A;
+static const uint16_t ADCSRB = 0x7B;
+static const uint16_t OCR2B = 0xB4;
+static const uint8_t ADEN = 0x80;
+static const uint8_t ADATE = 0x20;
+static const uint8_t ADIF = 0x10;
+static const uint8_t ACI = 0x10;
+static const uint8_t VECTOR_ADC = 21;
+static const uint8_t VECTOR_ANALOG_COMP = 23;
+static const uint8_t VECTORS = 26;
+static const uint16_t RETI = 0x9518;
+
+static bool check = false;
+static int failures = 0;
+
+static void verify( bool ok, const char *name, const char *what )
+{
+	if ( ok || !check ) return;
+	printf( "  FAIL %s: %s\n", name, what );
+	failures++;
+}
+
+struct IsrStats {
+	uint64_t runs = 0;
+	uint64_t cycles = 0;
+	uint64_t maxCycles = 0;
+	uint64_t maxLatency = 0;
+};
+
+struct Result {
+	IsrStats isr[VECTORS];
+	uint64_t lost = 0;
+	uint64_t conversions = 0;
+	unsigned frames = 0;
+};
+
+//-----------------------------------------------------------------------------
+// The board
+//-----------------------------------------------------------------------------
+
+class Board {
+public:
+	explicit Board( const elf_firmware_t &firmware );
+	~Board( void ) { avr_terminate( avr ); }
+
+	void send( const std::string &text );
+	// Runs for seconds, measuring when result is set
+	bool run( double seconds, Result *result );
+
+	scope::StreamReader reader;
+
+private:
+	static void output( struct avr_irq_t *irq, uint32_t value, void *param );
+	void updateInputs( void );
+	void step( Result *result );
+
+	avr_t *avr;
+	avr_irq_t *adcInput;
+	avr_irq_t *signalInput;
+	avr_irq_t *thresholdInput;
+	avr_irq_t *uartInput;
+	uint64_t lastInput = 0;
+
+	// ISRs running, innermost last, with the cycle they started at
+	struct Running { uint8_t vector; uint64_t start; };
+	std::vector<Running> running;
+
+	// Cycle each interrupt flag rose at, 0 when it is clear
+	uint64_t adcRaised = 0;
+	uint64_t acRaised = 0;
+	// Conversion grid, from the last completion seen
+	uint64_t lastCompletion = 0;
+};
+
+Board::Board( const elf_firmware_t &firmware )
+{
+	avr = avr_make_mcu_by_name( "atmega328p" );
+	if ( !avr ) {
+		fprintf( stderr, "simavr has no atmega328p\n" );
+		exit( 1 );
+	}
+	avr_init( avr );
+	avr->frequency = CLOCK;
+	avr->vcc = avr->avcc = avr->aref = 5000;
+	avr_load_firmware( avr, (elf_firmware_t *)&firmware );
+
+	adcInput = avr_io_getirq( avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 );
+	#if HAVE_ACOMP
+	signalInput = avr_io_getirq( avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN0 );
+	thresholdInput = avr_io_getirq( avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN1 );
+	#else
+	signalInput = thresholdInput = nullptr;
+	#endif
+
+	// The USART talks to the bench only
+	uint32_t flags = 0;
+	avr_ioctl( avr, AVR_IOCTL_UART_GET_FLAGS( '0' ), &flags );
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl( avr, AVR_IOCTL_UART_SET_FLAGS( '0' ), &flags );
+	uartInput = avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( '0' ), UART_IRQ_INPUT );
+	avr_irq_register_notify( avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( '0' ), UART_IRQ_OUTPUT ),
+		output, this );
+
+	updateInputs();
+}
+
+void Board::output( struct avr_irq_t *, uint32_t value, void *param )
+{
+	uint8_t byte = value;
+	( (Board *)param )->reader.feed( &byte, 1 );
+}
+
+void Board::send( const std::string &text )
+{
+	for ( char c : text ) avr_raise_irq( uartInput, (uint8_t)c );
+}
+
+// A sawtooth from 0.5 V to 4.5 V, and the threshold the PWM of thresholdPin
+// (OC2B) filters to
+void Board::updateInputs( void )
+{
+	double t = (double)avr->cycle / CLOCK;
+	double phase = t * SAWTOOTH - (uint64_t)( t * SAWTOOTH );
+	uint32_t millivolts = 500 + 4000 * phase;
+
+	avr_raise_irq( adcInput, millivolts );
+	if (signalInput) {
+		avr_raise_irq( signalInput, millivolts );
+		avr_raise_irq( thresholdInput, avr->data[OCR2B] * 5000 / 255 );
+	}
+	lastInput = avr->cycle;
+}
+
+// One instruction, and the interrupts it ends with
+void Board::step( Result *result )
+{
+	uint16_t opcode = avr->flash[avr->pc] | avr->flash[avr->pc + 1] << 8;
+	bool leaving = ( opcode == RETI );
+
+	avr_run( avr );
+	uint64_t now = avr->cycle;
+
+	if ( leaving && !running.empty() ) {
+		Running done = running.back();
+		running.pop_back();
+		if (result) {
+			IsrStats &isr = result->isr[done.vector];
+			uint64_t cycles = now - done.start;
+			isr.runs++;
+			isr.cycles += cycles;
+			if ( cycles > isr.maxCycles ) isr.maxCycles = cycles;
+		}
+	}
+
+	// A vector is two words, the interrupt response leaves the PC on it
+	if ( avr->pc < VECTORS * 4 && ( avr->pc & 3 ) == 0 && avr->pc > 0 ) {
+		uint8_t vector = avr->pc / 4;
+		running.push_back( { vector, now } );
+		uint64_t raised = vector == VECTOR_ADC ? adcRaised : vector == VECTOR_ANALOG_COMP ? acRaised : 0;
+		if ( result && raised && now - raised > result->isr[vector].maxLatency ) {
+			result->isr[vector].maxLatency = now - raised;
+		}
+	}
+
+	// Flags: a rise is a completed conversion or a comparator edge
+	uint8_t adcsra = avr->data[ADCSRA];
+	bool freeRunning = ( adcsra & ADEN ) && ( adcsra & ADATE ) && ( avr->data[ADCSRB] & 0x07 ) == 0;
+	if ( !freeRunning ) lastCompletion = 0;
+
+	if ( adcsra & ADIF ) {
+		if ( !adcRaised ) {
+			adcRaised = now;
+			// Conversions that completed while the flag was set are on
+			// the grid between this one and the last
+			uint8_t adps = adcsra & 0x07;
+			uint64_t period = 13u << ( adps ? adps : 1 );
+			if ( result && lastCompletion ) {
+				uint64_t conversions = ( now - lastCompletion + period / 2 ) / period;
+				result->conversions += conversions;
+				if ( conversions > 1 ) result->lost += conversions - 1;
+			}
+			if (freeRunning) lastCompletion = now;
+		}
+	}
+	else {
+		adcRaised = 0;
+	}
+	if ( avr->data[ACSR] & ACI ) {
+		if ( !acRaised ) acRaised = now;
+	}
+	else {
+		acRaised = 0;
+	}
+
+	if ( now - lastInput >= INPUTSTEP ) updateInputs();
+}
+
+bool Board::run( double seconds, Result *result )
+{
+	uint64_t end = avr->cycle + (uint64_t)( seconds * CLOCK );
+	while ( avr->cycle < end ) {
+		if ( avr->state == cpu_Done || avr->state == cpu_Crashed ) return false;
+		step( result );
+	}
+	if (result) {
+		scope::Record record;
+		while ( reader.next( record ) ) {
+			scope::Frame frame;
+			if ( scope::decodeFrame( record, frame ) ) result->frames++;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Runs
+//-----------------------------------------------------------------------------
+
+static bool measure( const elf_firmware_t &firmware, const std::string &commands, Result &result )
+{
+	Board board( firmware );
+	if ( !board.run( SETTLE, nullptr ) ) return false;
+	board.send( commands );
+	if ( !board.run( SETTLE, nullptr ) ) return false;
+	// Frames begun before the window are not counted
+	scope::Record record;
+	while ( board.reader.next( record ) ) {}
+	return board.run( WINDOW, &result );
+}
+
+static int runFirmware( const char *path, unsigned minPrescaler )
+{
+	elf_firmware_t firmware;
+	memset( &firmware, 0, sizeof(firmware) );
+	if ( elf_read_firmware( path, &firmware ) != 0 ) {
+		fprintf( stderr, "%s: can not read\n", path );
+		return 1;
+	}
+
+	printf( "%s\n", path );
+	printf( "  %-6s %8s %10s %10s %10s %8s %10s\n", "", "kS/s", "ISR avg", "ISR max",
+		"latency", "lost", "frames/s" );
+
+	unsigned fastest = 0;
+	for ( unsigned p = 128; p >= 2; p /= 2 ) {
+		Result result;
+		std::string commands = "f1;p" + std::to_string( p ) + ";e4;s;";
+		if ( !measure( firmware, commands, result ) ) {
+			printf( "  p%-5u crashed\n", p );
+			verify( p < minPrescaler, path, "firmware crashed" );
+			continue;
+		}
+		const IsrStats &adc = result.isr[VECTOR_ADC];
+		printf( "  p%-5u %8.1f %10.1f %10llu %10llu %8llu %10.1f\n", p, CLOCK / 13.0 / p / 1000,
+			adc.runs ? (double)adc.cycles / adc.runs : 0.0, (unsigned long long)adc.maxCycles,
+			(unsigned long long)adc.maxLatency, (unsigned long long)result.lost, result.frames / WINDOW );
+
+		bool clean = result.lost == 0 && result.frames > 0;
+		if ( clean && ( fastest == 0 || fastest == p * 2 ) ) fastest = p;
+		if ( p >= minPrescaler ) {
+			verify( clean, path, ( "lost conversions at p" + std::to_string( p ) ).c_str() );
+		}
+	}
+	if (fastest) {
+		printf( "  every conversion captured down to p%u, %.1f kS/s\n", fastest, CLOCK / 13.0 / fastest / 1000 );
+	}
+	else {
+		printf( "  conversions lost at every prescaler\n" );
+	}
+
+	// The ISR per conversion in the modes that do more than store it
+	static const struct { const char *name; const char *commands; } modes[] = {
+		{ "10 bit", "f1;l10;p32;e4;s;" },
+		{ "o1", "f1;l10;o1;p32;e4;s;" },
+		{ "o2", "f1;l10;o2;p32;e4;s;" },
+		{ "ping-pong", "f1;m1;p32;e4;s;" },
+		{ "roll", "f1;p32;e5;" },
+	};
+	for ( const auto &mode : modes ) {
+		Result result;
+		if ( !measure( firmware, mode.commands, result ) ) {
+			printf( "  %-10s crashed\n", mode.name );
+			verify( false, path, "firmware crashed" );
+			continue;
+		}
+		const IsrStats &adc = result.isr[VECTOR_ADC];
+		printf( "  %-10s ISR %.1f avg %llu max cycles, %llu lost at p32\n", mode.name,
+			adc.runs ? (double)adc.cycles / adc.runs : 0.0, (unsigned long long)adc.maxCycles,
+			(unsigned long long)result.lost );
+		verify( result.lost == 0, path, ( std::string( "lost conversions with " ) + mode.name ).c_str() );
+	}
+
+	// The comparator trigger on the sawtooth
+	Result result;
+	if ( HAVE_ACOMP && measure( firmware, "f1;p32;e3;t128;s;", result ) ) {
+		const IsrStats &ac = result.isr[VECTOR_ANALOG_COMP];
+		printf( "  comparator: %llu triggers, ISR %.1f avg %llu max cycles, latency %llu, %.1f frames/s\n",
+			(unsigned long long)ac.runs, ac.runs ? (double)ac.cycles / ac.runs : 0.0,
+			(unsigned long long)ac.maxCycles, (unsigned long long)ac.maxLatency, result.frames / WINDOW );
+		verify( ac.runs > 0, path, "the comparator did not trigger" );
+	}
+	else if ( !HAVE_ACOMP ) {
+		printf( "  comparator: this simavr has no analog comparator\n" );
+	}
+	return 0;
+}
+
+int main( int argc, char **argv )
+{
+	unsigned minPrescaler = 16;
+	std::vector<const char *> firmwares;
+
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !strcmp( argv[i], "--check" ) ) check = true;
+		else if ( !strcmp( argv[i], "--prescaler" ) && i + 1 < argc ) minPrescaler = atoi( argv[++i] );
+		else firmwares.push_back( argv[i] );
+	}
+	if ( firmwares.empty() ) {
+		fprintf( stderr, "usage: avr_bench [--check] [--prescaler N] firmware.elf...\n" );
+		return 1;
+	}
+
+	for ( const char *firmware : firmwares ) {
+		if ( runFirmware( firmware, minPrescaler ) ) return 1;
+	}
+
+	if ( check && failures ) {
+		printf( "%d failed\n", failures );
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,259 @@
+//-----------------------------------------------------------------------------
+// capture_bench.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Throughput of the capture service
+//-----------------------------------------------------------------------------
+// A pseudo-terminal stands in for the board: a thread writes a stream of
+// 1024 sample frames, with a text reply now and then, into the master side
+// as fast as the terminal takes it, and the pipeline of scope_capture reads
+// the slave side: LinkReader, the broadcast ring, the recorder and a second
+// consumer that decodes every frame. Meanwhile a spinning thread per CPU
+// keeps the host busy. Reports, in wall clock time:
+//
+//	throughput	bytes and frames per second through the pipeline, and
+//			the multiple of the 2 Mbaud link, the fastest the
+//			scope sends at (200 kB/s)
+//	losses		sequence gaps, records lost to the ring, bytes outside
+//			records other than the text replies, and frames missing
+//			from the recording
+//	replay		random access reads of the recording per second
+//
+// --check exits non-zero when anything is lost or the throughput is less
+// than LINKMARGIN times the link.
+
+#include "link.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const unsigned FRAMES = 4000;
+static const uint16_t SAMPLES = 1024;
+static const unsigned REPLYEVERY = 100;	// frames between text replies
+static const double LINKRATE = 200000;	// bytes/s at 2 Mbaud
+static const double LINKMARGIN = 4;
+
+static bool check = false;
+static int failures = 0;
+
+static void verify( bool ok, const char *what )
+{
+	if ( ok || !check ) return;
+	printf( "  FAIL %s\n", what );
+	failures++;
+}
+
+static double now( void )
+{
+	using namespace std::chrono;
+	return duration_cast<duration<double>>( steady_clock::now().time_since_epoch() ).count();
+}
+
+// The stream the board would send: frames with a sine and their sequence
+// numbers, and a text reply every REPLYEVERY frames. Returns the bytes of
+// the replies.
+static size_t boardStream( std::vector<uint8_t> &stream )
+{
+	const char *reply = "Baud rate: 2000000\r\n";
+	size_t replies = 0;
+
+	for ( unsigned n = 0; n < FRAMES; n++ ) {
+		if ( n % REPLYEVERY == REPLYEVERY - 1 ) {
+			stream.insert( stream.end(), reply, reply + strlen( reply ) );
+			replies += strlen( reply );
+		}
+
+		size_t start = stream.size();
+		uint8_t header[12] = { scope::SYNC, scope::RECORD_FRAME,
+			(uint8_t)n, (uint8_t)( n >> 8 ), 0, 1, 0, 1, 32, 4,
+			(uint8_t)SAMPLES, (uint8_t)( SAMPLES >> 8 ) };
+		stream.insert( stream.end(), header, header + sizeof(header) );
+		for ( uint16_t i = 0; i < SAMPLES; i++ ) {
+			stream.push_back( 128 + 100 * sin( 2 * M_PI * ( i + n ) / 97.0 ) );
+		}
+		uint16_t crc = scope::crc16( stream.data() + start + 2, stream.size() - start - 2 );
+		stream.push_back( crc & 0xFF );
+		stream.push_back( crc >> 8 );
+	}
+	return replies;
+}
+
+int main( int argc, char **argv )
+{
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !strcmp( argv[i], "--check" ) ) check = true;
+	}
+
+	std::vector<uint8_t> stream;
+	size_t replies = boardStream( stream );
+
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if ( master < 0 || grantpt( master ) < 0 || unlockpt( master ) < 0 ) {
+		perror( "posix_openpt" );
+		return 1;
+	}
+	int fd = scope::openLink( ptsname( master ), 2000000 );
+	if ( fd < 0 ) {
+		perror( ptsname( master ) );
+		return 1;
+	}
+
+	char directory[] = "/tmp/capture_bench.XXXXXX";
+	if ( !mkdtemp( directory ) ) {
+		perror( "mkdtemp" );
+		return 1;
+	}
+	std::string path = std::string( directory ) + "/bench.rec";
+	scope::RecordingWriter writer;
+	if ( !writer.create( path ) ) {
+		perror( path.c_str() );
+		return 1;
+	}
+
+	scope::BroadcastRing ring( 1024, scope::RECORDMAX );
+	scope::LinkReader link( fd, ring );
+	scope::BroadcastRing::Cursor recorderCursor = ring.subscribe();
+	scope::BroadcastRing::Cursor checkerCursor = ring.subscribe();
+
+	// The busy host
+	std::atomic<bool> busy { true };
+	std::vector<std::thread> spinners;
+	unsigned cpus = std::thread::hardware_concurrency();
+	for ( unsigned i = 0; i < ( cpus ? cpus : 1 ); i++ ) {
+		spinners.emplace_back( [&]() {
+			volatile uint64_t x = 0;
+			while ( busy.load( std::memory_order_relaxed ) ) x++;
+		} );
+	}
+
+	bool recorded = true;
+	std::thread recorder( [&]() { recorded = scope::recordRing( ring, recorderCursor, writer ); } );
+
+	// Decodes every frame and follows the sequence numbers
+	std::atomic<unsigned> frames { 0 };
+	unsigned gaps = 0;
+	double last = 0;
+	std::thread checker( [&]() {
+		scope::Record record;
+		scope::Frame frame;
+		int expected = 0;
+		scope::BroadcastRing::Result result;
+		while ( ( result = ring.wait( checkerCursor, record, 100 ) ) != scope::BroadcastRing::CLOSED ) {
+			if ( result != scope::BroadcastRing::READ ) continue;
+			if ( !scope::decodeFrame( record, frame ) || frame.samples.size() != SAMPLES ) continue;
+			if ( frame.sequence != expected ) gaps++;
+			expected = frame.sequence + 1;
+			last = now();
+			frames.fetch_add( 1 );
+		}
+	} );
+
+	std::thread reader( [&]() { link.run(); } );
+
+	// The board, in blocks of what a USB serial adapter hands over
+	double start = now();
+	std::thread board( [&]() {
+		for ( size_t i = 0; i < stream.size(); ) {
+			ssize_t n = write( master, stream.data() + i, std::min<size_t>( 4096, stream.size() - i ) );
+			if ( n <= 0 ) break;
+			i += n;
+		}
+	} );
+	board.join();
+
+	// Until the last frame is through, or nothing came for a second
+	unsigned seen = 0;
+	double quiet = now();
+	while ( frames.load() < FRAMES && now() - quiet < 1.0 ) {
+		if ( frames.load() != seen ) {
+			seen = frames.load();
+			quiet = now();
+		}
+		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+	}
+
+	link.stop();
+	reader.join();
+	checker.join();
+	recorder.join();
+	busy.store( false );
+	for ( std::thread &spinner : spinners ) spinner.join();
+	recorded = writer.close() && recorded;
+	close( fd );
+	close( master );
+
+	double seconds = last - start;
+	double rate = link.bytes() / seconds;
+	printf( "Capture through a pseudo-terminal, %u frames of %u samples, %u busy threads\n",
+		FRAMES, SAMPLES, (unsigned)spinners.size() );
+	printf( "  %.1f MB/s, %.0f frames/s, %.0f times the 2 Mbaud link\n",
+		rate / 1e6, frames.load() / seconds, rate / LINKRATE );
+	printf( "  %u frames, %u sequence gaps, %llu records lost to the ring, %lld stray bytes\n",
+		frames.load(), gaps, (unsigned long long)( recorderCursor.dropped + checkerCursor.dropped ),
+		(long long)link.skippedBytes() - (long long)replies );
+
+	verify( frames.load() == FRAMES && gaps == 0, "frames lost" );
+	verify( recorderCursor.dropped + checkerCursor.dropped == 0, "records lost to the ring" );
+	verify( link.skippedBytes() == replies, "bytes outside records" );
+	verify( rate >= LINKMARGIN * LINKRATE, "throughput below the link margin" );
+
+	// Random access replay of the recording
+	scope::RecordingReader recording;
+	if ( !recorded || !recording.open( path ) ) {
+		perror( path.c_str() );
+		return 1;
+	}
+	printf( "  %zu records, %.1f MB recorded\n", recording.records(), writer.bytes() / 1e6 );
+	verify( recording.records() == FRAMES, "frames missing from the recording" );
+
+	std::mt19937 random( 1 );
+	unsigned reads = 200000;
+	unsigned wrong = 0;
+	double replayStart = now();
+	for ( unsigned i = 0; i < reads && recording.records(); i++ ) {
+		size_t n = random() % recording.records();
+		scope::Frame frame;
+		if ( !scope::decodeFrame( recording.record( n ), frame ) || frame.sequence != (uint16_t)n ) wrong++;
+	}
+	double replaySeconds = now() - replayStart;
+	printf( "Replay, random access\n" );
+	printf( "  %.0f frames/s decoded, %u wrong\n", reads / replaySeconds, wrong );
+	verify( wrong == 0, "replayed frames do not match" );
+
+	recording.close();
+	unlink( path.c_str() );
+	unlink( ( path + ".idx" ).c_str() );
+	rmdir( directory );
+
+	if ( check && failures ) {
+		printf( "%d failed\n", failures );
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,568 @@
+//-----------------------------------------------------------------------------
+// scope_bench.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Benchmark of the sketch on the simulated device
+//-----------------------------------------------------------------------------
+// Reports, in simulated time at 500 kbaud:
+//
+//	frames/s	records received per second for a set of modes, with
+//			the link use and the bytes per record
+//	dead time	blind gap between the captures of two frames, single
+//			and ping-pong at p64 and p16
+//	link		time on the wire over the send time of the frames at
+//			500 k, 1 M and 2 Mbaud
+//	trigger		position of the trigger in the frames against the
+//			threshold crossing in their samples, for the comparator
+//			and the digital trigger
+//	compression	ratio of the plain to the compressed frame size and
+//			frames/s of f2 for a sine, a square, noise and DC
+//	resolution	samples/s and link bytes per sample of 8, 10 and 12-bit
+//			frames, and the host unpacker's speed (wall clock)
+//	latency		command round trip, from the last byte of d sent to the
+//			first byte of the reply, on an idle and on a busy link
+//
+// The simulation is deterministic, so the figures only change with the
+// sketch. --check exits non-zero when a figure is outside the bounds the
+// sketch is meant to meet (no CRC errors, a busy link, the trigger within
+// two samples, the reply within a frame time).
+
+#include "scenario.h"
+#include "small-scope.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// The figures are for CONFIG_UNO; the captures and frames of larger buffers
+// take as much longer, which scales the bounds and the run times
+static const double CAPTURESCALE = ADCBUFFERSIZE > 1024 ? ADCBUFFERSIZE / 1024.0 : 1.0;
+
+static bool check = false;
+static int failures = 0;
+
+static void verify( bool ok, const char *name, const char *what )
+{
+	if ( ok || !check ) return;
+	printf( "  FAIL %s: %s\n", name, what );
+	failures++;
+}
+
+// Bytes between the records after the first one, which the reader may
+// have joined in the middle of a record
+static uint64_t strayBytes( const sim::Receiver &receiver, const std::vector<scope::Record> &records,
+	size_t origin )
+{
+	if ( records.empty() ) return 0;
+	return receiver.reader.skippedBytes() - ( records[0].offset - origin );
+}
+
+static sim::Signal sine( double frequency, double amplitude, double offset = 2.5 )
+{
+	return [=]( double t ) { return offset + amplitude * sin( 2 * M_PI * frequency * t ); };
+}
+
+//-----------------------------------------------------------------------------
+// Frames per second
+//-----------------------------------------------------------------------------
+
+// A single capture is sent when it is complete and the next one is armed
+// when it has been sent, so the frame rate is one over the capture time plus
+// the send time: 13 ms and 21 ms for 1024 samples at p16. The bounds are
+// that, less a tenth.
+
+struct Mode {
+	const char *name;
+	const char *commands;
+	double frequency;	// input sine
+	double minimum;		// least records per second with --check
+};
+
+static const Mode modes[] = {
+	{ "framed p16 continuous",	"f1;p16;e4;s;",		1000,	25 },
+	{ "framed p128 continuous",	"f1;p128;e4;s;",	100,	7 },
+	{ "framed p16 rising 1 kHz",	"f1;p16;e3;t128;s;",	1000,	24 },
+	{ "ping-pong p64",		"f1;m1;p64;e4;s;",	100,	33 },
+	{ "compressed p64 100 Hz",	"f2;p64;e4;s;",		100,	14 },
+	{ "10-bit p128",		"f1;l10;p128;e4;s;",	100,	13 },
+	{ "view 100 p16",		"f1;<50;>50;p16;e4;s;",	1000,	56 },
+	{ "spectrum 16-bit p32",	"f4;p32;e4;s;",		2000,	23 },
+	{ "meter p32",			"f3;p32;e4;s;",		2000,	34 },
+};
+
+static int framesPerSecond( const Mode &mode, double seconds )
+{
+	sim::boot();
+	sim::setInput( 0, sine( mode.frequency, 2.0 ) );
+	sim::command( mode.commands );
+	sim::run( sim::cycles( 0.1 ) );
+
+	seconds *= CAPTURESCALE;
+	size_t origin = sim::link().bytes.size();
+	sim::Receiver receiver;
+	sim::run( sim::cycles( seconds ) );
+	std::vector<scope::Record> &records = receiver.poll();
+
+	size_t bytes = 0;
+	for ( const scope::Record &record : records ) bytes += record.bytes.size();
+
+	double rate = records.size() / seconds;
+	double busy = ( sim::link().bytes.size() - origin ) * 10.0 / sim::hostBaud() / seconds;
+
+	printf( "  %-28s %8.1f /s %7.0f B %6.1f %% link\n", mode.name, rate,
+		records.empty() ? 0.0 : (double)bytes / records.size(), 100 * busy );
+
+	verify( rate >= mode.minimum / CAPTURESCALE, mode.name, "frame rate below the bound" );
+	verify( strayBytes( receiver, records, origin ) == 0, mode.name, "bytes outside records" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// Dead time
+//-----------------------------------------------------------------------------
+// The blind gap between two frames: from the sample and hold of the last
+// sample of one frame to that of the first sample of the next, less one
+// sample interval, so frames of back to back samples have none. The frames
+// are found in the conversion log by their samples, for which the input
+// carries a ripple that makes every run of samples unique.
+
+static double ripple( double t )
+{
+	uint32_t x = (uint32_t)( t * 1e6 ) * 2654435761u;
+	return ( ( x >> 24 ) - 128 ) * 0.002;
+}
+
+// Mean dead time per frame in cycles, negative when too few frames were
+// found in the conversions
+static double deadTime( const char *name, const char *commands, double seconds )
+{
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 1.5 * sin( 2 * M_PI * 700 * t ) + ripple( t ); } );
+	sim::logConversions( true );
+	sim::command( commands );
+	sim::run( sim::cycles( 0.05 ) );
+
+	sim::Receiver receiver;
+	sim::run( sim::cycles( seconds * CAPTURESCALE ) );
+	const std::vector<sim::Conversion> &log = sim::conversions();
+
+	// First and last conversion of every frame
+	std::vector<std::pair<size_t, size_t>> spans;
+	size_t from = 0;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		if ( !scope::decodeFrame( record, frame ) || frame.samples.empty() ) continue;
+
+		size_t n = frame.samples.size();
+		for ( size_t i = from; i + n <= log.size(); i++ ) {
+			size_t k = 0;
+			while ( k < n && frame.samples[k] == log[i + k].code >> 2 ) k++;
+			if ( k == n ) {
+				spans.push_back( { i, i + n - 1 } );
+				from = i + n;
+				break;
+			}
+		}
+	}
+
+	size_t gaps = spans.size() > 1 ? spans.size() - 1 : 0;
+	double sum = 0;
+	double interval = 0;
+	for ( size_t n = 1; n < spans.size(); n++ ) {
+		size_t last = spans[n - 1].second;
+		interval = log[last].sampled - log[last - 1].sampled;
+		sum += log[spans[n].first].sampled - log[last].sampled - interval;
+	}
+	double mean = gaps ? sum / gaps : 0;
+
+	printf( "  %-28s %8.2f ms %7.1f samples per frame, %zu frames\n", name,
+		mean / sim::CLOCK * 1000, interval > 0 ? mean / interval : 0.0, spans.size() );
+
+	verify( gaps >= 10, name, "too few frames found in the conversions" );
+	return gaps >= 10 ? mean : -1;
+}
+
+static int deadTimes( int prescaler, double seconds )
+{
+	std::string p = "p" + std::to_string( prescaler );
+	double single = deadTime( ( "single " + p ).c_str(), ( "f1;" + p + ";e4;s;" ).c_str(), seconds );
+	double pingPong = deadTime( ( "ping-pong " + p ).c_str(), ( "f1;m1;" + p + ";e4;s;" ).c_str(), seconds );
+	verify( single >= 0 && pingPong >= 0 && pingPong < single, "ping-pong", "no less dead time than single" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// Link utilisation
+//-----------------------------------------------------------------------------
+// Time on the wire over the time a frame takes to send, from the start bit
+// of its first byte to the stop bit of its last one. The transmit engine
+// loads two bytes per Transmit Complete interrupt, so the line is idle for
+// the interrupt latency once every two bytes; the captures in between do
+// not count.
+
+static const uint8_t linkPattern[] = {
+	0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC,
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+};
+
+// Runs the self-test of z at rate, true when the scope kept it
+static bool switchBaud( uint32_t rate )
+{
+	size_t from = sim::link().bytes.size();
+	sim::command( "z" + std::to_string( rate ) + ";" );
+	if ( !sim::runUntil( [&]() { return sim::find( "\r\n", from ) >= 0; }, sim::cycles( 0.1 ) ) ) return false;
+	sim::setHostBaud( rate );
+
+	from = sim::link().bytes.size();
+	sim::hostSend( linkPattern, sizeof(linkPattern) );
+	if ( !sim::runUntil( [&]() {
+		return sim::link().bytes.size() >= from + 2 + sizeof(linkPattern);
+	}, sim::cycles( 0.1 ) ) ) return false;
+
+	from = sim::link().bytes.size();
+	sim::hostSend( linkPattern, sizeof(linkPattern) );
+	std::string confirmation = "Baud rate: " + std::to_string( rate ) + "\r\n";
+	return sim::runUntil( [&]() { return sim::find( confirmation, from ) >= 0; }, sim::cycles( 0.1 ) );
+}
+
+static int linkUtilisation( uint32_t rate, double minimum, double seconds )
+{
+	sim::boot();
+	sim::setInput( 0, sine( 1000, 2.0 ) );
+	bool switched = rate == BAUDRATE || switchBaud( rate );
+	sim::command( "f1;p16;e4;s;" );
+	sim::run( sim::cycles( 0.1 ) );
+
+	sim::Receiver receiver;
+	sim::run( sim::cycles( seconds * CAPTURESCALE ) );
+
+	double byteCycles = 10.0 * sim::CLOCK / rate;
+	double wire = 0;
+	double span = 0;
+	std::vector<scope::Record> &records = receiver.poll();
+	for ( const scope::Record &record : records ) {
+		wire += record.bytes.size() * byteCycles;
+		span += receiver.endTime( record ) - ( sim::link().times[record.offset] - byteCycles );
+	}
+	double utilisation = span > 0 ? wire / span : 0;
+
+	printf( "  %-28s %8.1f %% %6.2f ms/frame, %zu frames\n", ( std::to_string( rate / 1000 ) + " kbaud" ).c_str(),
+		100 * utilisation, records.empty() ? 0.0 : span / records.size() / sim::CLOCK * 1000, records.size() );
+
+	verify( switched, "link", "baud rate not switched" );
+	verify( !records.empty(), "link", "no frames" );
+	verify( utilisation >= minimum, "link", "utilisation below the bound" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// Compression
+//-----------------------------------------------------------------------------
+// f2 at p64 on four inputs. The ratio is samples over payload bytes, so it
+// does not depend on the buffer size; noise does not compress and is sent as
+// plain frames, whose payload is the samples.
+
+struct Waveform {
+	const char *name;
+	sim::Signal signal;
+	double minimum;		// least ratio with --check
+};
+
+static double noise( double t )
+{
+	uint32_t x = (uint32_t)( t * 1e6 ) * 2654435761u;
+	x ^= x >> 15;
+	return ( x & 0xFFFF ) * ( 5.0 / 65536 );
+}
+
+static const Waveform waveforms[] = {
+	{ "sine 100 Hz",	sine( 100, 2.0 ),					1.7 },
+	{ "square 100 Hz",	[]( double t ) { return fmod( t * 100, 1.0 ) < 0.5 ? 0.5 : 4.5; },	15 },
+	{ "noise",		noise,							1.0 },
+	{ "DC",			[]( double ) { return 2.5; },				25 },
+};
+
+static int compression( const Waveform &waveform, double seconds )
+{
+	sim::boot();
+	sim::setInput( 0, waveform.signal );
+	sim::command( "f2;p64;e4;s;" );
+	sim::run( sim::cycles( 0.1 ) );
+
+	seconds *= CAPTURESCALE;
+	sim::Receiver receiver;
+	sim::run( sim::cycles( seconds ) );
+	std::vector<scope::Record> &records = receiver.poll();
+
+	size_t samples = 0;
+	size_t payload = 0;
+	size_t compressed = 0;
+	bool intact = true;
+	for ( const scope::Record &record : records ) {
+		scope::Frame frame;
+		intact = intact && scope::decodeFrame( record, frame );
+		samples += frame.samples.size();
+		if ( record.type == scope::RECORD_COMPRESSED ) {
+			payload += scope::getWord( record.bytes.data() + 12 );
+			compressed++;
+		}
+		else {
+			payload += frame.samples.size();
+		}
+	}
+
+	double ratio = payload ? (double)samples / payload : 0;
+	double rate = records.size() / seconds;
+
+	printf( "  %-28s %8.2f : 1 %6.1f /s %4zu of %zu compressed\n", waveform.name, ratio, rate,
+		compressed, records.size() );
+
+	verify( ratio >= waveform.minimum, waveform.name, "ratio below the bound" );
+	verify( intact, waveform.name, "frame that does not decode" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// Resolution
+//-----------------------------------------------------------------------------
+// Continuous frames at 8, 10 and 12 bits. Samples per link second is what
+// the link alone would carry: 50000 at 8 bits, 40000 at 10 and 33333 at 12
+// for 500 kbaud, less the frame overhead.
+
+struct Resolution {
+	const char *name;
+	const char *commands;
+	uint8_t bits;
+};
+
+static const Resolution resolutions[] = {
+	{ "8-bit p32",		"f1;p32;e4;s;",		8 },
+	{ "10-bit p32",		"f1;l10;p32;e4;s;",	10 },
+	{ "12-bit o1 p16",	"f1;l10;o1;p16;e4;s;",	12 },
+};
+
+static int resolution( const Resolution &mode, double seconds )
+{
+	sim::boot();
+	sim::setInput( 0, sine( 100, 2.0 ) );
+	sim::command( mode.commands );
+	sim::run( sim::cycles( 0.1 ) );
+
+	seconds *= CAPTURESCALE;
+	sim::Receiver receiver;
+	sim::run( sim::cycles( seconds ) );
+
+	size_t samples = 0;
+	size_t bytes = 0;
+	bool intact = true;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		intact = intact && scope::decodeFrame( record, frame ) && frame.bits == mode.bits;
+		samples += frame.samples.size();
+		bytes += record.bytes.size();
+	}
+
+	double linkSeconds = bytes * 10.0 / sim::hostBaud();
+	printf( "  %-28s %8.0f /s %6.3f B/sample %8.0f /link s\n", mode.name, samples / seconds,
+		samples ? (double)bytes / samples : 0.0, linkSeconds > 0 ? samples / linkSeconds : 0.0 );
+
+	verify( samples > 0 && intact, mode.name, "frames that do not decode" );
+	return failures;
+}
+
+// Host side: unpacking against copying 8-bit samples, in samples per second
+// of wall clock time
+static void unpackSpeed( void )
+{
+	std::vector<uint8_t> data( 15 << 20 );
+	for ( size_t i = 0; i < data.size(); i++ ) data[i] = i * 2654435761u >> 13;
+
+	for ( uint8_t bits : { 8, 10, 12 } ) {
+		std::vector<uint16_t> samples;
+		samples.reserve( data.size() );
+		struct timespec start, end;
+		clock_gettime( CLOCK_MONOTONIC, &start );
+		for ( int pass = 0; pass < 4; pass++ ) {
+			samples.clear();
+			if ( bits == 8 ) samples.assign( data.begin(), data.end() );
+			else scope::unpackSamples( data.data(), data.size(), bits, samples );
+		}
+		clock_gettime( CLOCK_MONOTONIC, &end );
+		double elapsed = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) * 1e-9;
+		printf( "  unpack %2u-bit %21.0f M/s\n", bits, 4 * samples.size() / elapsed / 1e6 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Trigger position
+//-----------------------------------------------------------------------------
+// The input is a 1 kHz sine around the threshold, the frames are single
+// captures on its rising edge. The error is the trigger position minus the
+// first sample at or above the threshold after a sample below it, nearest
+// to the trigger.
+
+static int triggerPosition( const char *name, const char *commands )
+{
+	sim::boot();
+	sim::setInput( 0, sine( 1000, 2.0 ) );
+	sim::command( commands );
+
+	sim::Receiver receiver;
+	sim::run( sim::cycles( 1.0 * CAPTURESCALE ) );
+
+	int frames = 0;
+	double sum = 0;
+	int worst = 0;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		if ( !scope::decodeFrame( record, frame ) ) continue;
+
+		long best = -1;
+		for ( size_t i = 1; i < frame.samples.size(); i++ ) {
+			if ( frame.samples[i - 1] < 128 && frame.samples[i] >= 128 ) {
+				if ( best < 0 || labs( (long)i - frame.trigger ) < labs( best - frame.trigger ) ) best = i;
+			}
+		}
+		if ( best < 0 ) continue;
+
+		int error = (int)frame.trigger - (int)best;
+		sum += error;
+		if ( abs( error ) > abs( worst ) ) worst = error;
+		frames++;
+	}
+
+	printf( "  %-28s %8.2f mean %4d worst, samples, %d frames\n", name,
+		frames ? sum / frames : 0.0, worst, frames );
+
+	verify( frames > 10, name, "too few frames" );
+	verify( abs( worst ) <= 2, name, "trigger more than 2 samples off" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// Command latency
+//-----------------------------------------------------------------------------
+// d is sent every 37 ms, the latency runs from the arrival of its last byte
+// to the first byte of "Buffer size:".
+
+static int commandLatency( const char *name, const char *commands, double bound )
+{
+	sim::boot();
+	sim::setInput( 0, sine( 1000, 2.0 ) );
+	sim::command( commands );
+	sim::run( sim::cycles( 0.05 ) );
+
+	std::vector<double> latencies;
+	for ( int i = 0; i < 20; i++ ) {
+		size_t from = sim::link().bytes.size();
+		sim::hostSend( "d;" );
+		uint64_t sent = sim::hostSendDone();
+
+		long reply = -1;
+		sim::runUntil( [&]() {
+			reply = sim::find( "Buffer size:", from );
+			return reply >= 0;
+		}, sim::cycles( 0.5 * CAPTURESCALE ) );
+		if ( reply < 0 ) break;
+
+		uint64_t first = sim::link().times[reply];
+		latencies.push_back( (double)( first - sent ) / sim::CLOCK * 1000.0 );
+		sim::run( sim::cycles( 0.037 ) );
+	}
+
+	double sum = 0;
+	double worst = 0;
+	for ( double latency : latencies ) {
+		sum += latency;
+		worst = std::max( worst, latency );
+	}
+	double mean = latencies.empty() ? 0 : sum / latencies.size();
+
+	printf( "  %-28s %8.2f ms mean %6.2f ms worst\n", name, mean, worst );
+
+	verify( latencies.size() == 20, name, "reply missing" );
+	verify( worst <= bound * CAPTURESCALE, name, "reply later than the bound" );
+	return failures;
+}
+
+//-----------------------------------------------------------------------------
+// main
+//-----------------------------------------------------------------------------
+
+int main( int argc, char **argv )
+{
+	double seconds = 2.0;
+
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !strcmp( argv[i], "--check" ) ) {
+			check = true;
+			seconds = 1.0;
+		}
+	}
+
+	// Every scenario runs in a process of its own and exits with its
+	// failures
+	int failed = 0;
+
+	printf( "Frames per second, %.0f s each\n", seconds * CAPTURESCALE );
+	for ( const Mode &mode : modes ) {
+		failed += sim::isolate( [&]() { return framesPerSecond( mode, seconds ); } );
+	}
+
+	printf( "Dead time between frames, 500 kbaud\n" );
+	failed += sim::isolate( [&]() { return deadTimes( 64, seconds ); } );
+	failed += sim::isolate( [&]() { return deadTimes( 16, seconds ); } );
+
+	printf( "Link utilisation while a frame is sent, f1 p16\n" );
+	failed += sim::isolate( [&]() { return linkUtilisation( 500000, 0.9, seconds ); } );
+	failed += sim::isolate( [&]() { return linkUtilisation( 1000000, 0.85, seconds ); } );
+	failed += sim::isolate( [&]() { return linkUtilisation( 2000000, 0.75, seconds ); } );
+
+	printf( "Compression, f2 p64\n" );
+	for ( const Waveform &waveform : waveforms ) {
+		failed += sim::isolate( [&]() { return compression( waveform, seconds ); } );
+	}
+
+	printf( "Resolution, samples/s\n" );
+	for ( const Resolution &mode : resolutions ) {
+		failed += sim::isolate( [&]() { return resolution( mode, seconds ); } );
+	}
+	unpackSpeed();
+
+	printf( "Trigger position\n" );
+	failed += sim::isolate( [&]() { return triggerPosition( "comparator p16", "f1;p16;e3;t128;s;" ); } );
+	failed += sim::isolate( [&]() { return triggerPosition( "comparator p64", "f1;p64;e3;t128;s;" ); } );
+	failed += sim::isolate( [&]() { return triggerPosition( "digital p16", "f1;p16;g1;e3;t128;s;" ); } );
+	failed += sim::isolate( [&]() { return triggerPosition( "digital p64", "f1;p64;g1;e3;t128;s;" ); } );
+
+	printf( "Command latency\n" );
+	failed += sim::isolate( [&]() { return commandLatency( "idle link", "f1;S;", 2.0 ); } );
+	failed += sim::isolate( [&]() { return commandLatency( "busy link p16", "f1;p16;e4;s;", 25.0 ); } );
+
+	if ( check && failed ) {
+		printf( "%d failed\n", failed );
+		return 1;
+	}
+	return 0;
+}
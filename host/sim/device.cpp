@@ -0,0 +1,1172 @@
+//-----------------------------------------------------------------------------
+// device.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Arduino.h>
+#include "device.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <deque>
+
+// Entry points of the sketch
+void setup( void );
+void loop( void );
+
+// Handlers the sketch defines, the others stay null
+extern "C" {
+void ADC_vect( void ) __attribute__((weak));
+void ANALOG_COMP_vect( void ) __attribute__((weak));
+void TIMER0_COMPB_vect( void ) __attribute__((weak));
+void TIMER1_CAPT_vect( void ) __attribute__((weak));
+void TIMER1_COMPB_vect( void ) __attribute__((weak));
+void USART_TX_vect( void ) __attribute__((weak));
+}
+
+namespace sim {
+
+//-----------------------------------------------------------------------------
+// State
+//-----------------------------------------------------------------------------
+
+static const uint64_t NEVER = UINT64_MAX;
+
+uint32_t loopCycles = 60;
+uint32_t isrCycles = 40;
+
+static uint64_t cycle;
+static bool interruptsOn;
+static uint8_t isrDepth;
+
+// Registers without behaviour of their own, and the stored bits of those
+// with it
+static uint8_t registers[REG_COUNT];
+
+static uint8_t &reg( uint8_t r )
+{
+	return registers[r];
+}
+
+static bool regBit( uint8_t r, uint8_t bit )
+{
+	return registers[r] & _BV(bit);
+}
+
+// Analog inputs
+static Signal inputs[8];
+static Signal comparatorSignal;
+static double thresholdVolts;
+
+// ADC
+static uint16_t adcResult;
+static bool adcConverting;
+static bool adcFirst;
+static uint64_t adcSample;
+static uint64_t adcDone;
+static uint8_t adcInput;
+static uint8_t adcReference;
+static bool adcLogging;
+static std::vector<Conversion> adcLog;
+static uint32_t adcLost;
+
+// Analog comparator
+static bool comparatorOutput;
+static uint64_t comparatorNext;
+
+// Timers
+static uint64_t timer0Match;
+static uint16_t timer1A;
+static uint16_t timer1B;
+static uint16_t timer1Capture;
+static uint64_t timer1Base;
+static uint32_t timer1BaseCount;
+static uint64_t timer1Match;
+
+// USART
+static uint8_t usartFlags;
+static uint16_t usartRate;
+static bool udrFull;
+static uint8_t udrData;
+static bool shifting;
+static uint8_t shiftData;
+static bool shiftCorrupt;
+static uint64_t shiftDone;
+static uint8_t rxData[2];
+static bool rxError[2];
+static uint8_t rxCount;
+
+struct Pending {
+	uint64_t arrival;
+	uint8_t data;
+};
+
+static std::deque<Pending> hostQueue;
+static uint64_t hostLast;
+static uint32_t hostRate = 500000;
+static Link received;
+
+// Pins
+static bool led;
+static uint32_t ledBlinks;
+
+//-----------------------------------------------------------------------------
+// Spin watchdog
+//-----------------------------------------------------------------------------
+// Every device access counts as a hook. When the main context has used
+// SPINCPU of CPU time without one, it spins on a variable an ISR changes,
+// and the timer signal lets the device run on to the next interrupt, as
+// the board would.
+
+static const long SPINCPU = 200000;	// ns of CPU time without a hook
+static const long TICK = 50;		// us between watchdog checks
+static const uint64_t SPINLIMIT = 10ULL * CLOCK;	// cycles of a hung spin
+
+static volatile sig_atomic_t inFirmware;
+static volatile sig_atomic_t inDevice;
+static volatile uint32_t hooks;
+static uint32_t tickHooks;
+static long tickCpu;
+static bool spinning;
+static uint64_t spinStart;
+static int armed;
+
+struct DeviceScope {
+	DeviceScope() { inDevice = inDevice + 1; hooks = hooks + 1; }
+	~DeviceScope() { inDevice = inDevice - 1; }
+};
+
+static long cpuTime( void )
+{
+	struct timespec t;
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &t );
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void advance( uint64_t cycles );
+static bool advanceToInterrupt( uint64_t cycles );
+
+static void onTick( int )
+{
+	if ( !inFirmware || inDevice || !interruptsOn ) {
+		spinning = false;
+		tickHooks = hooks;
+		tickCpu = cpuTime();
+		return;
+	}
+
+	if ( hooks != tickHooks ) {
+		spinning = false;
+		tickHooks = hooks;
+		tickCpu = cpuTime();
+		return;
+	}
+
+	if ( !spinning ) {
+		if ( cpuTime() - tickCpu < SPINCPU ) return;
+		spinning = true;
+		spinStart = cycle;
+	}
+
+	inDevice = inDevice + 1;
+	advanceToInterrupt( CLOCK / 1000 );
+	inDevice = inDevice - 1;
+	tickHooks = hooks;
+
+	if ( cycle - spinStart > SPINLIMIT ) {
+		fault( "the main context spins and no interrupt ends it" );
+	}
+}
+
+static void arm( void )
+{
+	if ( armed++ ) return;
+
+	struct sigaction action;
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler = onTick;
+	action.sa_flags = SA_RESTART;
+	sigaction( SIGALRM, &action, NULL );
+
+	tickHooks = hooks;
+	tickCpu = cpuTime();
+	spinning = false;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = TICK;
+	timer.it_value = timer.it_interval;
+	setitimer( ITIMER_REAL, &timer, NULL );
+}
+
+static void disarm( void )
+{
+	if ( --armed ) return;
+
+	struct itimerval timer;
+	memset( &timer, 0, sizeof(timer) );
+	setitimer( ITIMER_REAL, &timer, NULL );
+}
+
+void fault( const char *message )
+{
+	fprintf( stderr, "device fault at %.6f s: %s\n", (double)cycle / CLOCK, message );
+	fflush( stderr );
+	abort();
+}
+
+//-----------------------------------------------------------------------------
+// Analog inputs
+//-----------------------------------------------------------------------------
+
+void setInput( uint8_t input, Signal signal )
+{
+	inputs[input & 7] = signal;
+}
+
+void setComparator( Signal signal )
+{
+	comparatorSignal = signal;
+}
+
+double threshold( void )
+{
+	return thresholdVolts;
+}
+
+static double voltage( uint8_t input, uint64_t at )
+{
+	double t = (double)at / CLOCK;
+
+	if ( input < 8 ) return inputs[input] ? inputs[input]( t ) : 0.0;
+	if ( input == 14 ) return 1.1;
+	return 0.0;
+}
+
+void logConversions( bool on )
+{
+	adcLogging = on;
+}
+
+std::vector<Conversion> &conversions( void )
+{
+	return adcLog;
+}
+
+uint32_t lostConversions( void )
+{
+	return adcLost;
+}
+
+//-----------------------------------------------------------------------------
+// ADC
+//-----------------------------------------------------------------------------
+
+static uint32_t adcDivider( void )
+{
+	uint8_t select = reg(REG_ADCSRA) & 0x07;
+	return select ? 1 << select : 2;
+}
+
+static uint8_t adcTriggerSource( void )
+{
+	return reg(REG_ADCSRB) & 0x07;
+}
+
+// A conversion takes 13 ADC clocks and samples after 1.5, the first one
+// after enabling the ADC 25 and 13.5. A conversion started by Timer1 samples
+// 2 ADC clocks and 3 cycles after the compare match.
+static void startConversion( uint64_t at, bool triggered )
+{
+	uint32_t p = adcDivider();
+
+	adcConverting = true;
+	adcInput = reg(REG_ADMUX) & 0x0F;
+	adcReference = reg(REG_ADMUX) >> 6;
+
+	if (adcFirst) {
+		adcSample = at + 27 * p / 2;
+		adcDone = at + 25 * p;
+		adcFirst = false;
+	}
+	else if (triggered) {
+		adcSample = at + 3 + 2 * p;
+		adcDone = at + 3 + 27 * p / 2;
+	}
+	else {
+		adcSample = at + 3 * p / 2;
+		adcDone = at + 13 * p;
+	}
+}
+
+static void completeConversion( void )
+{
+	uint64_t done = adcDone;
+	double reference = ( adcReference == 3 ) ? 1.1 : 5.0;
+	double code = floor( voltage( adcInput, adcSample ) / reference * 1024.0 );
+	if ( code < 0 ) code = 0;
+	if ( code > 1023 ) code = 1023;
+
+	if ( regBit( REG_ADCSRA, ADIF ) ) adcLost++;
+	adcResult = (uint16_t)code;
+	reg(REG_ADCSRA) |= _BV(ADIF);
+
+	if (adcLogging) {
+		Conversion conversion = { adcSample, adcInput, adcResult };
+		adcLog.push_back( conversion );
+	}
+
+	adcConverting = false;
+	if ( regBit( REG_ADCSRA, ADATE ) && adcTriggerSource() == 0 ) {
+		startConversion( done, false );
+	}
+}
+
+static void writeADCSRA( uint8_t value )
+{
+	uint8_t old = reg(REG_ADCSRA);
+	uint8_t flag = old & _BV(ADIF);
+	if ( value & _BV(ADIF) ) flag = 0;
+
+	reg(REG_ADCSRA) = ( value & ~( _BV(ADIF) | _BV(ADSC) ) ) | flag;
+
+	if ( !( value & _BV(ADEN) ) ) {
+		adcConverting = false;
+		adcFirst = true;
+		return;
+	}
+	if ( !( old & _BV(ADEN) ) ) adcFirst = true;
+
+	if ( ( value & _BV(ADSC) ) && !adcConverting ) startConversion( cycle, false );
+}
+
+static uint8_t readADCSRA( void )
+{
+	return reg(REG_ADCSRA) | ( adcConverting ? _BV(ADSC) : 0 );
+}
+
+static uint16_t adcData( void )
+{
+	return regBit( REG_ADMUX, ADLAR ) ? adcResult << 6 : adcResult;
+}
+
+//-----------------------------------------------------------------------------
+// Analog comparator
+//-----------------------------------------------------------------------------
+
+static bool compare( uint64_t at )
+{
+	double positive;
+	if ( regBit( REG_ACSR, ACBG ) ) positive = 1.1;
+	else if (comparatorSignal) positive = comparatorSignal( (double)at / CLOCK );
+	else positive = voltage( 0, at );
+
+	double negative = thresholdVolts;
+	if ( regBit( REG_ADCSRB, ACME ) && !regBit( REG_ADCSRA, ADEN ) ) {
+		negative = voltage( reg(REG_ADMUX) & 0x07, at );
+	}
+
+	return positive > negative;
+}
+
+static uint16_t timer1Count( uint64_t at );
+
+static void scheduleComparator( void )
+{
+	uint8_t acsr = reg(REG_ACSR);
+	boolean on = !( acsr & _BV(ACD) ) && ( acsr & ( _BV(ACIE) | _BV(ACIC) ) );
+
+	if (!on) {
+		comparatorNext = NEVER;
+	}
+	else if ( comparatorNext == NEVER ) {
+		comparatorOutput = compare( cycle );
+		comparatorNext = cycle + COMPARATORSTEP;
+	}
+}
+
+static void checkComparator( void )
+{
+	uint64_t at = comparatorNext;
+	bool output = compare( at );
+	comparatorNext += COMPARATORSTEP;
+	if ( output == comparatorOutput ) return;
+	comparatorOutput = output;
+
+	uint8_t mode = reg(REG_ACSR) & 0x03;
+	if ( mode == 0 || ( mode == 2 && !output ) || ( mode == 3 && output ) ) {
+		reg(REG_ACSR) |= _BV(ACI);
+	}
+
+	if ( regBit( REG_ACSR, ACIC ) && output == regBit( REG_TCCR1B, ICES1 ) ) {
+		timer1Capture = timer1Count( at );
+		reg(REG_TIFR1) |= _BV(ICF1);
+	}
+}
+
+static void writeACSR( uint8_t value )
+{
+	uint8_t flag = reg(REG_ACSR) & _BV(ACI);
+	if ( value & _BV(ACI) ) flag = 0;
+
+	reg(REG_ACSR) = ( value & ~( _BV(ACI) | _BV(ACO) ) ) | flag;
+	scheduleComparator();
+}
+
+//-----------------------------------------------------------------------------
+// Timer0
+//-----------------------------------------------------------------------------
+// Runs at clk/64 from reset as the core sets it up, Compare Match B sets
+// OCF0B on the timer clock at which TCNT0 becomes OCR0B.
+
+static uint64_t nextTimer0Match( uint64_t from )
+{
+	uint64_t tick = from / 64 + 1;
+	tick += ( reg(REG_OCR0B) - tick ) & 0xFF;
+	return tick * 64;
+}
+
+//-----------------------------------------------------------------------------
+// Timer1
+//-----------------------------------------------------------------------------
+// Normal mode or CTC with OCR1A as top, at clk/1 to clk/1024.
+
+static uint32_t timer1Divider( void )
+{
+	static const uint32_t dividers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	return dividers[reg(REG_TCCR1B) & 0x07];
+}
+
+static uint32_t timer1Top( void )
+{
+	boolean ctc = ( reg(REG_TCCR1B) & ( _BV(WGM12) | _BV(WGM13) ) ) == _BV(WGM12) &&
+		( reg(REG_TCCR1A) & 0x03 ) == 0;
+	return ctc ? (uint32_t)timer1A + 1 : 65536;
+}
+
+static uint64_t timer1Ticks( uint64_t at )
+{
+	uint32_t divider = timer1Divider();
+	return divider ? ( at - timer1Base ) / divider : 0;
+}
+
+static uint16_t timer1Count( uint64_t at )
+{
+	return ( timer1BaseCount + timer1Ticks( at ) ) % timer1Top();
+}
+
+// Takes the count at the current setting before the setting changes
+static void rebaseTimer1( void )
+{
+	timer1BaseCount = timer1Count( cycle );
+	timer1Base = cycle;
+}
+
+static void scheduleTimer1( void )
+{
+	uint32_t divider = timer1Divider();
+	uint32_t top = timer1Top();
+
+	if ( divider == 0 || timer1B >= top ) {
+		timer1Match = NEVER;
+		return;
+	}
+
+	uint64_t ticks = timer1Ticks( cycle );
+	uint32_t count = ( timer1BaseCount + ticks ) % top;
+	uint32_t distance = ( timer1B + top - count ) % top;
+	if ( distance == 0 ) distance = top;
+	timer1Match = timer1Base + ( ticks + distance ) * divider;
+}
+
+static void timer1Compare( void )
+{
+	uint64_t at = timer1Match;
+
+	if ( !regBit( REG_TIFR1, OCF1B ) ) {
+		reg(REG_TIFR1) |= _BV(OCF1B);
+
+		// Auto trigger on the rising edge of the flag
+		if ( regBit( REG_ADCSRA, ADEN ) && regBit( REG_ADCSRA, ADATE ) &&
+			adcTriggerSource() == 5 && !adcConverting ) {
+			startConversion( at, true );
+		}
+	}
+
+	uint64_t saved = cycle;
+	cycle = at;
+	scheduleTimer1();
+	cycle = saved;
+}
+
+//-----------------------------------------------------------------------------
+// USART
+//-----------------------------------------------------------------------------
+
+static uint32_t bitCycles( void )
+{
+	return ( (uint32_t)usartRate + 1 ) * ( ( usartFlags & _BV(U2X0) ) ? 8 : 16 );
+}
+
+static uint32_t frameCycles( void )
+{
+	uint8_t bits = ( reg(REG_UCSR0C) & _BV(3) ) ? 11 : 10;
+	return bits * bitCycles();
+}
+
+static bool ratesMatch( void )
+{
+	double device = (double)CLOCK / bitCycles();
+	return fabs( device - hostRate ) <= 0.045 * hostRate;
+}
+
+static void startShift( uint8_t data, uint64_t at )
+{
+	shifting = true;
+	shiftData = data;
+	shiftCorrupt = !ratesMatch();
+	shiftDone = at + frameCycles();
+}
+
+static void shiftOut( void )
+{
+	uint64_t at = shiftDone;
+
+	received.bytes.push_back( shiftCorrupt ? shiftData ^ 0xA5 : shiftData );
+	received.times.push_back( at );
+	if (shiftCorrupt) received.framingErrors++;
+
+	if (udrFull) {
+		udrFull = false;
+		startShift( udrData, at );
+	}
+	else {
+		shifting = false;
+		shiftDone = NEVER;
+		usartFlags |= _BV(TXC0);
+	}
+}
+
+// A new rate garbles the byte on the line
+static void rateChanged( void )
+{
+	if (shifting) shiftCorrupt = true;
+}
+
+static void hostArrive( void )
+{
+	Pending pending = hostQueue.front();
+	hostQueue.pop_front();
+
+	if ( !regBit( REG_UCSR0B, RXEN0 ) ) return;
+	if ( rxCount == 2 ) {
+		usartFlags |= _BV(DOR0);
+		return;
+	}
+
+	bool error = !ratesMatch();
+	rxData[rxCount] = error ? pending.data ^ 0xA5 : pending.data;
+	rxError[rxCount] = error;
+	rxCount++;
+}
+
+static void writeUDR( uint8_t data )
+{
+	if ( !regBit( REG_UCSR0B, TXEN0 ) || udrFull ) return;
+
+	if (!shifting) startShift( data, cycle );
+	else {
+		udrFull = true;
+		udrData = data;
+	}
+}
+
+static uint8_t readUDR( void )
+{
+	if ( rxCount == 0 ) return 0;
+
+	uint8_t data = rxData[0];
+	rxData[0] = rxData[1];
+	rxError[0] = rxError[1];
+	rxCount--;
+	usartFlags &= ~_BV(DOR0);
+	return data;
+}
+
+static uint8_t readUCSR0A( void )
+{
+	uint8_t value = usartFlags & ( _BV(TXC0) | _BV(DOR0) | _BV(U2X0) | _BV(MPCM0) );
+	if (rxCount) value |= _BV(RXC0);
+	if ( rxCount && rxError[0] ) value |= _BV(FE0);
+	if (!udrFull) value |= _BV(UDRE0);
+	return value;
+}
+
+static void writeUCSR0A( uint8_t value )
+{
+	uint8_t old = usartFlags;
+	if ( value & _BV(TXC0) ) usartFlags &= ~_BV(TXC0);
+	usartFlags = ( usartFlags & ~( _BV(U2X0) | _BV(MPCM0) ) ) | ( value & ( _BV(U2X0) | _BV(MPCM0) ) );
+	if ( ( old ^ usartFlags ) & _BV(U2X0) ) rateChanged();
+}
+
+void setHostBaud( uint32_t baud )
+{
+	hostRate = baud;
+}
+
+uint32_t hostBaud( void )
+{
+	return hostRate;
+}
+
+void hostSend( const void *data, size_t length )
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint64_t frame = 10ULL * CLOCK / hostRate;
+
+	if ( hostLast < cycle ) hostLast = cycle;
+	for ( size_t i = 0; i < length; i++ ) {
+		hostLast += frame;
+		Pending pending = { hostLast, bytes[i] };
+		hostQueue.push_back( pending );
+	}
+}
+
+void hostSend( const std::string &text )
+{
+	hostSend( text.data(), text.size() );
+}
+
+uint64_t hostSendDone( void )
+{
+	return hostLast;
+}
+
+Link &link( void )
+{
+	return received;
+}
+
+bool lineIdle( void )
+{
+	return !shifting && !udrFull;
+}
+
+//-----------------------------------------------------------------------------
+// Interrupts
+//-----------------------------------------------------------------------------
+// In the order of the vector table, which is the priority order.
+
+enum Vector {
+	VECTOR_TIMER1_CAPT,
+	VECTOR_TIMER1_COMPB,
+	VECTOR_TIMER0_COMPB,
+	VECTOR_USART_RX,
+	VECTOR_USART_UDRE,
+	VECTOR_USART_TX,
+	VECTOR_ADC,
+	VECTOR_ANALOG_COMP,
+	VECTOR_NONE
+};
+
+static Vector pendingVector( void )
+{
+	if ( regBit( REG_TIFR1, ICF1 ) && regBit( REG_TIMSK1, ICIE1 ) ) return VECTOR_TIMER1_CAPT;
+	if ( regBit( REG_TIFR1, OCF1B ) && regBit( REG_TIMSK1, OCIE1B ) ) return VECTOR_TIMER1_COMPB;
+	if ( regBit( REG_TIFR0, OCF0B ) && regBit( REG_TIMSK0, OCIE0B ) ) return VECTOR_TIMER0_COMPB;
+	if ( rxCount && regBit( REG_UCSR0B, RXCIE0 ) ) return VECTOR_USART_RX;
+	if ( !udrFull && regBit( REG_UCSR0B, UDRIE0 ) ) return VECTOR_USART_UDRE;
+	if ( ( usartFlags & _BV(TXC0) ) && regBit( REG_UCSR0B, TXCIE0 ) ) return VECTOR_USART_TX;
+	if ( regBit( REG_ADCSRA, ADIF ) && regBit( REG_ADCSRA, ADIE ) ) return VECTOR_ADC;
+	if ( regBit( REG_ACSR, ACI ) && regBit( REG_ACSR, ACIE ) ) return VECTOR_ANALOG_COMP;
+	return VECTOR_NONE;
+}
+
+static void handler( void (*isr)( void ) )
+{
+	if ( !isr ) fault( "interrupt taken without a handler" );
+	isr();
+}
+
+// Takes the interrupt, the flags of the single source vectors are cleared
+// when the vector is entered
+static void takeInterrupt( Vector vector )
+{
+	interruptsOn = false;
+	isrDepth++;
+	advance( isrCycles );
+
+	switch ( vector ) {
+	case VECTOR_TIMER1_CAPT:
+		reg(REG_TIFR1) &= ~_BV(ICF1);
+		handler( TIMER1_CAPT_vect );
+		break;
+	case VECTOR_TIMER1_COMPB:
+		reg(REG_TIFR1) &= ~_BV(OCF1B);
+		handler( TIMER1_COMPB_vect );
+		break;
+	case VECTOR_TIMER0_COMPB:
+		reg(REG_TIFR0) &= ~_BV(OCF0B);
+		handler( TIMER0_COMPB_vect );
+		break;
+	case VECTOR_USART_RX:
+		Serial.rxCompleteInterrupt();
+		break;
+	case VECTOR_USART_UDRE:
+		Serial.udrEmptyInterrupt();
+		break;
+	case VECTOR_USART_TX:
+		usartFlags &= ~_BV(TXC0);
+		handler( USART_TX_vect );
+		break;
+	case VECTOR_ADC:
+		reg(REG_ADCSRA) &= ~_BV(ADIF);
+		handler( ADC_vect );
+		break;
+	case VECTOR_ANALOG_COMP:
+		reg(REG_ACSR) &= ~_BV(ACI);
+		handler( ANALOG_COMP_vect );
+		break;
+	case VECTOR_NONE:
+		break;
+	}
+
+	isrDepth--;
+	interruptsOn = true;
+}
+
+// One interrupt at a time, the running context gets on between them
+static bool deliver( void )
+{
+	if ( !interruptsOn || isrDepth ) return false;
+
+	Vector vector = pendingVector();
+	if ( vector == VECTOR_NONE ) return false;
+	takeInterrupt( vector );
+	return true;
+}
+
+void interrupts( boolean enable )
+{
+	DeviceScope scope;
+	interruptsOn = enable;
+	advance( 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Time
+//-----------------------------------------------------------------------------
+
+static uint64_t nextEvent( void )
+{
+	uint64_t next = NEVER;
+
+	if ( adcConverting && adcDone < next ) next = adcDone;
+	if ( timer1Match < next ) next = timer1Match;
+	if ( timer0Match < next ) next = timer0Match;
+	if ( shiftDone < next ) next = shiftDone;
+	if ( !hostQueue.empty() && hostQueue.front().arrival < next ) next = hostQueue.front().arrival;
+	if ( comparatorNext < next ) next = comparatorNext;
+	return next;
+}
+
+static void processEvents( void )
+{
+	for ( ;; ) {
+		if ( adcConverting && adcDone <= cycle ) completeConversion();
+		else if ( timer1Match <= cycle ) timer1Compare();
+		else if ( timer0Match <= cycle ) {
+			reg(REG_TIFR0) |= _BV(OCF0B);
+			timer0Match = nextTimer0Match( timer0Match );
+		}
+		else if ( shiftDone <= cycle ) shiftOut();
+		else if ( !hostQueue.empty() && hostQueue.front().arrival <= cycle ) hostArrive();
+		else if ( comparatorNext <= cycle ) checkComparator();
+		else break;
+	}
+}
+
+static void advance( uint64_t cycles )
+{
+	deliver();
+
+	while ( cycles ) {
+		uint64_t next = nextEvent();
+		uint64_t step = 0;
+		if ( next > cycle ) step = ( next - cycle < cycles ) ? next - cycle : cycles;
+		cycle += step;
+		cycles -= step;
+		processEvents();
+		deliver();
+	}
+}
+
+// Runs until an interrupt was taken or the cycles have passed, for the
+// spin watchdog
+static bool advanceToInterrupt( uint64_t cycles )
+{
+	uint64_t end = cycle + cycles;
+
+	if ( deliver() ) return true;
+	while ( cycle < end ) {
+		uint64_t next = nextEvent();
+		if ( next > cycle ) cycle = ( next < end ) ? next : end;
+		processEvents();
+		if ( deliver() ) return true;
+	}
+	return false;
+}
+
+uint64_t now( void )
+{
+	return cycle;
+}
+
+double seconds( void )
+{
+	return (double)cycle / CLOCK;
+}
+
+void spend( uint32_t cycles )
+{
+	DeviceScope scope;
+	advance( cycles );
+}
+
+//-----------------------------------------------------------------------------
+// Register access
+//-----------------------------------------------------------------------------
+// Every access takes one cycle.
+
+uint8_t readRegister( uint8_t r )
+{
+	DeviceScope scope;
+	advance( 1 );
+
+	switch ( r ) {
+	case REG_SREG:	return interruptsOn ? _BV(SREG_I) : 0;
+	case REG_ADCSRA:	return readADCSRA();
+	case REG_ADCL:	return adcData() & 0xFF;
+	case REG_ADCH:	return adcData() >> 8;
+	case REG_ACSR:	return reg(REG_ACSR) | ( compare( cycle ) ? _BV(ACO) : 0 );
+	case REG_TCNT0:	return ( cycle / 64 ) & 0xFF;
+	case REG_UCSR0A:	return readUCSR0A();
+	case REG_UBRR0L:	return usartRate & 0xFF;
+	case REG_UBRR0H:	return usartRate >> 8;
+	case REG_UDR0:	return readUDR();
+	default:	return reg(r);
+	}
+}
+
+void writeRegister( uint8_t r, uint8_t value )
+{
+	DeviceScope scope;
+
+	switch ( r ) {
+	case REG_SREG:
+		interruptsOn = value & _BV(SREG_I);
+		break;
+	case REG_ADCSRA:
+		writeADCSRA( value );
+		break;
+	case REG_ADCL:
+	case REG_ADCH:
+	case REG_TCNT0:
+		break;
+	case REG_ACSR:
+		writeACSR( value );
+		break;
+	case REG_ADCSRB:
+		reg(r) = value;
+		break;
+	case REG_OCR0B:
+		reg(r) = value;
+		timer0Match = nextTimer0Match( cycle );
+		break;
+	case REG_TIFR0:
+	case REG_TIFR1:
+	case REG_TIFR2:
+		reg(r) &= ~value;
+		break;
+	case REG_TCCR1A:
+	case REG_TCCR1B:
+		rebaseTimer1();
+		reg(r) = value;
+		scheduleTimer1();
+		break;
+	case REG_UCSR0A:
+		writeUCSR0A( value );
+		break;
+	case REG_UBRR0L:
+		usartRate = ( usartRate & 0x0F00 ) | value;
+		rateChanged();
+		break;
+	case REG_UBRR0H:
+		usartRate = ( usartRate & 0x00FF ) | ( ( value & 0x0F ) << 8 );
+		rateChanged();
+		break;
+	case REG_UDR0:
+		writeUDR( value );
+		break;
+	default:
+		reg(r) = value;
+		break;
+	}
+
+	advance( 1 );
+}
+
+uint16_t readRegister16( uint8_t r )
+{
+	DeviceScope scope;
+	advance( 2 );
+
+	switch ( r ) {
+	case REG_ADC:	return adcData();
+	case REG_TCNT1:	return timer1Count( cycle );
+	case REG_OCR1A:	return timer1A;
+	case REG_OCR1B:	return timer1B;
+	case REG_ICR1:	return timer1Capture;
+	case REG_UBRR0:	return usartRate;
+	default:	return 0;
+	}
+}
+
+void writeRegister16( uint8_t r, uint16_t value )
+{
+	DeviceScope scope;
+
+	switch ( r ) {
+	case REG_TCNT1:
+		timer1Base = cycle;
+		timer1BaseCount = value;
+		scheduleTimer1();
+		break;
+	case REG_OCR1A:
+		rebaseTimer1();
+		timer1A = value;
+		scheduleTimer1();
+		break;
+	case REG_OCR1B:
+		timer1B = value;
+		scheduleTimer1();
+		break;
+	case REG_ICR1:
+		timer1Capture = value;
+		break;
+	case REG_UBRR0:
+		usartRate = value & 0x0FFF;
+		rateChanged();
+		break;
+	default:
+		break;
+	}
+
+	advance( 2 );
+}
+
+//-----------------------------------------------------------------------------
+// Pins
+//-----------------------------------------------------------------------------
+
+bool errorLed( void )
+{
+	return led;
+}
+
+uint32_t errorBlinks( void )
+{
+	return ledBlinks;
+}
+
+//-----------------------------------------------------------------------------
+// Power on
+//-----------------------------------------------------------------------------
+
+void reset( void )
+{
+	cycle = 0;
+	interruptsOn = false;
+	isrDepth = 0;
+	memset( registers, 0, sizeof(registers) );
+
+	for ( uint8_t i = 0; i < 8; i++ ) inputs[i] = Signal();
+	comparatorSignal = Signal();
+	thresholdVolts = 0;
+
+	adcResult = 0;
+	adcConverting = false;
+	adcFirst = true;
+	adcLog.clear();
+	adcLost = 0;
+
+	comparatorNext = NEVER;
+	timer1A = 0;
+	timer1B = 0;
+	timer1Capture = 0;
+	timer1Base = 0;
+	timer1BaseCount = 0;
+	timer1Match = NEVER;
+
+	usartFlags = 0;
+	usartRate = 0;
+	udrFull = false;
+	shifting = false;
+	shiftDone = NEVER;
+	rxCount = 0;
+	hostQueue.clear();
+	hostLast = 0;
+	received = Link();
+
+	led = false;
+	ledBlinks = 0;
+
+	// init() of the core: Timer0 at clk/64 with its overflow interrupt
+	// for millis(), Timer2 at clk/64 for analogWrite(), interrupts on
+	reg(REG_TCCR0A) = _BV(WGM01) | _BV(WGM00);
+	reg(REG_TCCR0B) = _BV(CS01) | _BV(CS00);
+	reg(REG_TIMSK0) = _BV(TOIE0);
+	reg(REG_TCCR2B) = _BV(CS22);
+	reg(REG_TCCR2A) = _BV(WGM20);
+	timer0Match = nextTimer0Match( 0 );
+	Serial.reset();
+	interruptsOn = true;
+}
+
+//-----------------------------------------------------------------------------
+// Running the sketch
+//-----------------------------------------------------------------------------
+
+// The watchdog runs while the sketch does, inFirmware tells when the main
+// context is in the sketch rather than in the caller
+struct Watchdog {
+	Watchdog() { arm(); }
+	~Watchdog() { disarm(); }
+};
+
+struct FirmwareScope {
+	FirmwareScope() { inFirmware = 1; }
+	~FirmwareScope() { inFirmware = 0; }
+};
+
+void boot( void )
+{
+	reset();
+	Watchdog watchdog;
+	FirmwareScope scope;
+	setup();
+}
+
+void run( uint64_t cycles )
+{
+	uint64_t end = cycle + cycles;
+	Watchdog watchdog;
+
+	while ( cycle < end ) {
+		{
+			FirmwareScope scope;
+			loop();
+		}
+		spend( loopCycles );
+	}
+}
+
+bool runUntil( const std::function<bool()> &done, uint64_t cycles )
+{
+	uint64_t end = cycle + cycles;
+	Watchdog watchdog;
+
+	while ( !done() ) {
+		if ( cycle >= end ) return false;
+		{
+			FirmwareScope scope;
+			loop();
+		}
+		spend( loopCycles );
+	}
+	return true;
+}
+
+void call( const std::function<void()> &function )
+{
+	Watchdog watchdog;
+	FirmwareScope scope;
+	function();
+}
+
+} // namespace sim
+
+//-----------------------------------------------------------------------------
+// Core functions
+//-----------------------------------------------------------------------------
+
+unsigned long millis( void )
+{
+	sim::spend( 20 );
+	return (uint32_t)( sim::now() / ( sim::CLOCK / 1000 ) );
+}
+
+unsigned long micros( void )
+{
+	sim::spend( 30 );
+	return (uint32_t)( sim::now() / ( sim::CLOCK / 1000000 ) );
+}
+
+void delay( unsigned long ms )
+{
+	while ( ms-- ) sim::spend( sim::CLOCK / 1000 );
+}
+
+void delayMicroseconds( unsigned int us )
+{
+	sim::spend( us * ( sim::CLOCK / 1000000 ) );
+}
+
+void pinMode( uint8_t, uint8_t )
+{
+	sim::spend( 40 );
+}
+
+void digitalWrite( uint8_t pin, uint8_t value )
+{
+	sim::spend( 60 );
+	if ( pin != 13 ) return;
+
+	if ( value && !sim::led ) sim::ledBlinks++;
+	sim::led = value;
+}
+
+int digitalRead( uint8_t )
+{
+	sim::spend( 60 );
+	return LOW;
+}
+
+// The threshold pin drives AIN1 through an RC filter
+void analogWrite( uint8_t pin, int value )
+{
+	sim::spend( 80 );
+	if ( pin == 3 ) sim::thresholdVolts = value * 5.0 / 255.0;
+}
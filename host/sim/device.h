@@ -0,0 +1,162 @@
+//-----------------------------------------------------------------------------
+// device.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Simulated ATmega328P for host builds of the sketch
+//-----------------------------------------------------------------------------
+// The device keeps a clock in CPU cycles at 16 MHz and models the parts the
+// sketch uses: the ADC (free running, single and Timer1 auto triggered
+// conversions, ADMUX latched at the start of a conversion), the analog
+// comparator with its interrupt and the Timer1 input capture, Timer0 and
+// Timer1 compare matches, the USART with its two byte transmit path and
+// Transmit Complete flag, and the interrupt priorities.
+//
+// It is a functional model, not a cycle model: time passes by a fixed cost
+// per register access, per interrupt and per loop() pass, not per
+// instruction. Frame rates, link timing, trigger positions and protocol
+// behaviour come out as on the board; ISR cycle counts do not, those need
+// the benchmark build on the board or in simavr (host/simavr).
+//
+// Firmware code that spins on a variable an ISR changes, without touching
+// the device, is noticed by a CPU time watchdog that lets the simulated time
+// pass until the next interrupt. A firmware that would hang on the board
+// (flush() on an idle USART, a spin that never ends) aborts the process.
+
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+const uint32_t CLOCK = 16000000;	// CPU cycles per second
+
+// Voltage at an input as a function of the time in seconds
+typedef std::function<double( double )> Signal;
+
+//-----------------------------------------------------------------------------
+// Device
+//-----------------------------------------------------------------------------
+
+// Power on: registers at their reset values, the clock at 0, the inputs at
+// 0 V and the Arduino core's Timer0 and Timer2 set up.
+void reset( void );
+
+uint64_t now( void );
+double seconds( void );
+
+// The running context spends cycles, interrupts are taken meanwhile
+void spend( uint32_t cycles );
+
+// Rough cycles of the fixed work of a loop() pass and of a C interrupt
+// handler (response, prologue, epilogue and reti)
+extern uint32_t loopCycles;
+extern uint32_t isrCycles;
+
+// Prints the message with the device time and aborts
+void fault( const char *message );
+
+//-----------------------------------------------------------------------------
+// Analog inputs
+//-----------------------------------------------------------------------------
+// The ADC reference is AVCC (5 V) or the internal 1.1 V, a code is
+// floor( V / Vref * 1024 ), limited to 0 to 1023. The comparator compares
+// AIN0 (the signal, A0 unless set) against AIN1, the filtered PWM of
+// analogWrite() on the threshold pin, and is checked every COMPARATORSTEP
+// cycles while its interrupt or the input capture is on.
+
+const uint32_t COMPARATORSTEP = 8;
+
+void setInput( uint8_t input, Signal signal );
+void setComparator( Signal signal );
+double threshold( void );
+
+struct Conversion {
+	uint64_t sampled;	// cycle of the sample and hold
+	uint8_t input;
+	uint16_t code;
+};
+
+// Every completed conversion while logging is on
+void logConversions( bool on );
+std::vector<Conversion> &conversions( void );
+
+// Results the ISR did not read before the next one replaced them
+uint32_t lostConversions( void );
+
+//-----------------------------------------------------------------------------
+// Serial link
+//-----------------------------------------------------------------------------
+// The host end of the USART. Bytes are sent and received at the host baud
+// rate; if it is more than 4.5% off the device's, every byte arrives with
+// a framing error.
+
+void setHostBaud( uint32_t baud );
+uint32_t hostBaud( void );
+
+// Queues bytes that go out one after the other from now on
+void hostSend( const void *data, size_t length );
+void hostSend( const std::string &text );
+
+// Cycle at which the last queued byte has arrived
+uint64_t hostSendDone( void );
+
+struct Link {
+	std::vector<uint8_t> bytes;	// received from the device
+	std::vector<uint64_t> times;	// cycle the stop bit of each ended
+	uint32_t framingErrors;
+};
+
+Link &link( void );
+
+// Whether the USART has nothing to send and nothing on the line
+bool lineIdle( void );
+
+//-----------------------------------------------------------------------------
+// Pins
+//-----------------------------------------------------------------------------
+
+bool errorLed( void );
+uint32_t errorBlinks( void );
+
+//-----------------------------------------------------------------------------
+// Running the sketch
+//-----------------------------------------------------------------------------
+
+// reset() and setup()
+void boot( void );
+
+// Calls loop() until the clock has advanced by at least cycles
+void run( uint64_t cycles );
+
+// Calls loop() until done() or the clock has advanced by cycles, returns
+// done()
+bool runUntil( const std::function<bool()> &done, uint64_t cycles );
+
+// Runs a function of the sketch from the main context, e.g. runCommand()
+void call( const std::function<void()> &function );
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,119 @@
+//-----------------------------------------------------------------------------
+// scenario.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "scenario.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace sim {
+
+int isolate( const std::function<int()> &scenario )
+{
+	fflush( stdout );
+	fflush( stderr );
+
+	pid_t pid = fork();
+	if ( pid < 0 ) {
+		perror( "fork" );
+		return 1;
+	}
+	if ( pid == 0 ) {
+		int status = scenario();
+		fflush( stdout );
+		fflush( stderr );
+		_exit( status );
+	}
+
+	int status;
+	if ( waitpid( pid, &status, 0 ) < 0 ) return 1;
+	if ( WIFSIGNALED(status) ) return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+void command( const std::string &commands )
+{
+	hostSend( commands );
+
+	uint64_t done = hostSendDone();
+	if ( done > now() ) run( done - now() );
+
+	// A command without terminator ends after COMMANDDELAY
+	run( cycles( 0.003 ) );
+}
+
+// Only what arrives from now on
+Receiver::Receiver() : origin( link().bytes.size() ), consumed( origin )
+{
+}
+
+std::vector<scope::Record> &Receiver::poll( void )
+{
+	Link &l = link();
+
+	records.clear();
+	if ( l.bytes.size() > consumed ) {
+		reader.feed( l.bytes.data() + consumed, l.bytes.size() - consumed );
+	}
+
+	scope::Record record;
+	while ( reader.next( record ) ) {
+		record.offset += origin;
+		records.push_back( record );
+	}
+	consumed = l.bytes.size();
+	return records;
+}
+
+uint64_t Receiver::endTime( const scope::Record &record ) const
+{
+	return link().times[record.offset + record.bytes.size() - 1];
+}
+
+std::string text( size_t from )
+{
+	Link &l = link();
+	std::string result;
+
+	for ( size_t i = from; i < l.bytes.size() && l.bytes[i] != scope::SYNC; i++ ) {
+		result += (char)l.bytes[i];
+	}
+	return result;
+}
+
+long find( const std::string &pattern, size_t from )
+{
+	Link &l = link();
+	if ( l.bytes.size() < from + pattern.size() ) return -1;
+
+	const uint8_t *begin = l.bytes.data();
+	const uint8_t *end = begin + l.bytes.size();
+	const uint8_t *p = std::search( begin + from, end, pattern.begin(), pattern.end() );
+	return ( p == end ) ? -1 : p - begin;
+}
+
+} // namespace sim
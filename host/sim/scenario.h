@@ -0,0 +1,79 @@
+//-----------------------------------------------------------------------------
+// scenario.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Helpers for tests and benchmarks that run the sketch on the device
+//-----------------------------------------------------------------------------
+
+#ifndef SIM_SCENARIO_H
+#define SIM_SCENARIO_H
+
+#include "device.h"
+#include "stream.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// Runs a scenario in a child process, so that every one starts from the
+// initial globals of the sketch, and returns its exit status (128 plus the
+// signal number when it was killed, as by a device fault).
+int isolate( const std::function<int()> &scenario );
+
+// Cycles of a time in seconds
+static inline uint64_t cycles( double seconds )
+{
+	return (uint64_t)( seconds * CLOCK );
+}
+
+// Sends commands and runs until the device has received all of them
+void command( const std::string &commands );
+
+// Reads the records the device has sent since the last call
+class Receiver {
+public:
+	Receiver();
+
+	// Feeds the bytes received since the last call and takes the records
+	std::vector<scope::Record> &poll( void );
+
+	// Cycle at which the last byte of a record arrived
+	uint64_t endTime( const scope::Record &record ) const;
+
+	scope::StreamReader reader;
+
+private:
+	size_t origin;
+	size_t consumed;
+	std::vector<scope::Record> records;
+};
+
+// Text the device sent from byte offset from on, up to the next record
+std::string text( size_t from );
+
+// Offset of the first occurrence of a string in the link from offset from
+// on, or -1
+long find( const std::string &pattern, size_t from );
+
+} // namespace sim
+
+#endif
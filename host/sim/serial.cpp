@@ -0,0 +1,206 @@
+//-----------------------------------------------------------------------------
+// serial.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Arduino.h>
+#include "device.h"
+
+//-----------------------------------------------------------------------------
+// HardwareSerial
+//-----------------------------------------------------------------------------
+// The USART driver of the Arduino AVR core (1.8), register for register, so
+// that the sketch shares the USART with it as on the board: write() puts a
+// byte straight into UDR0 when the buffer is empty and clears TXC0, and
+// flush() waits for TXC0 once anything was written since begin().
+
+HardwareSerial Serial;
+
+void HardwareSerial::reset( void )
+{
+	rxHead = rxTail = 0;
+	txHead = txTail = 0;
+	written = false;
+}
+
+void HardwareSerial::begin( unsigned long baud )
+{
+	uint16_t setting = ( F_CPU / 4 / baud - 1 ) / 2;
+	UCSR0A = _BV(U2X0);
+
+	if ( ( F_CPU == 16000000UL && baud == 57600 ) || setting > 4095 ) {
+		UCSR0A = 0;
+		setting = ( F_CPU / 8 / baud - 1 ) / 2;
+	}
+
+	UBRR0H = setting >> 8;
+	UBRR0L = setting;
+
+	written = false;
+
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+	UCSR0B |= _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+	UCSR0B &= ~_BV(UDRIE0);
+}
+
+void HardwareSerial::end( void )
+{
+	flush();
+	UCSR0B &= ~( _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0) | _BV(UDRIE0) );
+	rxHead = rxTail;
+}
+
+int HardwareSerial::available( void )
+{
+	sim::spend( 8 );
+	return ( SERIAL_RX_BUFFER_SIZE + rxHead - rxTail ) % SERIAL_RX_BUFFER_SIZE;
+}
+
+int HardwareSerial::availableForWrite( void )
+{
+	sim::spend( 12 );
+	uint8_t head = txHead;
+	uint8_t tail = txTail;
+	if ( head >= tail ) return SERIAL_TX_BUFFER_SIZE - 1 - head + tail;
+	return tail - head - 1;
+}
+
+int HardwareSerial::peek( void )
+{
+	sim::spend( 8 );
+	if ( rxHead == rxTail ) return -1;
+	return rxBuffer[rxTail];
+}
+
+int HardwareSerial::read( void )
+{
+	sim::spend( 12 );
+	if ( rxHead == rxTail ) return -1;
+
+	uint8_t c = rxBuffer[rxTail];
+	rxTail = ( rxTail + 1 ) % SERIAL_RX_BUFFER_SIZE;
+	return c;
+}
+
+void HardwareSerial::flush( void )
+{
+	if ( !written ) return;
+
+	while ( bit_is_set( UCSR0B, UDRIE0 ) || bit_is_clear( UCSR0A, TXC0 ) ) {
+		if ( bit_is_clear( SREG, SREG_I ) && bit_is_set( UCSR0B, UDRIE0 ) ) {
+			if ( bit_is_set( UCSR0A, UDRE0 ) ) udrEmptyInterrupt();
+		}
+
+		// On the board this loop never ends
+		if ( bit_is_clear( UCSR0B, UDRIE0 ) && bit_is_clear( UCSR0A, TXC0 ) &&
+			sim::lineIdle() ) {
+			sim::fault( "Serial.flush() waits for TXC0 on an idle USART" );
+		}
+	}
+}
+
+size_t HardwareSerial::write( uint8_t c )
+{
+	written = true;
+
+	if ( txHead == txTail && bit_is_set( UCSR0A, UDRE0 ) ) {
+		uint8_t oldSREG = SREG;
+		cli();
+		UDR0 = c;
+		UCSR0A = ( UCSR0A & ( _BV(U2X0) | _BV(MPCM0) ) ) | _BV(TXC0);
+		SREG = oldSREG;
+		return 1;
+	}
+
+	uint8_t i = ( txHead + 1 ) % SERIAL_TX_BUFFER_SIZE;
+	while ( i == txTail ) {
+		if ( bit_is_clear( SREG, SREG_I ) ) {
+			if ( bit_is_set( UCSR0A, UDRE0 ) ) udrEmptyInterrupt();
+		}
+	}
+
+	txBuffer[txHead] = c;
+
+	uint8_t oldSREG = SREG;
+	cli();
+	txHead = i;
+	UCSR0B |= _BV(UDRIE0);
+	SREG = oldSREG;
+	return 1;
+}
+
+size_t HardwareSerial::write( const uint8_t *buffer, size_t size )
+{
+	for ( size_t i = 0; i < size; i++ ) write( buffer[i] );
+	return size;
+}
+
+size_t HardwareSerial::printSigned( long n, int base )
+{
+	if ( n < 0 && base == DEC ) {
+		size_t length = write( (uint8_t)'-' );
+		return length + printNumber( -(unsigned long)n, base );
+	}
+	return printNumber( n, base );
+}
+
+size_t HardwareSerial::printNumber( unsigned long n, int base )
+{
+	char digits[8 * sizeof(long) + 1];
+	char *p = digits + sizeof(digits);
+
+	if ( base < 2 ) base = 10;
+	do {
+		uint8_t digit = n % base;
+		n /= base;
+		*--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+	} while ( n );
+
+	return write( (const uint8_t *)p, digits + sizeof(digits) - p );
+}
+
+void HardwareSerial::udrEmptyInterrupt( void )
+{
+	uint8_t c = txBuffer[txTail];
+	txTail = ( txTail + 1 ) % SERIAL_TX_BUFFER_SIZE;
+
+	UDR0 = c;
+	UCSR0A = ( UCSR0A & ( _BV(U2X0) | _BV(MPCM0) ) ) | _BV(TXC0);
+
+	if ( txHead == txTail ) UCSR0B &= ~_BV(UDRIE0);
+}
+
+void HardwareSerial::rxCompleteInterrupt( void )
+{
+	if ( bit_is_clear( UCSR0A, UPE0 ) ) {
+		uint8_t c = UDR0;
+		uint8_t i = ( rxHead + 1 ) % SERIAL_RX_BUFFER_SIZE;
+
+		if ( i != rxTail ) {
+			rxBuffer[rxHead] = c;
+			rxHead = i;
+		}
+	}
+	else {
+		(void)(uint8_t)UDR0;
+	}
+}
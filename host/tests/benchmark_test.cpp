@@ -0,0 +1,147 @@
+//-----------------------------------------------------------------------------
+// benchmark_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Benchmark build
+//-----------------------------------------------------------------------------
+// The report of the `b` command of the BENCHMARK build against the device:
+// the missed samples have to be the conversions the device saw replaced
+// before the ISR read them, free running and with the sample clock, where
+// // Timer1 wraps at OCR1A. The cycle counts are the device model's, which
+// charges every interrupt a fixed 40 cycles, so the probe has to find at
+// least those outside the stamps.
+
+#include "check.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static void input( void )
+{
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 1000 * t ); } );
+}
+
+// Sends `b` and returns the offset of the report in the link
+static size_t report( void )
+{
+	size_t from = sim::link().bytes.size();
+	sim::command( "b;" );
+	sim::runUntil( [&]() { return sim::find( "Spectrum cycles:", from ) >= 0; }, captureCycles( 0.2 ) );
+	return from;
+}
+
+// Value of the report line "<name>: <value>", -1 when it is not there
+static long value( size_t report, const char *name )
+{
+	long at = sim::find( std::string( name ) + ": ", report );
+	if ( at < 0 ) return -1;
+	return atol( sim::text( at + strlen( name ) + 2 ).c_str() );
+}
+
+// Runs a capture for seconds between two reports and checks the second
+// against the device, returns its offset
+static size_t measure( const char *commands, double seconds )
+{
+	input();
+	sim::command( commands );
+	sim::run( captureCycles( 0.05 ) );
+	report();
+
+	// The counters are reset once the report is out and copied when the
+	// next is asked for, between the device's counts before and after
+	uint32_t start = sim::lostConversions();
+	sim::run( captureCycles( seconds ) );
+	uint32_t before = sim::lostConversions() - start;
+	size_t at = report();
+	uint32_t after = sim::lostConversions() - start;
+	long missed = value( at, "ADC missed samples" );
+
+	printf( "  %s count %ld, cycles avg %ld max %ld, overhead %ld, spread %ld, missed %ld (device %u to %u)\n",
+		commands, value( at, "ADC ISR count" ), value( at, "ADC ISR avg cycles" ),
+		value( at, "ADC ISR max cycles" ), value( at, "ADC ISR overhead" ),
+		value( at, "ADC latency spread" ), missed, before, after );
+
+	CHECK( value( at, "ADC ISR count" ) > 0 );
+	CHECK( value( at, "ADC ISR max cycles" ) >= value( at, "ADC ISR avg cycles" ) );
+	// 0 when the capture was frozen, with the ADC off, during the probe
+	CHECK( value( at, "ADC ISR overhead" ) == 0 || value( at, "ADC ISR overhead" ) >= 40 );
+	// A conversion lost after the last sample of a capture, before the
+	// ADC stops, has no entry after it to be seen from
+	long captures = value( at, "ADC ISR count" ) / ADCBUFFERSIZE + 1;
+	CHECK( missed >= (long)before - captures );
+	CHECK( missed <= (long)after );
+	return at;
+}
+
+static void freeRunning( void )
+{
+	sim::boot();
+	size_t at = measure( "f1;p32;e4;s;", 0.1 );
+	CHECK( value( at, "ADC missed samples" ) == 0 );
+	CHECK( value( at, "ADC latency max" ) < 0 );
+}
+
+// The ADC never stops in roll mode, so the probe always sees it
+static void overhead( void )
+{
+	sim::boot();
+	size_t at = measure( "f1;p32;e5;", 0.1 );
+	CHECK( value( at, "ADC missed samples" ) == 0 );
+	CHECK( value( at, "ADC ISR overhead" ) >= 40 );
+	CHECK( value( at, "Min safe prescaler" ) > 0 );
+	CHECK( value( at, "Min safe prescaler" ) <= 32 );
+}
+
+// Too fast for the ISR: the grid counts every lost conversion
+static void overrun( void )
+{
+	sim::boot();
+	size_t at = measure( "f1;p2;e4;s;", 0.05 );
+	CHECK( value( at, "ADC missed samples" ) > 0 );
+}
+
+static void clocked( void )
+{
+	sim::boot();
+	size_t at = measure( "f1;c20000;e4;s;", 0.1 );
+	long latency = value( at, "ADC latency max" );
+	printf( "  latency max %ld\n", latency );
+	CHECK( value( at, "ADC missed samples" ) == 0 );
+	CHECK( latency >= 40 );
+	CHECK( latency < (long)( F_CPU / 20000 ) );
+	// Periods of 800 cycles at clk/1 and 80000 at clk/8, Timer1 wraps at
+	// OCR1A within both
+	CHECK( value( at, "ADC ISR max cycles" ) < 800 );
+
+	at = measure( "c200;", 0.3 );
+	CHECK( value( at, "ADC ISR max cycles" ) < 800 );
+	CHECK( value( at, "ADC missed samples" ) == 0 );
+}
+
+int main( void )
+{
+	runScenario( "free running", freeRunning );
+	runScenario( "overhead", overhead );
+	runScenario( "overrun", overrun );
+	runScenario( "sample clock", clocked );
+	return testResult();
+}
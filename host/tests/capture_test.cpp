@@ -0,0 +1,273 @@
+//-----------------------------------------------------------------------------
+// capture_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Capture service
+//-----------------------------------------------------------------------------
+// The pieces of scope_capture without a port: the broadcast ring with two
+// consumers, one of them too slow, and recordings of the frames the sketch
+// sends, read back at random, by time and after a crash.
+
+#include "check.h"
+#include "link.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+
+// A record of n bytes whose bytes tell n and its number
+static scope::Record numberedRecord( uint64_t number, size_t length )
+{
+	scope::Record record;
+	record.type = scope::RECORD_FRAME;
+	record.offset = number * 1000;
+	record.bytes.resize( length );
+	for ( size_t i = 0; i < length; i++ ) record.bytes[i] = number + i;
+	return record;
+}
+
+static bool intact( const scope::Record &record, uint64_t number )
+{
+	if ( record.offset != number * 1000 ) return false;
+	for ( size_t i = 0; i < record.bytes.size(); i++ ) {
+		if ( record.bytes[i] != (uint8_t)( number + i ) ) return false;
+	}
+	return true;
+}
+
+static void ringBroadcast( void )
+{
+	const uint64_t RECORDS = 200000;
+	scope::BroadcastRing ring( 64, 256 );
+
+	CHECK( !ring.publish( numberedRecord( 0, 257 ) ) );
+
+	// Both consumers see every record, in order and whole
+	scope::BroadcastRing::Cursor cursors[2] = { ring.subscribe(), ring.subscribe() };
+	uint64_t read[2] = {};
+	uint64_t broken[2] = {};
+	std::thread consumers[2];
+	for ( int c = 0; c < 2; c++ ) {
+		consumers[c] = std::thread( [&, c]() {
+			scope::Record record;
+			while ( ring.wait( cursors[c], record, 100 ) != scope::BroadcastRing::CLOSED ) {
+				if ( record.bytes.empty() ) continue;
+				if ( !intact( record, read[c] + cursors[c].dropped ) ) broken[c]++;
+				read[c]++;
+				record.bytes.clear();
+			}
+		} );
+	}
+
+	// The producer waits for the slower consumer, so nothing is lost
+	for ( uint64_t n = 0; n < RECORDS; n++ ) {
+		while ( n - cursors[0].next >= ring.slots() / 2 || n - cursors[1].next >= ring.slots() / 2 ) {
+			std::this_thread::yield();
+		}
+		ring.publish( numberedRecord( n, 1 + n % 256 ) );
+	}
+	ring.close();
+	for ( std::thread &consumer : consumers ) consumer.join();
+
+	printf( "  %llu and %llu records read\n", (unsigned long long)read[0], (unsigned long long)read[1] );
+	for ( int c = 0; c < 2; c++ ) {
+		CHECK( read[c] == RECORDS );
+		CHECK( cursors[c].dropped == 0 );
+		CHECK( broken[c] == 0 );
+	}
+	CHECK( ring.published() == RECORDS );
+}
+
+static void ringOverrun( void )
+{
+	scope::BroadcastRing ring( 8, 16 );
+	scope::BroadcastRing::Cursor fast = ring.subscribe();
+	scope::BroadcastRing::Cursor slow = ring.subscribe();
+	scope::Record record;
+
+	CHECK( ring.read( fast, record ) == scope::BroadcastRing::EMPTY );
+
+	// The slow consumer reads nothing while 20 records go through a ring
+	// of 8, and loses the ones that were overwritten
+	for ( uint64_t n = 0; n < 20; n++ ) {
+		ring.publish( numberedRecord( n, 10 ) );
+		CHECK( ring.read( fast, record ) == scope::BroadcastRing::READ );
+		CHECK( intact( record, n ) );
+	}
+	CHECK( fast.dropped == 0 );
+
+	uint64_t first = 0;
+	unsigned read = 0;
+	while ( ring.read( slow, record ) == scope::BroadcastRing::READ ) {
+		if ( read == 0 ) first = record.offset / 1000;
+		CHECK( intact( record, first + read ) );
+		read++;
+	}
+	printf( "  %u records read, %llu dropped\n", read, (unsigned long long)slow.dropped );
+	CHECK( slow.dropped + read == 20 );
+	CHECK( read == ring.slots() - 1 );
+
+	// A consumer that subscribes late only takes what comes after
+	scope::BroadcastRing::Cursor late = ring.subscribe();
+	CHECK( ring.read( late, record ) == scope::BroadcastRing::EMPTY );
+
+	ring.publish( numberedRecord( 20, 10 ) );
+	ring.close();
+	CHECK( ring.read( late, record ) == scope::BroadcastRing::READ );
+	CHECK( intact( record, 20 ) );
+	CHECK( ring.read( late, record ) == scope::BroadcastRing::CLOSED );
+	CHECK( ring.wait( fast, record, 10 ) == scope::BroadcastRing::READ );
+	CHECK( ring.wait( fast, record, 10 ) == scope::BroadcastRing::CLOSED );
+}
+
+static void ringRace( void )
+{
+	const uint64_t RECORDS = 500000;
+	scope::BroadcastRing ring( 16, 256 );
+
+	// The producer does not wait: it overwrites slots while the consumer
+	// copies them, and what the consumer takes is whole or not taken
+	scope::BroadcastRing::Cursor cursor = ring.subscribe();
+	uint64_t read = 0;
+	uint64_t broken = 0;
+	uint64_t backwards = 0;
+	std::thread consumer( [&]() {
+		scope::Record record;
+		uint64_t last = 0;
+		while ( ring.wait( cursor, record, 100 ) != scope::BroadcastRing::CLOSED ) {
+			if ( record.bytes.empty() ) continue;
+			uint64_t number = record.offset / 1000;
+			if ( !intact( record, number ) || record.bytes.size() != 1 + number % 256 ) broken++;
+			if ( read && number <= last ) backwards++;
+			last = number;
+			read++;
+			record.bytes.clear();
+		}
+	} );
+
+	for ( uint64_t n = 0; n < RECORDS; n++ ) ring.publish( numberedRecord( n, 1 + n % 256 ) );
+	ring.close();
+	consumer.join();
+
+	printf( "  %llu records read, %llu dropped\n", (unsigned long long)read, (unsigned long long)cursor.dropped );
+	CHECK( broken == 0 );
+	CHECK( backwards == 0 );
+	CHECK( read + cursor.dropped <= RECORDS );
+	CHECK( read > 0 );
+}
+
+static std::string temporaryDirectory( void )
+{
+	char directory[] = "/tmp/capture_test.XXXXXX";
+	return mkdtemp( directory ) ? directory : "";
+}
+
+static void removeRecording( const std::string &directory, const std::string &path )
+{
+	unlink( path.c_str() );
+	unlink( ( path + ".idx" ).c_str() );
+	rmdir( directory.c_str() );
+}
+
+static void recording( void )
+{
+	std::string directory = temporaryDirectory();
+	CHECK( !directory.empty() );
+	std::string path = directory + "/scope.rec";
+
+	// A capture of the sketch, then the records it sent go into
+	// a recording, with made up receive times 1 ms apart
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 1000 * t ); } );
+	sim::command( "f1;p32;e4;s;" );
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.5 ) );
+	std::vector<scope::Record> sent = receiver.poll();
+	scope::Record record;
+	printf( "  %zu records sent\n", sent.size() );
+	CHECK( sent.size() >= 5 );
+
+	scope::RecordingWriter writer;
+	CHECK( writer.create( path ) );
+	for ( size_t i = 0; i < sent.size(); i++ ) {
+		CHECK( writer.append( sent[i], 1000000 + 1000 * i ) );
+	}
+	CHECK( writer.records() == sent.size() );
+	CHECK( writer.close() );
+
+	scope::RecordingReader reader;
+	CHECK( reader.open( path ) );
+	CHECK( reader.records() == sent.size() );
+
+	// Any record, in any order, is the one that was sent
+	for ( size_t k = 0; k < sent.size() && reader.records() == sent.size(); k++ ) {
+		size_t i = ( k * 7 + 3 ) % sent.size();
+		scope::Record back = reader.record( i );
+		CHECK( back.bytes == sent[i].bytes );
+		CHECK( back.type == sent[i].type );
+		CHECK( reader.entry( i ).received == 1000000 + 1000 * i );
+		if ( scope::numbered( sent[i].type ) ) {
+			CHECK( reader.entry( i ).sequence == scope::getWord( sent[i].bytes.data() + 2 ) );
+		}
+	}
+
+	// By time: at, between and past the receive times
+	CHECK( reader.find( 0 ) == 0 );
+	CHECK( reader.find( 1002000 ) == 2 );
+	CHECK( reader.find( 1002001 ) == 3 );
+	CHECK( reader.find( 1000000 + 1000 * sent.size() ) == sent.size() );
+
+	// The recording is the stream, a reader splits it the same way
+	scope::StreamReader stream;
+	std::vector<uint8_t> bytes( reader.bytes( 0 ), reader.bytes( 0 ) + writer.bytes() );
+	stream.feed( bytes.data(), bytes.size() );
+	size_t records = 0;
+	while ( stream.next( record ) ) records++;
+	CHECK( records == sent.size() );
+	CHECK( stream.skippedBytes() == 0 );
+	reader.close();
+
+	// After a crash the index is as long as the chunk it grew to, the
+	// entries that were not written are zeros and are not records
+	CHECK( truncate( ( path + ".idx" ).c_str(), 1 << 20 ) == 0 );
+	CHECK( reader.open( path ) );
+	CHECK( reader.records() == sent.size() );
+	reader.close();
+
+	// An entry whose record did not make it to the stream is not one
+	CHECK( truncate( path.c_str(), writer.bytes() - 1 ) == 0 );
+	CHECK( reader.open( path ) );
+	CHECK( reader.records() == sent.size() - 1 );
+	reader.close();
+
+	removeRecording( directory, path );
+}
+
+int main( void )
+{
+	runScenario( "ring, two consumers", ringBroadcast );
+	runScenario( "ring, overrun", ringOverrun );
+	runScenario( "ring, producer running over a consumer", ringRace );
+	runScenario( "recording", recording );
+	return testResult();
+}
@@ -0,0 +1,76 @@
+//-----------------------------------------------------------------------------
+// check.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Checks for the host tests
+//-----------------------------------------------------------------------------
+// A test is a set of scenarios, each run by runScenario() in a process of
+// its own; CHECK() reports a failed condition and the scenario fails with
+// it. A device fault fails the scenario as well.
+
+#ifndef SCOPE_CHECK_H
+#define SCOPE_CHECK_H
+
+#include "scenario.h"
+#include "small-scope.h"
+
+#include <stdio.h>
+
+// Scenarios are timed for CONFIG_UNO; the captures of larger buffers take
+// longer and run for as many more captures' time
+static const double CAPTURESCALE = ADCBUFFERSIZE > 1024 ? ADCBUFFERSIZE / 1024.0 : 1.0;
+
+static inline uint64_t captureCycles( double seconds )
+{
+	return sim::cycles( seconds * CAPTURESCALE );
+}
+
+static int checkFailures = 0;
+
+#define CHECK( condition ) \
+	do { \
+		if ( !( condition ) ) { \
+			printf( "  %s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #condition ); \
+			checkFailures++; \
+		} \
+	} while ( 0 )
+
+static int scenarioFailures = 0;
+
+static inline void runScenario( const char *name, void (*scenario)( void ) )
+{
+	printf( "%s\n", name );
+	int status = sim::isolate( [&]() {
+		scenario();
+		return checkFailures ? 1 : 0;
+	} );
+	if ( status != 0 ) {
+		printf( "  FAILED (status %d)\n", status );
+		scenarioFailures++;
+	}
+}
+
+static inline int testResult( void )
+{
+	if ( scenarioFailures ) printf( "%d failed\n", scenarioFailures );
+	return scenarioFailures ? 1 : 0;
+}
+
+#endif
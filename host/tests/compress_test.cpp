@@ -0,0 +1,141 @@
+//-----------------------------------------------------------------------------
+// compress_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Compressed frames
+//-----------------------------------------------------------------------------
+// Puts a pattern into the frozen capture, sends it with sendFrame() as f2
+// does and decodes what arrives with the host decoder: the samples must come
+// back unchanged, oldest first, whatever the codes and the stop index.
+
+#include "check.h"
+
+#include <math.h>
+
+struct Pattern {
+	const char *name;
+	uint8_t (*sample)( uint16_t i );
+	bool compresses;		// sent as a compressed frame
+};
+
+static uint32_t hash( uint32_t x )
+{
+	x *= 2654435761u;
+	return x ^ ( x >> 15 );
+}
+
+static const Pattern patterns[] = {
+	// One run after the other, each longer than RUNMAX
+	{ "DC", []( uint16_t ) -> uint8_t { return 128; }, true },
+	// Pairs of small deltas
+	{ "ramp", []( uint16_t i ) -> uint8_t { return i / 2; }, true },
+	// Single deltas up to 31
+	{ "sine", []( uint16_t i ) -> uint8_t { return 128 + 100 * sin( i * 0.2 ); }, true },
+	// 0 to 255 and back are deltas of -1 and +1
+	{ "rail to rail square", []( uint16_t i ) -> uint8_t { return ( i & 32 ) ? 255 : 0; }, true },
+	// Wraps from the top to the bottom by a delta of +3
+	{ "wrapping sawtooth", []( uint16_t i ) -> uint8_t { return i * 3; }, true },
+	// Runs and literal runs longer than LITERALMAX in turn
+	{ "runs and bursts", []( uint16_t i ) -> uint8_t {
+		return ( ( i / 100 ) & 1 ) ? hash( i ) : 40; }, true },
+	// Does not get smaller, sent as a plain frame
+	{ "noise", []( uint16_t i ) -> uint8_t { return hash( i ); }, false },
+};
+
+static void roundTrip( const Pattern &pattern, uint16_t stop )
+{
+	for ( uint16_t i = 0; i < captureSize; i++ ) ADCBuffer[i] = pattern.sample( i );
+	frozenBuffer = ADCBuffer;
+	frozenStopIndex = stop;
+	frozenTriggerIndex = ( stop + captureSize / 2 ) % captureSize;
+
+	sim::Receiver receiver;
+	sim::call( sendFrame );
+	sim::runUntil( []() { return !txBusy && sim::lineIdle(); }, captureCycles( 0.1 ) );
+
+	std::vector<scope::Record> &records = receiver.poll();
+	CHECK( records.size() == 1 );
+	if ( records.size() != 1 ) return;
+
+	const scope::Record &record = records[0];
+	CHECK( record.type == ( pattern.compresses ? scope::RECORD_COMPRESSED : scope::RECORD_FRAME ) );
+	if ( pattern.compresses ) CHECK( record.bytes.size() < 12 + captureSize + 2u );
+
+	scope::Frame frame;
+	CHECK( scope::decodeFrame( record, frame ) );
+	CHECK( frame.size == captureSize );
+	CHECK( frame.samples.size() == captureSize );
+	CHECK( frame.triggerIndex == frozenTriggerIndex );
+	CHECK( frame.stopIndex == stop );
+
+	bool same = frame.samples.size() == captureSize;
+	for ( uint16_t i = 0; same && i < captureSize; i++ ) {
+		same = frame.samples[i] == pattern.sample( ( stop + i ) % captureSize );
+	}
+	if ( !same ) printf( "  %s, stop %u: samples differ\n", pattern.name, stop );
+	CHECK( same );
+}
+
+static void patternsRoundTrip( void )
+{
+	sim::boot();
+	sim::command( "f2;" );
+
+	for ( const Pattern &pattern : patterns ) {
+		for ( uint16_t stop : { 0, 1, 517 % ADCBUFFERSIZE, ADCBUFFERSIZE - 1 } ) {
+			roundTrip( pattern, stop );
+		}
+	}
+}
+
+// The decoder rejects a payload that gives too few or too many samples
+static void truncatedPayload( void )
+{
+	sim::boot();
+	sim::command( "f2;" );
+	for ( uint16_t i = 0; i < captureSize; i++ ) ADCBuffer[i] = 128;
+	frozenBuffer = ADCBuffer;
+	frozenStopIndex = 0;
+
+	sim::Receiver receiver;
+	sim::call( sendFrame );
+	sim::runUntil( []() { return !txBusy && sim::lineIdle(); }, captureCycles( 0.1 ) );
+	std::vector<scope::Record> &records = receiver.poll();
+	CHECK( records.size() == 1 );
+	if ( records.size() != 1 ) return;
+
+	scope::Frame frame;
+	scope::Record record = records[0];
+	size_t payload = record.bytes.size() - 12 - 2 - 2;
+	CHECK( scope::decodeFrame( record, frame ) );
+
+	// One run less, then one run more
+	record.bytes[12 + 2 + payload - 1] -= 1;
+	CHECK( !scope::decodeFrame( record, frame ) );
+	record.bytes[12 + 2 + payload - 1] += 2;
+	CHECK( !scope::decodeFrame( record, frame ) );
+}
+
+int main( void )
+{
+	runScenario( "patterns", patternsRoundTrip );
+	runScenario( "payload of the wrong length", truncatedPayload );
+	return testResult();
+}
@@ -0,0 +1,341 @@
+//-----------------------------------------------------------------------------
+// frame_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Framed output
+//-----------------------------------------------------------------------------
+
+#include "check.h"
+
+#include <math.h>
+#include <util/crc16.h>
+
+static void input( void )
+{
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 1000 * t ); } );
+}
+
+// Frames received in seconds
+static std::vector<scope::Frame> frames( double seconds )
+{
+	sim::Receiver receiver;
+	sim::run( captureCycles( seconds ) );
+
+	std::vector<scope::Frame> result;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		if ( scope::decodeFrame( record, frame ) ) result.push_back( frame );
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// Round trip
+//-----------------------------------------------------------------------------
+// The samples of every frame are a run of consecutive conversions of the
+// device, in the order they were made, and the sequence numbers count up.
+// The input carries a pseudo-random ripple so that a run of samples only
+// matches the conversions at one place.
+
+static double ripple( double t )
+{
+	uint32_t x = (uint32_t)( t * 1e6 ) * 2654435761u;
+	return ( ( x >> 24 ) - 128 ) * 0.002;
+}
+
+static void roundTrip( const char *commands )
+{
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 1.5 * sin( 2 * M_PI * 700 * t ) + ripple( t ); } );
+	sim::logConversions( true );
+	sim::command( commands );
+
+	std::vector<scope::Frame> received = frames( 0.3 );
+	const std::vector<sim::Conversion> &log = sim::conversions();
+	CHECK( received.size() >= 3 );
+
+	size_t from = 0;
+	for ( size_t n = 0; n < received.size(); n++ ) {
+		const scope::Frame &frame = received[n];
+		if ( n > 0 ) CHECK( frame.sequence == (uint16_t)( received[n - 1].sequence + 1 ) );
+
+		bool found = false;
+		for ( size_t i = from; !found && i + frame.samples.size() <= log.size(); i++ ) {
+			size_t k = 0;
+			while ( k < frame.samples.size() && frame.samples[k] == log[i + k].code >> 2 ) k++;
+			if ( k == frame.samples.size() ) {
+				found = true;
+				from = i + k;
+			}
+		}
+		CHECK( found );
+	}
+}
+
+static void roundTripSingle( void ) { roundTrip( "f1;p32;e4;s;" ); }
+static void roundTripTriggered( void ) { roundTrip( "f1;p16;e3;t128;s;" ); }
+static void roundTripPingPong( void ) { roundTrip( "f1;m1;p64;e4;s;" ); }
+
+//-----------------------------------------------------------------------------
+// Rate
+//-----------------------------------------------------------------------------
+// The header tells the prescaler the ADC ran at, and with the sample clock,
+// which lowers it from the setting here, the rate in a channel block.
+
+static void rate( void )
+{
+	sim::boot();
+	input();
+	sim::command( "f1;p32;e4;s;" );
+	std::vector<scope::Frame> received = frames( 0.1 );
+	CHECK( !received.empty() );
+	for ( const scope::Frame &frame : received ) {
+		CHECK( frame.prescaler == 32 );
+		CHECK( !( frame.mode & scope::MODE_CHANNELS ) );
+	}
+
+	sim::command( "p128;c50000;" );
+	frames( 0.05 );
+	received = frames( 0.1 );
+	CHECK( !received.empty() );
+	for ( const scope::Frame &frame : received ) {
+		CHECK( frame.prescaler < 128 );
+		CHECK( (uint32_t)frame.prescaler * AUTOCYCLES <= F_CPU / 50000 );
+		CHECK( frame.channels == 1 );
+		CHECK( frame.channelRate == 50000 );
+		CHECK( frame.samples.size() == frame.size );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CRC
+//-----------------------------------------------------------------------------
+// The reader checks frames with the CRC the sketch computes with
+// _crc_ccitt_update(): CRC-16/MCRF4XX, whose check value is 0x6F91.
+
+static void crc( void )
+{
+	const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+	CHECK( scope::crc16( check, sizeof(check) ) == 0x6F91 );
+
+	uint16_t sketch = 0xFFFF;
+	for ( uint8_t byte : check ) sketch = _crc_ccitt_update( sketch, byte );
+	CHECK( sketch == 0x6F91 );
+
+	// Every record on the link passes, and fails with any bit flipped
+	sim::boot();
+	input();
+	sim::command( "f1;p32;e4;s;" );
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.1 ) );
+	std::vector<scope::Record> records = receiver.poll();
+	CHECK( !records.empty() );
+
+	for ( const scope::Record &record : records ) {
+		std::vector<uint8_t> bytes = record.bytes;
+		size_t length = bytes.size();
+		CHECK( scope::crc16( bytes.data() + 2, length - 4 ) == scope::getWord( bytes.data() + length - 2 ) );
+		for ( size_t i = 2; i < length; i += 97 ) {
+			bytes[i] ^= 0x10;
+			CHECK( scope::crc16( bytes.data() + 2, length - 4 ) != scope::getWord( bytes.data() + length - 2 ) );
+			bytes[i] ^= 0x10;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Resynchronization
+//-----------------------------------------------------------------------------
+// The records of a recorded stream come out the same whatever pieces it is
+// fed in. A corrupted record is dropped and the reader finds the next one,
+// also past text and a false sync word in between.
+
+static std::vector<scope::Record> read( const std::vector<uint8_t> &stream, size_t piece )
+{
+	scope::StreamReader reader;
+	std::vector<scope::Record> records;
+	scope::Record record;
+	for ( size_t i = 0; i < stream.size(); i += piece ) {
+		reader.feed( stream.data() + i, std::min( piece, stream.size() - i ) );
+		while ( reader.next( record ) ) records.push_back( record );
+	}
+	return records;
+}
+
+static void resync( void )
+{
+	sim::boot();
+	input();
+	sim::command( "f1;p32;e4;s;" );
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.25 ) );
+	std::vector<scope::Record> records = receiver.poll();
+	CHECK( records.size() >= 4 );
+
+	std::vector<uint8_t> stream;
+	for ( const scope::Record &record : records ) {
+		stream.insert( stream.end(), record.bytes.begin(), record.bytes.end() );
+	}
+
+	for ( size_t piece : { (size_t)1, (size_t)7, (size_t)64, (size_t)1000, stream.size() } ) {
+		std::vector<scope::Record> again = read( stream, piece );
+		CHECK( again.size() == records.size() );
+		for ( size_t i = 0; i < again.size() && i < records.size(); i++ ) {
+			CHECK( again[i].bytes == records[i].bytes );
+		}
+	}
+
+	// Corrupt the second record, put text and a false sync word before
+	// the third
+	std::vector<uint8_t> damaged;
+	for ( size_t i = 0; i < records.size(); i++ ) {
+		std::vector<uint8_t> bytes = records[i].bytes;
+		if ( i == 1 ) bytes[bytes.size() / 2] ^= 0x01;
+		if ( i == 2 ) {
+			const char text[] = "Trigger: 2\r\n\xA5\x5A\x01";
+			damaged.insert( damaged.end(), text, text + sizeof(text) - 1 );
+		}
+		damaged.insert( damaged.end(), bytes.begin(), bytes.end() );
+	}
+
+	std::vector<scope::Record> again = read( damaged, 13 );
+	CHECK( again.size() == records.size() - 1 );
+	if ( again.size() == records.size() - 1 ) {
+		CHECK( again[0].bytes == records[0].bytes );
+		for ( size_t i = 1; i < again.size(); i++ ) CHECK( again[i].bytes == records[i + 1].bytes );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Trigger position
+//-----------------------------------------------------------------------------
+// Without a trigger the capture ends waitDuration samples after it is armed,
+// and the header puts the trigger there, so that hosts draw continuous
+// captures like triggered ones.
+
+static void continuousTrigger( const char *commands )
+{
+	sim::boot();
+	input();
+	sim::command( commands );
+
+	std::vector<scope::Frame> received = frames( 0.3 );
+	CHECK( received.size() >= 5 );
+	for ( const scope::Frame &frame : received ) {
+		CHECK( frame.trigger == frame.size - waitDuration );
+	}
+}
+
+static void continuousSingle( void ) { continuousTrigger( "f1;p32;e4;s;" ); }
+static void continuousPingPong( void ) { continuousTrigger( "f1;m1;p32;e4;s;" ); }
+static void continuousSegmented( void ) { continuousTrigger( "f1;m2;k4;p32;e4;s;" ); }
+
+// A flat input never triggers, the auto trigger timeout gives frames. The
+// longest timeout does not wrap around to a short one.
+static void autoTrigger( void )
+{
+	sim::boot();
+	sim::setInput( 0, []( double ) { return 1.0; } );
+	sim::command( "f1;p32;e3;t128;y20;s;" );
+	CHECK( frames( 0.3 ).size() >= 3 );
+
+	sim::command( "y4294968;" );
+	frames( 0.1 );
+	CHECK( autoTimeout == AUTOTIMEOUTMAX * 1000 );
+	CHECK( frames( 0.3 ).empty() );
+}
+
+//-----------------------------------------------------------------------------
+// Decimation
+//-----------------------------------------------------------------------------
+// With a3 every frame and view says so and gives the factor and the start of
+// the first min/max pair. From there on each pair is the minimum and the
+// maximum of a block of consecutive conversions, one block after the other;
+// pairs taken from any other start do not match the conversions anywhere.
+// Triggered frames and views start with either half of a pair.
+
+// True when samples from phase on are pairs of blocks of factor
+// conversions somewhere in the log
+static bool peakPairs( const std::vector<uint16_t> &samples, uint8_t phase, uint8_t factor,
+	const std::vector<sim::Conversion> &log )
+{
+	size_t pairs = ( samples.size() - phase ) / 2;
+	for ( size_t i = 0; i + pairs * factor <= log.size(); i++ ) {
+		size_t k = 0;
+		for ( ; k < pairs; k++ ) {
+			uint16_t minimum = 255, maximum = 0;
+			for ( size_t j = 0; j < factor; j++ ) {
+				uint16_t code = log[i + k * factor + j].code >> 2;
+				if ( code < minimum ) minimum = code;
+				if ( code > maximum ) maximum = code;
+			}
+			if ( samples[phase + 2 * k] != minimum || samples[phase + 2 * k + 1] != maximum ) break;
+		}
+		if ( k == pairs ) return true;
+	}
+	return false;
+}
+
+static void decimation( const char *commands, uint8_t type )
+{
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 1.5 * sin( 2 * M_PI * 300 * t ) + ripple( t ); } );
+	sim::logConversions( true );
+	sim::command( commands );
+
+	std::vector<scope::Frame> received = frames( 0.3 );
+	const std::vector<sim::Conversion> &log = sim::conversions();
+	CHECK( received.size() >= 3 );
+
+	for ( const scope::Frame &frame : received ) {
+		CHECK( frame.type == type );
+		CHECK( frame.decimation == scope::DECIMATION_PEAK );
+		CHECK( frame.decimateFactor == 4 );
+		CHECK( frame.decimatePhase <= 1 );
+		CHECK( peakPairs( frame.samples, frame.decimatePhase, 4, log ) );
+		CHECK( !peakPairs( frame.samples, frame.decimatePhase ^ 1, 4, log ) );
+	}
+}
+
+static void decimationSingle( void ) { decimation( "f1;a3;n4;p32;e4;s;", scope::RECORD_FRAME ); }
+static void decimationTriggered( void ) { decimation( "f1;a3;n4;p32;g1;e3;t128;s;", scope::RECORD_FRAME ); }
+static void decimationPingPong( void ) { decimation( "f1;m1;a3;n4;p32;e4;s;", scope::RECORD_FRAME ); }
+static void decimationSegmented( void ) { decimation( "f1;m2;k4;a3;n4;p32;e4;s;", scope::RECORD_FRAME ); }
+static void decimationView( void ) { decimation( "f1;a3;n4;p32;<101>40;e4;s;", scope::RECORD_VIEW ); }
+
+int main( void )
+{
+	runScenario( "round trip, continuous", roundTripSingle );
+	runScenario( "round trip, triggered", roundTripTriggered );
+	runScenario( "round trip, ping-pong", roundTripPingPong );
+	runScenario( "rate", rate );
+	runScenario( "CRC", crc );
+	runScenario( "resynchronization", resync );
+	runScenario( "continuous trigger, single", continuousSingle );
+	runScenario( "continuous trigger, ping-pong", continuousPingPong );
+	runScenario( "continuous trigger, segmented", continuousSegmented );
+	runScenario( "auto trigger timeout", autoTrigger );
+	runScenario( "decimation, single", decimationSingle );
+	runScenario( "decimation, triggered", decimationTriggered );
+	runScenario( "decimation, ping-pong", decimationPingPong );
+	runScenario( "decimation, segmented", decimationSegmented );
+	runScenario( "decimation, view", decimationView );
+	return testResult();
+}
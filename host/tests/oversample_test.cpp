@@ -0,0 +1,131 @@
+//-----------------------------------------------------------------------------
+// oversample_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Oversampling
+//-----------------------------------------------------------------------------
+// The figures in "Oversampling" in README.md: a 5 Hz sine with 1 LSB of
+// uniform dither, and a 0.1 Hz one without, which moves by less than 0.05
+// LSB during the 16 conversions of an o2 sample, captured at 10 bits and
+// with o1 and o2. The error
+// of a sample is its value in 10-bit LSB against the mean of the sine over
+// the conversions it was made of; a code k stands for inputs from k to k+1
+// LSB, so the sine is taken 0.5 LSB lower. The conversions of a sample come
+// from the conversion log, found like in unpack_test.
+
+#include "check.h"
+
+#include <math.h>
+
+static const double LSB = 5.0 / 1024;
+
+static double frequency;
+
+static double sine( double t )
+{
+	return 2.5 + 1.5 * sin( 2 * M_PI * frequency * t );
+}
+
+// Uniform in -0.5 to 0.5 LSB, new every microsecond
+static double dither( double t )
+{
+	uint32_t x = (uint32_t)( t * 1e6 ) * 2654435761u;
+	x ^= x >> 16;
+	x *= 0x45D9F3B;
+	x ^= x >> 16;
+	return ( ( x & 0xFFFF ) / 65536.0 - 0.5 ) * LSB;
+}
+
+// RMS error in LSB of the 10 or 12-bit samples of all frames
+static double rmsError( const char *commands, uint8_t k, bool dithered )
+{
+	sim::boot();
+	frequency = dithered ? 5 : 0.1;
+	if (dithered) sim::setInput( 0, []( double t ) { return sine( t ) + dither( t ); } );
+	else sim::setInput( 0, sine );
+	sim::logConversions( true );
+	sim::command( commands );
+
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.5 ) );
+	const std::vector<sim::Conversion> &log = sim::conversions();
+	size_t step = 1u << 2 * k;
+	double scale = k ? 4 : 1;	// sample units per 10-bit LSB
+	uint8_t shift = k ? 2 * ( k - 1 ) : 0;
+
+	double sum = 0;
+	size_t count = 0;
+	size_t from = 0;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		if ( !scope::decodeFrame( record, frame ) ) continue;
+
+		// Position of the frame in the log
+		size_t first = SIZE_MAX;
+		for ( size_t i = from; first == SIZE_MAX && i + frame.samples.size() * step <= log.size(); i++ ) {
+			size_t n = 0;
+			for ( ; n < frame.samples.size(); n++ ) {
+				uint32_t codes = 0;
+				for ( size_t j = 0; j < step; j++ ) codes += log[i + n * step + j].code;
+				if ( frame.samples[n] != ( ( codes + ( ( 1 << shift ) >> 1 ) ) >> shift ) ) break;
+			}
+			if ( n == frame.samples.size() ) first = i;
+		}
+		CHECK( first != SIZE_MAX );
+		if ( first == SIZE_MAX ) continue;
+		from = first + frame.samples.size() * step;
+
+		for ( size_t n = 0; n < frame.samples.size(); n++ ) {
+			double input = 0;
+			for ( size_t j = 0; j < step; j++ ) {
+				input += sine( (double)log[first + n * step + j].sampled / sim::CLOCK );
+			}
+			double expected = input / step / LSB - 0.5;
+			double error = frame.samples[n] / scale - expected;
+			sum += error * error;
+			count++;
+		}
+	}
+	CHECK( count > 1000 );
+	return count ? sqrt( sum / count ) : 0;
+}
+
+static void check( const char *name, const char *commands, uint8_t k, bool dithered, double documented )
+{
+	double rms = rmsError( commands, k, dithered );
+	printf( "  %-24s %.3f LSB, documented %.2f\n", name, rms, documented );
+	CHECK( fabs( rms - documented ) < 0.03 );
+}
+
+static void tenBits( void ) { check( "10 bits, dither", "f1;l10;p64;e4;s;", 0, true, 0.41 ); }
+static void oversampleO1( void ) { check( "o1, dither", "f1;l10;o1;p32;e4;s;", 1, true, 0.20 ); }
+static void oversampleO2( void ) { check( "o2, dither", "f1;l10;o2;p16;e4;s;", 2, true, 0.13 ); }
+static void tenBitsPlain( void ) { check( "10 bits, no dither", "f1;l10;p64;e4;s;", 0, false, 0.29 ); }
+static void oversampleO2Plain( void ) { check( "o2, no dither", "f1;l10;o2;p16;e4;s;", 2, false, 0.28 ); }
+
+int main( void )
+{
+	runScenario( "10 bits", tenBits );
+	runScenario( "o1", oversampleO1 );
+	runScenario( "o2", oversampleO2 );
+	runScenario( "10 bits without dither", tenBitsPlain );
+	runScenario( "o2 without dither", oversampleO2Plain );
+	return testResult();
+}
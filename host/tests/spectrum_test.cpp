@@ -0,0 +1,147 @@
+//-----------------------------------------------------------------------------
+// spectrum_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Spectrum mode
+//-----------------------------------------------------------------------------
+// The figures in "Spectrum mode" in README.md: captures of two sines and
+// 1 LSB of noise go through sendSpectrum() as f4 and f5 send them, and the
+// bins are compared with a double precision DFT of the newest N samples,
+// less their mean. For each capture the test reports the RMS error of the
+// 16-bit bins, the largest error in dB below the peak and the largest error
+// of the 8-bit bins that are within 40 dB of the peak.
+
+#include "check.h"
+
+#include <math.h>
+#include <complex>
+
+static uint32_t state = 1;
+
+static double uniform( void )
+{
+	state = state * 1664525 + 1013904223;
+	return ( state >> 8 ) / 16777216.0 - 0.5;
+}
+
+// A capture of the sines with frequencies in bins of an N point DFT, and
+// its DFT
+static void capture( double f1, double f2, uint16_t n, std::vector<double> &dft )
+{
+	for ( uint16_t i = 0; i < captureSize; i++ ) {
+		double x = 128 + 43 * sin( 2 * M_PI * f1 * i / n ) + 10 * sin( 2 * M_PI * f2 * i / n + 1 ) + uniform();
+		ADCBuffer[i] = (uint8_t)lround( x );
+	}
+	uint16_t stop = 301 % captureSize;
+	frozenBuffer = ADCBuffer;
+	frozenStopIndex = stop;
+
+	// Newest n samples, oldest first
+	std::vector<double> samples;
+	for ( uint16_t i = captureSize - n; i < captureSize; i++ ) {
+		samples.push_back( ADCBuffer[( stop + i ) % captureSize] );
+	}
+	double mean = 0;
+	for ( double sample : samples ) mean += sample;
+	mean /= n;
+
+	dft.assign( n / 2, 0 );
+	for ( uint16_t k = 0; k < n / 2; k++ ) {
+		std::complex<double> sum = 0;
+		for ( uint16_t i = 0; i < n; i++ ) {
+			sum += ( samples[i] - mean ) * std::polar( 1.0, -2 * M_PI * k * i / n );
+		}
+		dft[k] = abs( sum );
+	}
+}
+
+static bool spectrum( scope::Spectrum &result )
+{
+	sim::Receiver receiver;
+	sim::call( sendFrame );
+	sim::runUntil( []() { return !txBusy && sim::lineIdle(); }, captureCycles( 0.1 ) );
+	std::vector<scope::Record> &records = receiver.poll();
+	CHECK( records.size() == 1 );
+	return records.size() == 1 && scope::decodeSpectrum( records[0], result );
+}
+
+static void accuracy( void )
+{
+	sim::boot();
+	uint16_t n = std::min( captureSize / 2, FFTMAX );
+
+	double worstRms = 0;
+	double leastDb = 1000, mostDb = 0;
+	double worstLog = 0;
+	const double frequencies[][2] = { { 37.3, 101.7 }, { 60, 151.5 }, { 12.8, 90.2 }, { 81.5, 21 } };
+	for ( const auto &f : frequencies ) {
+		double f1 = f[0] * n / 512, f2 = f[1] * n / 512;
+		std::vector<double> dft;
+
+		// 16-bit bins
+		sim::command( "f4;" );
+		capture( f1, f2, n, dft );
+		scope::Spectrum linear;
+		CHECK( spectrum( linear ) );
+		CHECK( linear.magnitudes.size() == n / 2u );
+		if ( linear.magnitudes.size() != n / 2u ) return;
+
+		double sum = 0, worst = 0, peak = 0;
+		for ( uint16_t k = 1; k < n / 2; k++ ) {
+			double error = linear.magnitudes[k] - dft[k];
+			sum += error * error;
+			worst = std::max( worst, fabs( error ) );
+			peak = std::max( peak, dft[k] );
+		}
+		double rms = sqrt( sum / ( n / 2 - 1 ) );
+		double db = 20 * log10( peak / worst );
+		printf( "  sines at bins %.1f and %.1f: peak %.0f, RMS error %.2f, largest %.0f dB below the peak\n",
+			f1, f2, peak, rms, db );
+		worstRms = std::max( worstRms, rms );
+		leastDb = std::min( leastDb, db );
+		mostDb = std::max( mostDb, db );
+
+		// 8-bit bins of the same capture
+		sim::command( "f5;" );
+		capture( f1, f2, n, dft );
+		scope::Spectrum logarithmic;
+		CHECK( spectrum( logarithmic ) );
+		if ( logarithmic.magnitudes.size() != n / 2u ) return;
+		for ( uint16_t k = 1; k < n / 2; k++ ) {
+			if ( dft[k] < peak / 100 ) continue;
+			double error = 20 * log10( logarithmic.magnitudes[k] / dft[k] );
+			worstLog = std::max( worstLog, fabs( error ) );
+		}
+	}
+
+	printf( "  N %u: 16-bit RMS error up to %.2f, largest %.0f to %.0f dB below the peak, "
+		"8-bit within %.2f dB\n", n, worstRms, leastDb, mostDb, worstLog );
+
+	// Bounds of the figures in README.md
+	CHECK( worstRms <= 1.5 );
+	CHECK( leastDb >= 55 );
+	CHECK( worstLog <= 0.6 );
+}
+
+int main( void )
+{
+	runScenario( "accuracy against a DFT", accuracy );
+	return testResult();
+}
@@ -0,0 +1,140 @@
+//-----------------------------------------------------------------------------
+// transmit_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Transmit engine
+//-----------------------------------------------------------------------------
+// The engine and Serial share the USART. Text from Serial followed by
+// records from the engine, and the other way round, must neither hang nor
+// lose a byte, whatever the length of the records.
+
+#include "check.h"
+
+#include <math.h>
+
+static void input( void )
+{
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 2000 * t ); } );
+}
+
+// Records of a type received in seconds, with no bytes outside records
+// after the first one
+static int receive( uint8_t type, double seconds )
+{
+	size_t origin = sim::link().bytes.size();
+	sim::Receiver receiver;
+	sim::run( captureCycles( seconds ) );
+
+	int count = 0;
+	uint64_t first = 0;
+	for ( const scope::Record &record : receiver.poll() ) {
+		if ( count == 0 ) first = record.offset - origin;
+		if ( record.type == type ) count++;
+	}
+	CHECK( receiver.reader.skippedBytes() == first );
+	return count;
+}
+
+// Text, then spectra: 16-bit (527 bytes) and 8-bit (271 bytes) spectra are
+// odd, so the engine ends on the first byte of a pass
+static void textThenSpectra( void )
+{
+	sim::boot();
+	input();
+	sim::command( "d;" );
+	CHECK( sim::find( "Buffer size:", 0 ) >= 0 );
+
+	sim::command( "f4;p32;e4;s;" );
+	CHECK( receive( scope::RECORD_SPECTRUM, 0.3 ) >= 5 );
+
+	sim::command( "f5;" );
+	CHECK( receive( scope::RECORD_SPECTRUM, 0.3 ) >= 5 );
+}
+
+// Frames, text in between, frames again
+static void framesTextFrames( void )
+{
+	sim::boot();
+	input();
+	sim::command( "f1;p32;e4;s;" );
+	CHECK( receive( scope::RECORD_FRAME, 0.2 ) >= 3 );
+
+	for ( int i = 0; i < 5; i++ ) {
+		size_t from = sim::link().bytes.size();
+		sim::command( "d;" );
+		sim::runUntil( [&]() { return sim::find( "Buffer size:", from ) >= 0; }, captureCycles( 0.2 ) );
+		CHECK( sim::find( "Buffer size:", from ) >= 0 );
+		CHECK( receive( scope::RECORD_FRAME, 0.1 ) >= 1 );
+	}
+}
+
+// Views of odd and even lengths, one and two bytes in the last pass
+static void oddViews( void )
+{
+	for ( int length = 1; length <= 4; length++ ) {
+		sim::boot();
+		input();
+		sim::command( "d;" );
+		char commands[32];
+		snprintf( commands, sizeof(commands), "f1;<50;>%d;p16;e4;s;", 50 + length );
+		sim::command( commands );
+		CHECK( receive( scope::RECORD_VIEW, 0.1 ) >= 3 );
+	}
+}
+
+// `s` in roll mode starts the ring over: the samples that follow are the
+// input, not a stretch of the cleared buffer, and the overruns while status
+// reports held the link up are gone
+static void rollRestart( void )
+{
+	sim::boot();
+	sim::setInput( 0, []( double ) { return 2.5; } );
+	sim::command( "p128;e5;" );
+	sim::run( captureCycles( 0.02 ) );
+
+	size_t from = sim::link().bytes.size();
+	sim::command( "d;d;d;d;d;d;d;d;d;d;d;d;s;" );
+	sim::run( captureCycles( 0.05 ) );
+	long last = from;
+	for ( long at = last; at >= 0; at = sim::find( "Overruns: ", at + 1 ) ) last = at;
+	size_t start = sim::find( "\r\n", last ) + 2;
+	size_t to = sim::link().bytes.size();
+	CHECK( to - start > 100 );
+	int cleared = 0;
+	for ( size_t i = start; i < to; i++ ) {
+		if ( sim::link().bytes[i] < 100 || sim::link().bytes[i] > 156 ) cleared++;
+	}
+	printf( "  %zu samples, %d off the input\n", to - start, cleared );
+	CHECK( cleared == 0 );
+
+	sim::command( "d;" );
+	sim::runUntil( [&]() { return sim::find( "Overruns: ", to ) >= 0; }, captureCycles( 0.2 ) );
+	sim::run( captureCycles( 0.01 ) );
+	CHECK( sim::find( "Overruns: 0\r\n", to ) >= 0 );
+}
+
+int main( void )
+{
+	runScenario( "text, then spectra", textThenSpectra );
+	runScenario( "frames, text, frames", framesTextFrames );
+	runScenario( "odd view lengths", oddViews );
+	runScenario( "roll mode restart", rollRestart );
+	return testResult();
+}
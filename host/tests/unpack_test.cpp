@@ -0,0 +1,176 @@
+//-----------------------------------------------------------------------------
+// unpack_test.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// 10 and 12-bit captures
+//-----------------------------------------------------------------------------
+// The host unpacker against the layout in README.md, and packed frames of
+// the device against the conversions it made: every 10-bit sample is one
+// conversion, every 12-bit one the rounded sum of 4^k of them.
+
+#include "check.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+
+//-----------------------------------------------------------------------------
+// Layout
+//-----------------------------------------------------------------------------
+
+static void layout( void )
+{
+	// 0x3FF, 0x000, 0x155, 0x2AA: high bytes FF 00 55 AA, low bits
+	// 11, 00, 01, 10 from bit 0 on
+	const uint8_t ten[] = { 0xFF, 0x00, 0x55, 0xAA, 0x93 };
+	std::vector<uint16_t> samples;
+	CHECK( scope::unpackSamples( ten, sizeof(ten), 10, samples ) );
+	CHECK( samples == std::vector<uint16_t>( { 0x3FF, 0x000, 0x155, 0x2AA } ) );
+
+	// 0xABC, 0x123: high bytes AB 12, low bits C and 3
+	const uint8_t twelve[] = { 0xAB, 0x12, 0x3C };
+	samples.clear();
+	CHECK( scope::unpackSamples( twelve, sizeof(twelve), 12, samples ) );
+	CHECK( samples == std::vector<uint16_t>( { 0xABC, 0x123 } ) );
+
+	CHECK( !scope::unpackSamples( ten, 4, 10, samples ) );
+	CHECK( !scope::unpackSamples( twelve, 2, 12, samples ) );
+}
+
+//-----------------------------------------------------------------------------
+// Round trip
+//-----------------------------------------------------------------------------
+
+static double ripple( double t )
+{
+	uint32_t x = (uint32_t)( t * 1e6 ) * 2654435761u;
+	return ( ( x >> 24 ) - 128 ) * 0.0005;
+}
+
+// Sample of n conversions from first on, as the ISR rounds their sum
+static uint16_t expected( const std::vector<sim::Conversion> &log, size_t first, uint8_t k )
+{
+	uint32_t sum = 0;
+	for ( size_t i = first; i < first + ( 1u << 2 * k ); i++ ) sum += log[i].code;
+	uint8_t shift = k ? 2 * ( k - 1 ) : 0;
+	return ( sum + ( ( 1 << shift ) >> 1 ) ) >> shift;
+}
+
+static void roundTrip( const char *commands, uint8_t bits, uint8_t k )
+{
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 50 * t ) + ripple( t ); } );
+	sim::logConversions( true );
+	sim::command( commands );
+
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.6 ) );
+	const std::vector<sim::Conversion> &log = sim::conversions();
+	size_t step = 1u << 2 * k;
+
+	int frames = 0;
+	size_t from = 0;
+	for ( const scope::Record &record : receiver.poll() ) {
+		scope::Frame frame;
+		CHECK( scope::decodeFrame( record, frame ) );
+		CHECK( frame.bits == bits );
+		CHECK( frame.samples.size() == frame.size );
+		frames++;
+
+		// The samples are consecutive sums, somewhere after the previous
+		// frame
+		bool found = false;
+		for ( size_t i = from; !found && i + frame.samples.size() * step <= log.size(); i++ ) {
+			size_t n = 0;
+			while ( n < frame.samples.size() && frame.samples[n] == expected( log, i + n * step, k ) ) n++;
+			if ( n == frame.samples.size() ) {
+				found = true;
+				from = i + n * step;
+			}
+		}
+		CHECK( found );
+	}
+	CHECK( frames >= 2 );
+}
+
+static void tenBits( void ) { roundTrip( "f1;l10;p32;e4;s;", 10, 0 ); }
+static void twelveBitsO1( void ) { roundTrip( "f1;l10;o1;p16;e4;s;", 12, 1 ); }
+static void twelveBitsO2( void ) { roundTrip( "f1;l10;o2;p16;e4;s;", 12, 2 ); }
+
+//-----------------------------------------------------------------------------
+// scope_decode
+//-----------------------------------------------------------------------------
+// Decodes a recorded 10-bit stream like decodeFrame() does.
+
+static const char *decoder;
+
+static void decodeTool( void )
+{
+	sim::boot();
+	sim::setInput( 0, []( double t ) { return 2.5 + 2.0 * sin( 2 * M_PI * 50 * t ); } );
+	sim::command( "f1;l10;p32;e4;s;" );
+	size_t origin = sim::link().bytes.size();
+	sim::Receiver receiver;
+	sim::run( captureCycles( 0.3 ) );
+
+	char path[] = "/tmp/scope_decode_XXXXXX";
+	int fd = mkstemp( path );
+	CHECK( fd >= 0 );
+	if ( fd < 0 ) return;
+	FILE *file = fdopen( fd, "wb" );
+	const std::vector<uint8_t> &bytes = sim::link().bytes;
+	fwrite( bytes.data() + origin, 1, bytes.size() - origin, file );
+	fclose( file );
+
+	std::string command = std::string( decoder ) + " " + path + " 2>/dev/null";
+	FILE *output = popen( command.c_str(), "r" );
+	CHECK( output );
+	if ( !output ) return;
+
+	std::vector<scope::Record> &records = receiver.poll();
+	CHECK( records.size() >= 2 );
+	char line[65536];
+	for ( const scope::Record &record : records ) {
+		scope::Frame frame;
+		CHECK( scope::decodeFrame( record, frame ) );
+		std::string expected = "frame " + std::to_string( frame.sequence ) + " 10 " +
+			std::to_string( frame.trigger );
+		for ( uint16_t sample : frame.samples ) expected += " " + std::to_string( sample );
+		expected += "\n";
+		CHECK( fgets( line, sizeof(line), output ) && expected == line );
+	}
+	CHECK( !fgets( line, sizeof(line), output ) );
+	CHECK( pclose( output ) == 0 );
+	unlink( path );
+}
+
+int main( int argc, char **argv )
+{
+	runScenario( "packed layout", layout );
+	runScenario( "10-bit frames", tenBits );
+	runScenario( "12-bit frames, o1", twelveBitsO1 );
+	runScenario( "12-bit frames, o2", twelveBitsO2 );
+	if ( argc > 1 ) {
+		decoder = argv[1];
+		runScenario( "scope_decode", decodeTool );
+	}
+	return testResult();
+}
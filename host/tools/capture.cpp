@@ -0,0 +1,242 @@
+//-----------------------------------------------------------------------------
+// capture.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// scope_capture
+//-----------------------------------------------------------------------------
+// Headless capture service. Reads the output stream of the scope from a
+// serial port at the link rate, hands every record to a broadcast ring and
+// records them with an index (see recording.h), until SIGINT or SIGTERM:
+//
+//	scope_capture [-b baud] [-c commands] [-o recording] [-p] [-q] port
+//
+// -c sends commands once the port is open, e.g. -c "f1;s;". -p prints a line
+// per record to stdout, from a consumer of its own:
+//
+//	<offset> <type> <sequence> <length>
+//
+// Once a second a line of statistics goes to stderr, unless -q: bytes and
+// records per second and bytes outside records; at the end the totals and
+// the records the consumers lost to a full ring. The ring holds RINGSLOTS
+// records, five seconds of 1024 sample frames at 2 Mbaud, so only a consumer
+// that stalls for that long loses any. The capture also ends when the port
+// does.
+//
+// A recording is replayed, or part of it, as the stream it was made from:
+//
+//	scope_capture -r recording [-f first] [-t time] [-n count]
+//
+// from record first, or the first received at or after time (microseconds
+// since the epoch, as in the index), to stdout, e.g. into scope_decode.
+
+#include "link.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+
+static const size_t RINGSLOTS = 1024;
+
+static void usage( void )
+{
+	fprintf( stderr,
+		"usage: scope_capture [-b baud] [-c commands] [-o recording] [-p] [-q] port\n"
+		"       scope_capture -r recording [-f first] [-t time] [-n count]\n" );
+	exit( 1 );
+}
+
+static const char *typeName( uint8_t type )
+{
+	switch ( type ) {
+	case scope::RECORD_FRAME:	return "frame";
+	case scope::RECORD_COMPRESSED:	return "compressed";
+	case scope::RECORD_TELEMETRY:	return "telemetry";
+	case scope::RECORD_METER:	return "meter";
+	case scope::RECORD_SPECTRUM:	return "spectrum";
+	case scope::RECORD_LINKTEST:	return "linktest";
+	case scope::RECORD_VIEW:	return "view";
+	default:			return "unknown";
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Replay
+//-----------------------------------------------------------------------------
+
+static int replay( const char *path, size_t first, uint64_t time, bool timed, size_t count )
+{
+	scope::RecordingReader recording;
+	if ( !recording.open( path ) ) {
+		fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+	if (timed) first = recording.find( time );
+	size_t end = recording.records();
+	if ( first > end ) first = end;
+	if ( count < end - first ) end = first + count;
+
+	for ( size_t i = first; i < end; i++ ) {
+		if ( fwrite( recording.bytes( i ), recording.entry( i ).length, 1, stdout ) != 1 ) {
+			perror( "stdout" );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Capture
+//-----------------------------------------------------------------------------
+
+int main( int argc, char **argv )
+{
+	uint32_t baud = 500000;
+	const char *commands = nullptr;
+	const char *output = nullptr;
+	const char *input = nullptr;
+	bool print = false;
+	bool quiet = false;
+	size_t first = 0;
+	size_t count = SIZE_MAX;
+	uint64_t time = 0;
+	bool timed = false;
+
+	int option;
+	while ( ( option = getopt( argc, argv, "b:c:o:pqr:f:t:n:" ) ) != -1 ) {
+		switch ( option ) {
+		case 'b': baud = strtoul( optarg, nullptr, 10 ); break;
+		case 'c': commands = optarg; break;
+		case 'o': output = optarg; break;
+		case 'p': print = true; break;
+		case 'q': quiet = true; break;
+		case 'r': input = optarg; break;
+		case 'f': first = strtoull( optarg, nullptr, 10 ); break;
+		case 't': time = strtoull( optarg, nullptr, 10 ); timed = true; break;
+		case 'n': count = strtoull( optarg, nullptr, 10 ); break;
+		default: usage();
+		}
+	}
+
+	if (input) {
+		if ( optind != argc ) usage();
+		return replay( input, first, time, timed, count );
+	}
+	if ( optind != argc - 1 ) usage();
+	const char *port = argv[optind];
+
+	int fd = scope::openLink( port, baud );
+	if ( fd < 0 ) {
+		fprintf( stderr, "%s: %s\n", port, strerror( errno ) );
+		return 1;
+	}
+
+	scope::RecordingWriter writer;
+	if ( output && !writer.create( output ) ) {
+		fprintf( stderr, "%s: %s\n", output, strerror( errno ) );
+		return 1;
+	}
+
+	// The signals are taken by the main thread only, with sigtimedwait()
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &signals, nullptr );
+
+	scope::BroadcastRing ring( RINGSLOTS, scope::RECORDMAX );
+	scope::LinkReader link( fd, ring );
+
+	// Consumers subscribe before the first record comes in
+	scope::BroadcastRing::Cursor recorderCursor = ring.subscribe();
+	scope::BroadcastRing::Cursor printerCursor = ring.subscribe();
+
+	bool recorded = true;
+	std::thread recorder;
+	if (output) {
+		recorder = std::thread( [&]() { recorded = scope::recordRing( ring, recorderCursor, writer ); } );
+	}
+
+	std::thread printer;
+	if (print) {
+		printer = std::thread( [&]() {
+			scope::Record record;
+			scope::BroadcastRing::Result result;
+			while ( ( result = ring.wait( printerCursor, record, 100 ) ) != scope::BroadcastRing::CLOSED ) {
+				if ( result != scope::BroadcastRing::READ ) continue;
+				uint16_t sequence = scope::numbered( record.type ) ? scope::getWord( record.bytes.data() + 2 ) : 0;
+				printf( "%llu %s %u %zu\n", (unsigned long long)record.offset, typeName( record.type ),
+					sequence, record.bytes.size() );
+			}
+			fflush( stdout );
+		} );
+	}
+
+	bool linked = true;
+	std::thread reader( [&]() { linked = link.run(); } );
+
+	if ( commands && write( fd, commands, strlen( commands ) ) < 0 ) {
+		fprintf( stderr, "%s: %s\n", port, strerror( errno ) );
+	}
+
+	// Statistics once a second until a signal or the end of the stream
+	uint64_t lastBytes = 0;
+	uint64_t lastRecords = 0;
+	struct timespec second = { 1, 0 };
+	while ( !link.finished() ) {
+		if ( sigtimedwait( &signals, nullptr, &second ) > 0 ) break;
+
+		uint64_t bytes = link.bytes();
+		uint64_t records = link.records();
+		if ( !quiet ) {
+			fprintf( stderr, "%llu B/s, %llu records/s, %llu bytes skipped\n",
+				(unsigned long long)( bytes - lastBytes ),
+				(unsigned long long)( records - lastRecords ),
+				(unsigned long long)link.skippedBytes() );
+		}
+		lastBytes = bytes;
+		lastRecords = records;
+	}
+
+	link.stop();
+	reader.join();
+	if ( recorder.joinable() ) recorder.join();
+	if ( printer.joinable() ) printer.join();
+	close( fd );
+
+	if ( output && !writer.close() ) {
+		fprintf( stderr, "%s: %s\n", output, strerror( errno ) );
+		recorded = false;
+	}
+
+	if ( !quiet ) {
+		fprintf( stderr, "%llu bytes, %llu records, %llu recorded, %llu bytes skipped, %llu records lost\n",
+			(unsigned long long)link.bytes(), (unsigned long long)link.records(),
+			(unsigned long long)writer.records(), (unsigned long long)link.skippedBytes(),
+			(unsigned long long)( recorderCursor.dropped + printerCursor.dropped ) );
+	}
+	if ( !linked ) fprintf( stderr, "%s: %s\n", port, strerror( errno ) );
+	return linked && recorded ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+//-----------------------------------------------------------------------------
+// decode.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// scope_decode
+//-----------------------------------------------------------------------------
+// Decodes a recorded output stream of the scope into text, one line per
+// record:
+//
+//	<type> <sequence> <bits> <trigger> <sample> <sample> ...
+//	<type> <length>
+//
+// The first for frames, compressed frames and views, with packed 10 and
+// 12-bit samples unpacked; samples are oldest first, trigger is the position
+// of the trigger among them. The second for all other records. Without framing (f0) there are no records, -b10 or
+// -b12 unpacks the whole input as packed samples instead, -b8 prints it.
+//
+//	scope_decode [-b8|-b10|-b12] [file]
+
+#include "stream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static const char *typeName( uint8_t type )
+{
+	switch ( type ) {
+	case scope::RECORD_FRAME:	return "frame";
+	case scope::RECORD_COMPRESSED:	return "compressed";
+	case scope::RECORD_TELEMETRY:	return "telemetry";
+	case scope::RECORD_METER:	return "meter";
+	case scope::RECORD_SPECTRUM:	return "spectrum";
+	case scope::RECORD_LINKTEST:	return "linktest";
+	case scope::RECORD_VIEW:	return "view";
+	default:			return "unknown";
+	}
+}
+
+static void printSamples( const std::vector<uint16_t> &samples )
+{
+	for ( uint16_t sample : samples ) printf( " %u", sample );
+	printf( "\n" );
+}
+
+int main( int argc, char **argv )
+{
+	int bits = 0;
+	FILE *input = stdin;
+
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !strcmp( argv[i], "-b8" ) ) bits = 8;
+		else if ( !strcmp( argv[i], "-b10" ) ) bits = 10;
+		else if ( !strcmp( argv[i], "-b12" ) ) bits = 12;
+		else if ( input == stdin && argv[i][0] != '-' ) {
+			input = fopen( argv[i], "rb" );
+			if ( !input ) {
+				perror( argv[i] );
+				return 1;
+			}
+		}
+		else {
+			fprintf( stderr, "usage: scope_decode [-b8|-b10|-b12] [file]\n" );
+			return 1;
+		}
+	}
+
+	std::vector<uint8_t> data;
+	uint8_t chunk[65536];
+	size_t n;
+	while ( ( n = fread( chunk, 1, sizeof(chunk), input ) ) > 0 ) {
+		data.insert( data.end(), chunk, chunk + n );
+	}
+
+	// Unframed samples
+	if (bits) {
+		std::vector<uint16_t> samples;
+		if ( bits == 8 ) {
+			samples.assign( data.begin(), data.end() );
+		}
+		else {
+			size_t group = ( bits == 12 ) ? 3 : 5;
+			data.resize( data.size() / group * group );
+			scope::unpackSamples( data.data(), data.size(), bits, samples );
+		}
+		for ( uint16_t sample : samples ) printf( "%u\n", sample );
+		return 0;
+	}
+
+	scope::StreamReader reader;
+	reader.feed( data.data(), data.size() );
+
+	scope::Record record;
+	while ( reader.next( record ) ) {
+		scope::Frame frame;
+		if ( scope::decodeFrame( record, frame ) ) {
+			printf( "%s %u %u %u", typeName( record.type ), frame.sequence, frame.bits, frame.trigger );
+			printSamples( frame.samples );
+		}
+		else {
+			printf( "%s %zu\n", typeName( record.type ), record.bytes.size() );
+		}
+	}
+
+	if ( reader.skippedBytes() ) {
+		fprintf( stderr, "%llu bytes outside records\n", (unsigned long long)reader.skippedBytes() );
+	}
+	return 0;
+}
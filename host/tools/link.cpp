@@ -0,0 +1,149 @@
+//-----------------------------------------------------------------------------
+// link.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "link.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <chrono>
+
+namespace scope {
+
+// Bytes taken from the port at a time, a few frames at 2 Mbaud
+static const size_t BLOCK = 64 << 10;
+
+static speed_t termiosSpeed( uint32_t baud )
+{
+	switch ( baud ) {
+	case 9600:	return B9600;
+	case 19200:	return B19200;
+	case 38400:	return B38400;
+	case 57600:	return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	case 500000:	return B500000;
+	case 1000000:	return B1000000;
+	case 2000000:	return B2000000;
+	default:	return B0;
+	}
+}
+
+int openLink( const char *path, uint32_t baud )
+{
+	speed_t speed = termiosSpeed( baud );
+	if ( speed == B0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = open( path, O_RDWR | O_NOCTTY | O_CLOEXEC );
+	if ( fd < 0 ) return -1;
+
+	// 8N1 without flow control, bytes as they come
+	struct termios tty;
+	if ( tcgetattr( fd, &tty ) == 0 ) {
+		cfmakeraw( &tty );
+		tty.c_cflag |= CLOCAL | CREAD;
+		tty.c_cflag &= ~CRTSCTS;
+		tty.c_cc[VMIN] = 1;
+		tty.c_cc[VTIME] = 0;
+		cfsetispeed( &tty, speed );
+		cfsetospeed( &tty, speed );
+		if ( tcsetattr( fd, TCSANOW, &tty ) < 0 ) {
+			int error = errno;
+			close( fd );
+			errno = error;
+			return -1;
+		}
+	}
+	return fd;
+}
+
+uint64_t wallClock( void )
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>( system_clock::now().time_since_epoch() ).count();
+}
+
+//-----------------------------------------------------------------------------
+// LinkReader
+//-----------------------------------------------------------------------------
+
+bool LinkReader::run( void )
+{
+	std::vector<uint8_t> block( BLOCK );
+	Record record;
+	bool ok = true;
+
+	while ( !stopping.load() ) {
+		// Wakes up now and then to see whether to stop
+		struct pollfd ready = { fd, POLLIN, 0 };
+		int events = poll( &ready, 1, 100 );
+		if ( events < 0 && errno != EINTR ) {
+			ok = false;
+			break;
+		}
+		if ( events <= 0 ) continue;
+
+		ssize_t n = read( fd, block.data(), block.size() );
+		if ( n < 0 && ( errno == EINTR || errno == EAGAIN ) ) continue;
+		// A pseudo-terminal whose other side is closed reads as EIO
+		if ( n == 0 || ( n < 0 && errno == EIO ) ) break;
+		if ( n < 0 ) {
+			ok = false;
+			break;
+		}
+
+		received.fetch_add( n );
+		reader.feed( block.data(), n );
+		while ( reader.next( record ) ) {
+			ring.publish( record );
+			published.fetch_add( 1 );
+		}
+		skipped.store( reader.skippedBytes() );
+	}
+
+	ring.close();
+	done.store( true );
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Recording consumer
+//-----------------------------------------------------------------------------
+
+bool recordRing( const BroadcastRing &ring, BroadcastRing::Cursor &cursor, RecordingWriter &writer )
+{
+	Record record;
+	for ( ;; ) {
+		BroadcastRing::Result result = ring.wait( cursor, record, 100 );
+		if ( result == BroadcastRing::CLOSED ) return true;
+		if ( result == BroadcastRing::READ && !writer.append( record, wallClock() ) ) return false;
+	}
+}
+
+} // namespace scope
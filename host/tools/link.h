@@ -0,0 +1,80 @@
+//-----------------------------------------------------------------------------
+// link.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Reading the link
+//-----------------------------------------------------------------------------
+// The reading side of scope_capture: a thread that reads the serial port in
+// blocks, splits the bytes into records with a StreamReader and publishes
+// them to a BroadcastRing, and the consumer that records them.
+
+#ifndef SCOPE_LINK_H
+#define SCOPE_LINK_H
+
+#include "recording.h"
+#include "ring.h"
+
+#include <atomic>
+
+namespace scope {
+
+// Longest record the StreamReader takes: 4096 packed 12-bit samples with all
+// blocks, so that every record fits a slot of the ring
+const size_t RECORDMAX = 4096 / 2 * 3 + 64;
+
+// Opens a serial port, or a pseudo-terminal, raw at baud, -1 with errno set
+// when it can not be opened or the rate is not one termios knows
+int openLink( const char *path, uint32_t baud );
+
+// Microseconds since the epoch
+uint64_t wallClock( void );
+
+class LinkReader {
+public:
+	LinkReader( int fd, BroadcastRing &ring ) : fd( fd ), ring( ring ) {}
+
+	// Reads until the end of the stream, an error or stop(), then closes
+	// the ring. False on a read error, with errno set.
+	bool run( void );
+	void stop( void ) { stopping.store( true ); }
+	bool finished( void ) const { return done.load(); }
+
+	uint64_t bytes( void ) const { return received.load(); }
+	uint64_t records( void ) const { return published.load(); }
+	uint64_t skippedBytes( void ) const { return skipped.load(); }
+
+private:
+	int fd;
+	BroadcastRing &ring;
+	StreamReader reader;
+	std::atomic<bool> stopping { false };
+	std::atomic<bool> done { false };
+	std::atomic<uint64_t> received { 0 };
+	std::atomic<uint64_t> published { 0 };
+	std::atomic<uint64_t> skipped { 0 };
+};
+
+// Consumer that appends every record of the ring to a recording until the
+// ring is closed. False when a record can not be written.
+bool recordRing( const BroadcastRing &ring, BroadcastRing::Cursor &cursor, RecordingWriter &writer );
+
+} // namespace scope
+
+#endif
@@ -0,0 +1,212 @@
+//-----------------------------------------------------------------------------
+// recording.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "recording.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace scope {
+
+// Files grow by this much at a time
+static const size_t CHUNK = 16 << 20;
+
+static const uint8_t MAGIC[8] = { 'S', 'S', 'I', 'D', 'X', '1', 0, 0 };
+static const size_t INDEXHEADER = 16;
+
+//-----------------------------------------------------------------------------
+// MappedFile
+//-----------------------------------------------------------------------------
+
+bool MappedFile::create( const std::string &path )
+{
+	close();
+	fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 ) return false;
+	writable = true;
+	return true;
+}
+
+bool MappedFile::open( const std::string &path )
+{
+	close();
+	fd = ::open( path.c_str(), O_RDONLY );
+	if ( fd < 0 ) return false;
+
+	struct stat status;
+	if ( fstat( fd, &status ) < 0 ) {
+		close();
+		return false;
+	}
+	length = status.st_size;
+	if ( length == 0 ) return true;
+
+	void *p = mmap( nullptr, length, PROT_READ, MAP_SHARED, fd, 0 );
+	if ( p == MAP_FAILED ) {
+		close();
+		return false;
+	}
+	map = (uint8_t *)p;
+	mapped = length;
+	return true;
+}
+
+// Grows the file and its mapping to hold size bytes, in whole chunks
+bool MappedFile::reserve( size_t size )
+{
+	if ( size <= mapped ) return true;
+
+	size_t grown = ( size + CHUNK - 1 ) / CHUNK * CHUNK;
+	if ( ftruncate( fd, grown ) < 0 ) return false;
+
+	void *p = map ? mremap( map, mapped, grown, MREMAP_MAYMOVE ) :
+		mmap( nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if ( p == MAP_FAILED ) return false;
+	map = (uint8_t *)p;
+	mapped = grown;
+	return true;
+}
+
+bool MappedFile::append( const void *data, size_t size )
+{
+	if ( !writable || !reserve( length + size ) ) return false;
+	memcpy( map + length, data, size );
+	length += size;
+	return true;
+}
+
+bool MappedFile::close( void )
+{
+	bool ok = true;
+	if ( map ) munmap( map, mapped );
+	if ( fd >= 0 ) {
+		// The unused rest of the last chunk goes
+		if ( writable ) ok = ftruncate( fd, length ) == 0;
+		ok = ::close( fd ) == 0 && ok;
+	}
+	fd = -1;
+	map = nullptr;
+	mapped = 0;
+	length = 0;
+	writable = false;
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// RecordingWriter
+//-----------------------------------------------------------------------------
+
+bool RecordingWriter::create( const std::string &path )
+{
+	count = 0;
+	length = 0;
+	if ( !stream.create( path ) || !index.create( path + ".idx" ) ) return false;
+
+	uint8_t header[INDEXHEADER] = {};
+	memcpy( header, MAGIC, sizeof(MAGIC) );
+	header[8] = sizeof(IndexEntry);
+	return index.append( header, sizeof(header) );
+}
+
+bool RecordingWriter::append( const Record &record, uint64_t received )
+{
+	IndexEntry entry = {};
+	entry.offset = stream.size();
+	entry.length = record.bytes.size();
+	entry.type = record.type;
+	entry.received = received;
+
+	if ( numbered( record.type ) ) entry.sequence = getWord( record.bytes.data() + 2 );
+
+	if ( !stream.append( record.bytes.data(), record.bytes.size() ) ) return false;
+	if ( !index.append( &entry, sizeof(entry) ) ) return false;
+	count++;
+	length += record.bytes.size();
+	return true;
+}
+
+bool RecordingWriter::close( void )
+{
+	bool ok = stream.close();
+	return index.close() && ok;
+}
+
+//-----------------------------------------------------------------------------
+// RecordingReader
+//-----------------------------------------------------------------------------
+
+bool RecordingReader::open( const std::string &path )
+{
+	count = 0;
+	entries = nullptr;
+	if ( !stream.open( path ) || !index.open( path + ".idx" ) ) return false;
+
+	if ( index.size() < INDEXHEADER || memcmp( index.data(), MAGIC, sizeof(MAGIC) ) ||
+		index.data()[8] != sizeof(IndexEntry) ) {
+		errno = EINVAL;
+		return false;
+	}
+
+	// Entries up to the first one that is not written or whose record is
+	// not there
+	entries = (const IndexEntry *)( index.data() + INDEXHEADER );
+	size_t listed = ( index.size() - INDEXHEADER ) / sizeof(IndexEntry);
+	while ( count < listed && entries[count].length > 0 &&
+		entries[count].offset + entries[count].length <= stream.size() ) {
+		count++;
+	}
+	return true;
+}
+
+void RecordingReader::close( void )
+{
+	stream.close();
+	index.close();
+	entries = nullptr;
+	count = 0;
+}
+
+Record RecordingReader::record( size_t i ) const
+{
+	Record record;
+	record.type = entries[i].type;
+	record.offset = entries[i].offset;
+	record.bytes.assign( bytes( i ), bytes( i ) + entries[i].length );
+	return record;
+}
+
+size_t RecordingReader::find( uint64_t received ) const
+{
+	const IndexEntry *end = entries + count;
+	const IndexEntry *found = std::lower_bound( entries, end, received,
+		[]( const IndexEntry &entry, uint64_t time ) { return entry.received < time; } );
+	return found - entries;
+}
+
+} // namespace scope
@@ -0,0 +1,130 @@
+//-----------------------------------------------------------------------------
+// recording.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Recordings
+//-----------------------------------------------------------------------------
+// A recording is two append-only files, written and read through mmap():
+//
+//	<name>		the records as they came, back to back, which is a
+//			stream of the scope that scope_decode reads
+//	<name>.idx	a 16 byte header and an entry per record
+//
+// The index header is the magic "SSIDX1" padded with zeros to 8 bytes, the
+// entry size (24) and 4 reserved bytes; an entry is, little endian:
+//
+//	offset	size	field
+//	0	8	offset of the record in <name>
+//	8	4	length of the record
+//	12	2	sequence number, 0 for records without one
+//	14	1	record type, the second sync byte
+//	15	1	reserved
+//	16	8	receive time, microseconds since the epoch
+//
+// Both files grow in chunks and are cut to their length when the recording
+// is closed. After a crash the index ends with zero entries, at the first
+// entry of length 0, and the records it lists are complete, since a record
+// is written before its entry.
+
+#ifndef SCOPE_RECORDING_H
+#define SCOPE_RECORDING_H
+
+#include "stream.h"
+
+#include <string>
+
+namespace scope {
+
+struct IndexEntry {
+	uint64_t offset;
+	uint32_t length;
+	uint16_t sequence;
+	uint8_t type;
+	uint8_t reserved;
+	uint64_t received;
+};
+
+static_assert( sizeof(IndexEntry) == 24, "index entries are 24 bytes" );
+
+// A file mapped into memory that only grows at its end
+class MappedFile {
+public:
+	~MappedFile( void ) { close(); }
+
+	bool create( const std::string &path );
+	bool open( const std::string &path );	// read only
+	bool append( const void *data, size_t length );
+	bool close( void );
+
+	const uint8_t *data( void ) const { return map; }
+	size_t size( void ) const { return length; }
+
+private:
+	bool reserve( size_t size );
+
+	int fd = -1;
+	uint8_t *map = nullptr;
+	size_t mapped = 0;
+	size_t length = 0;
+	bool writable = false;
+};
+
+class RecordingWriter {
+public:
+	// False with errno set when a file can not be created
+	bool create( const std::string &path );
+	bool append( const Record &record, uint64_t received );
+	bool close( void );
+
+	uint64_t records( void ) const { return count; }
+	uint64_t bytes( void ) const { return length; }
+
+private:
+	MappedFile stream;
+	MappedFile index;
+	uint64_t count = 0;
+	uint64_t length = 0;
+};
+
+class RecordingReader {
+public:
+	bool open( const std::string &path );
+	void close( void );
+
+	size_t records( void ) const { return count; }
+	const IndexEntry &entry( size_t i ) const { return entries[i]; }
+
+	// Bytes of record i, sync word to CRC
+	const uint8_t *bytes( size_t i ) const { return stream.data() + entries[i].offset; }
+	Record record( size_t i ) const;
+
+	// First record received at or after time, records() when none is
+	size_t find( uint64_t received ) const;
+
+private:
+	MappedFile stream;
+	MappedFile index;
+	const IndexEntry *entries = nullptr;
+	size_t count = 0;
+};
+
+} // namespace scope
+
+#endif
@@ -0,0 +1,132 @@
+//-----------------------------------------------------------------------------
+// ring.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "ring.h"
+
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+namespace scope {
+
+BroadcastRing::BroadcastRing( size_t slots, size_t slotBytes ) :
+	count( slots ),
+	slotBytes( slotBytes ),
+	slot( new Slot[slots] ),
+	data( new uint8_t[slots * slotBytes] ),
+	head( 0 ),
+	closed( false )
+{
+	for ( size_t i = 0; i < count; i++ ) {
+		slot[i].sequence.store( 0, std::memory_order_relaxed );
+	}
+}
+
+bool BroadcastRing::publish( const Record &record )
+{
+	if ( record.bytes.size() > slotBytes ) return false;
+
+	uint64_t n = head.load( std::memory_order_relaxed );
+	Slot &s = slot[n % count];
+
+	// Readers that see the odd count, or a different one after copying,
+	// drop what they copied
+	s.sequence.store( 2 * n + 1, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	s.offset = record.offset;
+	s.length = record.bytes.size();
+	s.type = record.type;
+	memcpy( data.get() + ( n % count ) * slotBytes, record.bytes.data(), record.bytes.size() );
+
+	s.sequence.store( 2 * n + 2, std::memory_order_release );
+	head.store( n + 1, std::memory_order_release );
+	return true;
+}
+
+void BroadcastRing::close( void )
+{
+	closed.store( true, std::memory_order_release );
+}
+
+BroadcastRing::Cursor BroadcastRing::subscribe( void ) const
+{
+	Cursor cursor;
+	cursor.next = head.load( std::memory_order_acquire );
+	return cursor;
+}
+
+BroadcastRing::Result BroadcastRing::read( Cursor &cursor, Record &record ) const
+{
+	for ( ;; ) {
+		// Closed is read first, so a record published before the ring
+		// was closed is not missed
+		bool last = closed.load( std::memory_order_acquire );
+		uint64_t published = head.load( std::memory_order_acquire );
+		if ( cursor.next >= published ) return last ? CLOSED : EMPTY;
+
+		// Overwritten records are skipped, the oldest slot is left
+		// alone since the producer may be writing it
+		if ( published - cursor.next >= count ) {
+			uint64_t oldest = published - count + 1;
+			cursor.dropped += oldest - cursor.next;
+			cursor.next = oldest;
+		}
+
+		const Slot &s = slot[cursor.next % count];
+		uint64_t sequence = s.sequence.load( std::memory_order_acquire );
+		if ( sequence == 2 * cursor.next + 2 ) {
+			// Torn fields are thrown away below, but must not
+			// take the copy out of the slot
+			size_t length = s.length;
+			if ( length > slotBytes ) length = slotBytes;
+			record.offset = s.offset;
+			record.type = s.type;
+			const uint8_t *bytes = data.get() + ( cursor.next % count ) * slotBytes;
+			record.bytes.assign( bytes, bytes + length );
+
+			std::atomic_thread_fence( std::memory_order_acquire );
+			if ( s.sequence.load( std::memory_order_relaxed ) == sequence ) {
+				cursor.next++;
+				return READ;
+			}
+		}
+
+		// The producer came round to the slot: it holds a later record
+		// now, the head has moved on and the loop skips ahead
+		if ( head.load( std::memory_order_acquire ) == published ) std::this_thread::yield();
+	}
+}
+
+BroadcastRing::Result BroadcastRing::wait( Cursor &cursor, Record &record, unsigned timeoutMs ) const
+{
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds( timeoutMs );
+	for ( ;; ) {
+		Result result = read( cursor, record );
+		if ( result != EMPTY || std::chrono::steady_clock::now() >= end ) return result;
+		std::this_thread::sleep_for( std::chrono::microseconds( 200 ) );
+	}
+}
+
+} // namespace scope
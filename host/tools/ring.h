@@ -0,0 +1,92 @@
+//-----------------------------------------------------------------------------
+// ring.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Broadcast ring of records
+//-----------------------------------------------------------------------------
+// One producer, the thread that reads the link, publishes every record into
+// a ring of fixed slots; any number of consumers read all of them at their
+// own pace. The producer never waits: it overwrites the oldest slot, so a
+// consumer that falls more than a ring behind loses records, and it is told
+// how many. Nothing is locked, each slot is a seqlock: its count is odd
+// while the producer writes it and tells which record it holds otherwise.
+
+#ifndef SCOPE_RING_H
+#define SCOPE_RING_H
+
+#include "stream.h"
+
+#include <atomic>
+#include <memory>
+
+namespace scope {
+
+class BroadcastRing {
+public:
+	// slots records of up to slotBytes bytes each
+	BroadcastRing( size_t slots, size_t slotBytes );
+
+	// Copies the record into the next slot, false when it is longer than a
+	// slot. Only one thread may publish.
+	bool publish( const Record &record );
+
+	// No more records will be published
+	void close( void );
+
+	// Read position of a consumer
+	struct Cursor {
+		uint64_t next = 0;
+		uint64_t dropped = 0;	// records overwritten before they were read
+	};
+
+	// A consumer that takes the records published from now on
+	Cursor subscribe( void ) const;
+
+	enum Result { READ, EMPTY, CLOSED };
+
+	// Takes the next record. EMPTY when there is none yet, CLOSED when
+	// there is none and there will be none.
+	Result read( Cursor &cursor, Record &record ) const;
+
+	// The same, waiting up to timeoutMs for a record
+	Result wait( Cursor &cursor, Record &record, unsigned timeoutMs ) const;
+
+	uint64_t published( void ) const { return head.load( std::memory_order_acquire ); }
+	size_t slots( void ) const { return count; }
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> sequence;	// 2n+2 holds record n, odd while written
+		uint64_t offset;
+		uint32_t length;
+		uint8_t type;
+	};
+
+	size_t count;
+	size_t slotBytes;
+	std::unique_ptr<Slot[]> slot;
+	std::unique_ptr<uint8_t[]> data;
+	std::atomic<uint64_t> head;		// records published
+	std::atomic<bool> closed;
+};
+
+} // namespace scope
+
+#endif
@@ -0,0 +1,377 @@
+//-----------------------------------------------------------------------------
+// stream.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "stream.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace scope {
+
+// Largest capture of any configuration, longer lengths are garbage
+static const uint16_t SAMPLESMAX = 4096;
+
+uint16_t crc16( const uint8_t *data, size_t length, uint16_t crc )
+{
+	for ( size_t i = 0; i < length; i++ ) {
+		crc ^= data[i];
+		for ( uint8_t bit = 0; bit < 8; bit++ ) {
+			crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0x8408 : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Record lengths
+//-----------------------------------------------------------------------------
+
+uint8_t frameDecimation( uint8_t mode )
+{
+	return ( mode & MODE_PACKED ) ? DECIMATION_OFF : ( mode >> 3 ) & 0x03;
+}
+
+// Header bytes of a frame or view with the blocks its trigger mode byte
+// announces
+static size_t headerLength( uint8_t mode, size_t length )
+{
+	if ( mode & MODE_CHANNELS ) length += 8;
+	if ( mode & MODE_SEGMENTS ) length += 6;
+	if ( frameDecimation( mode ) ) length += 2;
+	return length;
+}
+
+// Bytes of count samples as the trigger mode byte says they are sent
+static size_t payloadLength( uint8_t mode, uint16_t count )
+{
+	if ( !( mode & MODE_PACKED ) ) return count;
+	if ( ( mode >> 3 ) & 0x03 ) return count / 2 * 3;
+	return count / 4 * 5;
+}
+
+long recordLength( const uint8_t *data, size_t available, bool linkTest )
+{
+	if ( available < 1 ) return 0;
+	if ( data[0] != SYNC ) return -1;
+	if ( available < 2 ) return 0;
+
+	switch ( data[1] ) {
+	case RECORD_FRAME:
+	case RECORD_COMPRESSED: {
+		if ( available < 12 ) return 0;
+		uint8_t mode = data[9];
+		uint16_t count = getWord( data + 10 );
+		if ( count == 0 || count > SAMPLESMAX || ( mode & MODE_TRIGGER ) > 6 ) return -1;
+
+		size_t header = headerLength( mode, 12 );
+		if ( data[1] == RECORD_FRAME ) return header + payloadLength( mode, count ) + 2;
+
+		if ( available < header + 2 ) return 0;
+		uint16_t payload = getWord( data + header );
+		if ( payload > SAMPLESMAX ) return -1;
+		return header + 2 + payload + 2;
+	}
+	case RECORD_TELEMETRY:
+	case RECORD_METER:
+		return 32;
+	case RECORD_SPECTRUM: {
+		if ( available < 13 ) return 0;
+		uint16_t bins = getWord( data + 4 );
+		uint8_t bits = data[7];
+		if ( bins > SAMPLESMAX / 2 || ( bits != 8 && bits != 16 ) ) return -1;
+		return 13 + bins * bits / 8 + 2;
+	}
+	case RECORD_VIEW: {
+		if ( available < 16 ) return 0;
+		uint16_t count = getWord( data + 14 );
+		if ( count > SAMPLESMAX + 1 ) return -1;
+		return headerLength( data[9], 16 ) + count + 2;
+	}
+	case RECORD_LINKTEST:
+		return linkTest ? 18 : -1;
+	default:
+		return -1;
+	}
+}
+
+bool numbered( uint8_t type )
+{
+	switch ( type ) {
+	case RECORD_FRAME:
+	case RECORD_COMPRESSED:
+	case RECORD_VIEW:
+	case RECORD_METER:
+	case RECORD_SPECTRUM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// StreamReader
+//-----------------------------------------------------------------------------
+
+void StreamReader::feed( const uint8_t *data, size_t length )
+{
+	// Drop what has been read before the buffer grows
+	if ( start > 0 && start >= buffer.size() / 2 ) {
+		buffer.erase( buffer.begin(), buffer.begin() + start );
+		base += start;
+		start = 0;
+	}
+	buffer.insert( buffer.end(), data, data + length );
+}
+
+bool StreamReader::next( Record &record )
+{
+	for ( ;; ) {
+		const uint8_t *data = buffer.data() + start;
+		size_t available = buffer.size() - start;
+
+		const uint8_t *sync = (const uint8_t *)memchr( data, SYNC, available );
+		if ( !sync ) {
+			skipped += available;
+			start = buffer.size();
+			return false;
+		}
+		skipped += sync - data;
+		start += sync - data;
+		data = sync;
+		available = buffer.size() - start;
+
+		long length = recordLength( data, available, linkTest );
+		if ( length == 0 ) return false;
+		if ( length > 0 && (size_t)length > available ) return false;
+
+		bool valid = length > 0;
+		if ( valid && data[1] != RECORD_LINKTEST ) {
+			valid = crc16( data + 2, length - 4 ) == getWord( data + length - 2 );
+		}
+		if ( !valid ) {
+			skipped++;
+			start++;
+			continue;
+		}
+
+		record.type = data[1];
+		record.offset = base + start;
+		record.bytes.assign( data, data + length );
+		start += length;
+		found++;
+		return true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Frames
+//-----------------------------------------------------------------------------
+
+static void readSamples( const uint8_t *data, uint16_t count, Frame &frame )
+{
+	frame.bits = 8;
+	frame.samples.assign( data, data + count );
+}
+
+uint8_t frameBits( uint8_t mode )
+{
+	if ( !( mode & MODE_PACKED ) ) return 8;
+	return ( ( mode >> 3 ) & 0x03 ) ? 12 : 10;
+}
+
+bool unpackSamples( const uint8_t *data, size_t length, uint8_t bits, std::vector<uint16_t> &samples )
+{
+	uint8_t group = ( bits == 12 ) ? 2 : 4;
+	uint8_t lowBits = bits - 8;
+	uint8_t mask = ( 1 << lowBits ) - 1;
+	if ( length % ( group + 1 ) ) return false;
+
+	samples.reserve( samples.size() + length / ( group + 1 ) * group );
+	for ( const uint8_t *end = data + length; data < end; data += group + 1 ) {
+		uint8_t low = data[group];
+		for ( uint8_t j = 0; j < group; j++ ) {
+			samples.push_back( ( data[j] << lowBits ) | ( low & mask ) );
+			low >>= lowBits;
+		}
+	}
+	return true;
+}
+
+// Signed value of the low bits of a code
+static int8_t signedBits( uint8_t code, uint8_t bits )
+{
+	uint8_t sign = 1 << ( bits - 1 );
+	return ( ( code & ( 2 * sign - 1 ) ) ^ sign ) - sign;
+}
+
+// The codes of a compressed frame, see compress.cpp. Deltas are added modulo
+// 256. False unless they give exactly count samples.
+static bool decompress( const uint8_t *data, size_t length, uint16_t count, Frame &frame )
+{
+	frame.bits = 8;
+	frame.samples.clear();
+	frame.samples.reserve( count );
+
+	uint8_t previous = 0;
+	for ( size_t i = 0; i < length; ) {
+		uint8_t code = data[i++];
+		uint8_t n = ( code & 0x3F ) + 1;
+
+		switch ( code & 0xC0 ) {
+		case 0x00:
+			frame.samples.insert( frame.samples.end(), n, previous );
+			break;
+		case 0x40:
+			previous += signedBits( code >> 3, 3 );
+			frame.samples.push_back( previous );
+			previous += signedBits( code, 3 );
+			frame.samples.push_back( previous );
+			break;
+		case 0x80:
+			previous += signedBits( code, 6 );
+			frame.samples.push_back( previous );
+			break;
+		default:
+			if ( i + n > length ) return false;
+			for ( ; n > 0; n-- ) {
+				previous = data[i++];
+				frame.samples.push_back( previous );
+			}
+		}
+		if ( frame.samples.size() > count ) return false;
+	}
+	return frame.samples.size() == count;
+}
+
+// Reads the segment and decimation blocks that start at offset, if any, and
+// returns the offset after them
+static size_t readBlocks( const uint8_t *data, size_t offset, Frame &frame )
+{
+	if ( frame.mode & MODE_SEGMENTS ) {
+		frame.segmented = true;
+		frame.segment = data[offset];
+		frame.segmentCount = data[offset + 1];
+		frame.segmentTime = getLong( data + offset + 2 );
+		offset += 6;
+	}
+	frame.decimation = frameDecimation( frame.mode );
+	if ( frame.decimation != DECIMATION_OFF ) {
+		frame.decimateFactor = data[offset];
+		frame.decimatePhase = data[offset + 1];
+		offset += 2;
+	}
+	return offset;
+}
+
+bool decodeFrame( const Record &record, Frame &frame )
+{
+	const uint8_t *data = record.bytes.data();
+
+	frame = Frame();
+	frame.type = record.type;
+	frame.sequence = getWord( data + 2 );
+	frame.mode = data[9];
+	frame.channels = 1;
+
+	if ( record.type == RECORD_VIEW ) {
+		frame.trigger = getWord( data + 4 );
+		frame.viewFirst = getWord( data + 6 );
+		frame.prescaler = data[8];
+		frame.viewLength = getWord( data + 10 );
+		frame.viewMode = data[12];
+		frame.viewStep = data[13];
+
+		size_t offset = readBlocks( data, 16, frame );
+		readSamples( data + offset, getWord( data + 14 ), frame );
+		return true;
+	}
+
+	if ( record.type != RECORD_FRAME && record.type != RECORD_COMPRESSED ) return false;
+
+	frame.triggerIndex = getWord( data + 4 );
+	frame.stopIndex = getWord( data + 6 );
+	frame.prescaler = data[8];
+	frame.size = getWord( data + 10 );
+	frame.trigger = ( frame.triggerIndex + frame.size - frame.stopIndex ) % frame.size;
+
+	size_t offset = 12;
+	if ( frame.mode & MODE_CHANNELS ) {
+		frame.channels = data[12];
+		frame.firstChannel = data[13];
+		frame.inputs = getWord( data + 14 );
+		frame.channelRate = getLong( data + 16 );
+		offset += 8;
+	}
+	offset = readBlocks( data, offset, frame );
+
+	if ( record.type == RECORD_COMPRESSED ) {
+		uint16_t payload = getWord( data + offset );
+		return decompress( data + offset + 2, payload, frame.size, frame );
+	}
+
+	if ( frame.mode & MODE_PACKED ) {
+		frame.bits = frameBits( frame.mode );
+		return unpackSamples( data + offset, payloadLength( frame.mode, frame.size ), frame.bits,
+			frame.samples );
+	}
+
+	readSamples( data + offset, frame.size, frame );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Spectra
+//-----------------------------------------------------------------------------
+
+bool decodeSpectrum( const Record &record, Spectrum &spectrum )
+{
+	if ( record.type != RECORD_SPECTRUM ) return false;
+	const uint8_t *data = record.bytes.data();
+
+	spectrum = Spectrum();
+	spectrum.sequence = getWord( data + 2 );
+	uint16_t count = getWord( data + 4 );
+	spectrum.window = data[6];
+	spectrum.bits = data[7];
+	spectrum.exponent = data[8];
+	spectrum.rate = getLong( data + 9 );
+
+	for ( uint16_t k = 0; k < count; k++ ) {
+		uint16_t bin;
+		double magnitude;
+		if ( spectrum.bits == 16 ) {
+			bin = getWord( data + 13 + 2 * k );
+			magnitude = ldexp( bin, spectrum.exponent ) / 32;
+		}
+		else {
+			bin = data[13 + k];
+			magnitude = bin ? exp2( bin / 8.0 ) / 32 : 0;
+		}
+		spectrum.bins.push_back( bin );
+		spectrum.magnitudes.push_back( magnitude );
+	}
+	return true;
+}
+
+} // namespace scope
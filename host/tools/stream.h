@@ -0,0 +1,181 @@
+//-----------------------------------------------------------------------------
+// stream.h
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Host side of the output stream
+//-----------------------------------------------------------------------------
+// Splits the byte stream of the scope into records as described in "Reading
+// the stream" in README.md: a record starts with the sync byte 0xA5 and a
+// second byte that gives its type, its length follows from its header and
+// it ends with the CRC-16/CCITT of everything after the sync word. A reader
+// that finds no valid record at a 0xA5 moves on by one byte.
+
+#ifndef SCOPE_STREAM_H
+#define SCOPE_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace scope {
+
+const uint8_t SYNC = 0xA5;
+
+enum RecordType {
+	RECORD_FRAME = 0x5A,
+	RECORD_COMPRESSED = 0x5C,
+	RECORD_TELEMETRY = 0x54,
+	RECORD_METER = 0x4D,
+	RECORD_SPECTRUM = 0x46,
+	RECORD_LINKTEST = 0x42,
+	RECORD_VIEW = 0x56
+};
+
+// Trigger mode byte flags
+const uint8_t MODE_CHANNELS = 0x80;
+const uint8_t MODE_PACKED = 0x40;
+const uint8_t MODE_SEGMENTS = 0x20;
+const uint8_t MODE_TRIGGER = 0x07;
+
+// Decimation modes, in bits 3 and 4 of the trigger mode byte when the
+// samples are not packed
+enum Decimation {
+	DECIMATION_OFF = 0,
+	DECIMATION_SKIP = 1,
+	DECIMATION_AVERAGE = 2,
+	DECIMATION_PEAK = 3
+};
+
+// Decimation mode from the trigger mode byte of a frame or view
+uint8_t frameDecimation( uint8_t mode );
+
+// CRC-16/CCITT as computed by the scope (reflected 0x8408, from 0xFFFF)
+uint16_t crc16( const uint8_t *data, size_t length, uint16_t crc = 0xFFFF );
+
+static inline uint16_t getWord( const uint8_t *p )
+{
+	return p[0] | ( p[1] << 8 );
+}
+
+static inline uint32_t getLong( const uint8_t *p )
+{
+	return getWord( p ) | ( (uint32_t)getWord( p + 2 ) << 16 );
+}
+
+// Length of the record that starts with the sync word at data, from the
+// bytes available: 0 when more are needed to tell, -1 when it is no record.
+// The link self-test reply (A5 42 and the 16 byte pattern) has no CRC and
+// is only taken when linkTest is set.
+long recordLength( const uint8_t *data, size_t available, bool linkTest = false );
+
+struct Record {
+	uint8_t type;
+	uint64_t offset;		// stream offset of the sync word
+	std::vector<uint8_t> bytes;	// sync word to CRC
+};
+
+// Frames, views, measurement records and spectra carry the sequence number
+// they share at byte 2
+bool numbered( uint8_t type );
+
+class StreamReader {
+public:
+	void feed( const uint8_t *data, size_t length );
+
+	// Takes the next complete record, false when more bytes are needed
+	bool next( Record &record );
+
+	// Accept the link self-test reply while a baud rate change runs
+	void expectLinkTest( bool on ) { linkTest = on; }
+
+	uint64_t skippedBytes( void ) const { return skipped; }
+	uint64_t records( void ) const { return found; }
+
+private:
+	std::vector<uint8_t> buffer;
+	size_t start = 0;
+	uint64_t base = 0;
+	uint64_t skipped = 0;
+	uint64_t found = 0;
+	bool linkTest = false;
+};
+
+// A frame, compressed frame or view with its samples, oldest first
+struct Frame {
+	uint8_t type;
+	uint16_t sequence;
+	uint16_t triggerIndex;
+	uint16_t stopIndex;
+	uint8_t prescaler;
+	uint8_t mode;			// trigger mode byte
+	uint16_t size;			// samples in the capture
+	uint8_t bits;			// 8, 10 or 12
+
+	uint8_t channels;		// channel block
+	uint8_t firstChannel;
+	uint16_t inputs;
+	uint32_t channelRate;
+
+	bool segmented;			// segment block
+	uint8_t segment;
+	uint8_t segmentCount;
+	uint32_t segmentTime;
+
+	uint8_t decimation;		// decimation block
+	uint8_t decimateFactor;
+	uint8_t decimatePhase;		// samples before the first min/max pair
+
+	uint16_t viewFirst;		// views, in samples of the capture
+	uint16_t viewLength;
+	uint8_t viewMode;
+	uint8_t viewStep;
+
+	uint16_t trigger;		// trigger, in samples after the oldest one
+	std::vector<uint16_t> samples;
+};
+
+// Decodes the frame in a record, false for other records or when its
+// samples can not be decoded
+bool decodeFrame( const Record &record, Frame &frame );
+
+// A spectrum frame, see sendSpectrum() in spectrum.cpp
+struct Spectrum {
+	uint16_t sequence;
+	uint8_t window;
+	uint8_t bits;			// 16 linear, 8 in 1/8 octaves
+	uint8_t exponent;
+	uint32_t rate;			// samples/s, bin k is at k rate / 2 bins Hz
+	std::vector<uint16_t> bins;
+	std::vector<double> magnitudes;	// |X| of the bins in LSB
+};
+
+bool decodeSpectrum( const Record &record, Spectrum &spectrum );
+
+// Bits of the samples of a frame from its trigger mode byte
+uint8_t frameBits( uint8_t mode );
+
+// Unpacks 10-bit samples, four from five bytes, or 12-bit ones, two from
+// three bytes (see compress.cpp), and appends them to samples. False when
+// length is not a whole number of groups.
+bool unpackSamples( const uint8_t *data, size_t length, uint8_t bits, std::vector<uint16_t> &samples );
+
+} // namespace scope
+
+#endif
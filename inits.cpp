@@ -295,3 +295,122 @@ void initAnalogComparator(void)
 	sbi(DIDR1,AIN1D);
 	sbi(DIDR1,AIN0D);
 }
+
+//-----------------------------------------------------------------------------
+// initEquivalentTime()
+//-----------------------------------------------------------------------------
+void initEquivalentTime(void)
+{
+	//---------------------------------------------------------------------
+	// TCCR1A/TCCR1B settings
+	//---------------------------------------------------------------------
+	// Normal mode (WGM13:0 = 0) with no prescaling (CS12:0 = 001), TCNT1
+	// counts system clock cycles. The compare match and input capture
+	// values are cycle times relative to it. This is the same setting as
+	// the benchmark build uses, so both can run together.
+	TCCR1A = 0;
+	TCCR1B = 0;
+	sbi(TCCR1B,CS10);
+	// This bit selects which edge on the Input Capture pin (ICP1) that is
+	// used to trigger a capture event. When the ICES1 bit is written to
+	// zero, a falling (negative) edge is used as trigger, and when the
+	// ICES1 bit is written to one, a rising (positive) edge will trigger
+	// the capture. Toggle is not available, it falls back to rising.
+	if ( triggerEvent != 2 ) sbi(TCCR1B,ICES1);
+	// The interrupts are enabled pass by pass.
+	cbi(TIMSK1,ICIE1);
+	cbi(TIMSK1,OCIE1B);
+
+	//---------------------------------------------------------------------
+	// ACSR settings
+	//---------------------------------------------------------------------
+	// The comparator output is connected to the input capture front-end
+	// logic of Timer1 instead of raising its own interrupt.
+	cbi(ACSR,ACIE);
+	sbi(ACSR,ACIC);
+
+	//---------------------------------------------------------------------
+	// ADCSRB settings
+	//---------------------------------------------------------------------
+	// Conversions are started by Timer1 Compare Match B (ADTS2:0 = 101).
+	// The conversion starts on the rising edge of OCF1B, so the flag has
+	// to be cleared before the next compare match.
+	sbi(ADCSRB,ADTS2);
+	cbi(ADCSRB,ADTS1);
+	sbi(ADCSRB,ADTS0);
+}
+
+//-----------------------------------------------------------------------------
+// initSampleClock()
+//-----------------------------------------------------------------------------
+// Sets Timer1 and the ADC trigger source for the sampleClock setting.
+void initSampleClock(void)
+{
+	isClocked = ( sampleClock != 0 );
+
+	//---------------------------------------------------------------------
+	// TCCR1A/TCCR1B settings
+	//---------------------------------------------------------------------
+	// With the sample clock Timer1 counts in CTC mode (WGM13:0 = 0100)
+	// from 0 to OCR1A, the clock source selected by clockSelect:
+	//	CS12	CS11	CS10	Prescaler
+	//	0	0	1	No prescaling
+	//	0	1	0	8
+	//	0	1	1	64
+	//	1	0	0	256
+	//	1	0	1	1024
+	// Compare Match B at 0 comes once per period. Otherwise Timer1 is
+	// left as the free running cycle counter of the other modes.
+	TCCR1A = 0;
+	TCCR1B = 0;
+	cbi(TIMSK1,OCIE1B);
+	if (isClocked) {
+		TCNT1 = 0;
+		OCR1A = clockCounts;
+		OCR1B = 0;
+		TCCR1B = _BV(WGM12) | clockSelect;
+	}
+	else {
+		sbi(TCCR1B,CS10);
+	}
+	// The flag of a stale compare match would not give a rising edge
+	TIFR1 = _BV(OCF1B);
+
+	//---------------------------------------------------------------------
+	// ADCSRB settings
+	//---------------------------------------------------------------------
+	// Conversions are started by Timer1 Compare Match B (ADTS2:0 = 101),
+	// or free running (ADTS2:0 = 000). ISR(ADC_vect) clears OCF1B after
+	// every conversion, so the next compare match is a rising edge again.
+	cbi(ADCSRB,ADTS1);
+	if (isClocked) {
+		sbi(ADCSRB,ADTS2);
+		sbi(ADCSRB,ADTS0);
+	}
+	else {
+		cbi(ADCSRB,ADTS2);
+		cbi(ADCSRB,ADTS0);
+	}
+}
+
+#if BENCHMARK == 1
+//-----------------------------------------------------------------------------
+// initBenchmark()
+//-----------------------------------------------------------------------------
+void initBenchmark(void)
+{
+	//---------------------------------------------------------------------
+	// TCCR1A/TCCR1B settings
+	//---------------------------------------------------------------------
+	// Timer1 is used as a free running cycle counter. Normal mode
+	// (WGM13:0 = 0) with no prescaling (CS12:0 = 001), so TCNT1 counts
+	// system clock cycles and wraps every 4.096ms.
+	TCCR1A = 0;
+	TCCR1B = 0;
+	sbi(TCCR1B,CS10);
+	// No Timer1 interrupts are needed, the counter is only read.
+	TIMSK1 = 0;
+
+	resetBenchmark();
+}
+#endif
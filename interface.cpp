@@ -25,52 +25,1037 @@
 #include "small-scope.h"
 
 //-----------------------------------------------------------------------------
+// error
+//-----------------------------------------------------------------------------
+// Lights the error LED for ERRORBLINK ms without blocking, updateError()
+// turns it off again.
+
+static unsigned long errorTime;
+static boolean errorLit = false;
+
 void error (void) {
 	digitalWrite( errorPin, HIGH );
-	delay( 200 );
-	digitalWrite( errorPin, LOW );
+	errorTime = millis();
+	errorLit = true;
+}
+
+void updateError (void) {
+	if ( errorLit && millis() - errorTime >= ERRORBLINK ) {
+		digitalWrite( errorPin, LOW );
+		errorLit = false;
+	}
 }
 
 //-----------------------------------------------------------------------------
-// fillBuffer
+// readCommands
 //-----------------------------------------------------------------------------
-// Fills the given buffer with bufferSize chars from a Serial object
+// Byte at a time command parser, it never waits for input. A command is a
+// letter followed by an optional decimal argument, which is given either
+//	- terminated: digits ended by '\n', '\r', ';', ',' or ' ', by the
+//	  next command letter or by COMMANDDELAY ms of silence, e.g. "p32;",
+//	- length-prefixed: '#', the digit count and the digits, e.g. "p#232",
+//	  which runs as soon as the last digit arrives.
+// Several commands can be sent in one burst, e.g. "p32;w512;t100;".
+
+static uint8_t parseState = PARSE_IDLE;
+static char parseCommand;
+static uint32_t parseArgument;
+static uint8_t parseDigits;
+static uint8_t parseLength;
+static unsigned long parseTime;
+
+static boolean isTerminator( char c )
+{
+	return c == '\n' || c == '\r' || c == ';' || c == ',' || c == ' ';
+}
 
-void fillBuffer( char *buffer, byte bufferSize, HardwareSerial* serial )
+static void finishCommand( void )
 {
-	// Clean buffer
-	memset( (void *)buffer, '\0', sizeof(char) * bufferSize );
+	parseState = PARSE_IDLE;
+	runCommand( parseCommand, parseArgument );
+}
 
-	dprint(serial->available());
-	
-	byte limit = ( bufferSize < serial->available() ) ? bufferSize : serial->available();
+static void parseByte( char c )
+{
+	parseTime = millis();
 
-	dprint(serial->available());
-	dprint(bufferSize);
-	dprint(limit);
+	switch (parseState)
+	{
+	case PARSE_COUNTED:
+		if ( c >= '0' && c <= '9' ) {
+			parseArgument = parseArgument * 10 + ( c - '0' );
+			if ( ++parseDigits >= parseLength ) finishCommand();
+		}
+		else {
+			parseState = PARSE_IDLE;
+			error();
+		}
+		break;
+	case PARSE_LENGTH:
+		if ( c >= '1' && c <= '0' + COMMANDDIGITS ) {
+			parseLength = c - '0';
+			parseState = PARSE_COUNTED;
+		}
+		else {
+			parseState = PARSE_IDLE;
+			error();
+		}
+		break;
+	case PARSE_ARGUMENT:
+		if ( c >= '0' && c <= '9' && parseDigits < COMMANDDIGITS ) {
+			parseArgument = parseArgument * 10 + ( c - '0' );
+			parseDigits++;
+			break;
+		}
+		if ( c == '#' && parseDigits == 0 ) {
+			parseState = PARSE_LENGTH;
+			break;
+		}
+		finishCommand();
+		// Anything but a terminator starts the next command
+		if ( isTerminator(c) ) break;
+		// fall through
+	case PARSE_IDLE:
+	default:
+		if ( isTerminator(c) ) break;
+		parseCommand = c;
+		parseArgument = 0;
+		parseDigits = 0;
+		parseState = PARSE_ARGUMENT;
+	}
+}
 
-	// Fill buffer
-	for ( byte i = 0; i < limit; i++ ) {
-		dprint(serial->available());
-		dprint(i);
-		dprint(buffer);
+static void checkLink( void );
 
-		buffer[i] = serial->read();
+void readCommands( void )
+{
+	// The link self-test takes the bytes while it runs
+	if (linkTest) {
+		checkLink();
+		return;
+	}
+
+	while ( !linkTest && Serial.available() > 0 ) {
+		parseByte( Serial.read() );
+	}
+
+	if ( parseState == PARSE_IDLE || millis() - parseTime < COMMANDDELAY ) return;
+
+	// Hosts that send no terminator end a command with a pause, an
+	// incomplete length-prefixed argument is dropped.
+	if ( parseState == PARSE_ARGUMENT ) {
+		finishCommand();
+	}
+	else {
+		parseState = PARSE_IDLE;
+		error();
 	}
 }
 
 void printStatus( void )
 {
+	waitTransmit();
+
 	Serial.print("Buffer size: ");
 	Serial.println(ADCBUFFERSIZE);
+	Serial.print("Memory mode: ");
+	Serial.println(memoryMode);
+	Serial.print("Segments: ");
+	Serial.println(segmentCount);
+	Serial.print("Capture size: ");
+	Serial.println(captureSize);
 	Serial.print("Baud rate: ");
-	Serial.println(BAUDRATE);
+	Serial.println(baudRate);
 	Serial.print("Wait duration: ");
 	Serial.println(waitDuration);
 	Serial.print("Prescaler: ");
 	Serial.println(prescaler);
+	Serial.print("Equivalent time: ");
+	Serial.println(isEquivalentTime);
+	Serial.print("Sample clock: ");
+	Serial.println(sampleClock);
+	Serial.print("Sample rate: ");
+	Serial.println(sampleRate());
+	Serial.print("Channels: ");
+	Serial.println(muxChannels);
+	Serial.print("Channel rate: ");
+	Serial.println(sampleRate() / muxChannels);
+	Serial.print("Resolution: ");
+	Serial.println(8 + lowBits);
+	Serial.print("Oversampling: ");
+	Serial.println(oversampleShift);
+	Serial.print("Conversion period: ");
+	Serial.println(conversionPeriod());
+	Serial.print("CPU clock: ");
+	Serial.println(F_CPU);
+	Serial.print("Decimation mode: ");
+	Serial.println(decimateMode);
+	Serial.print("Decimation factor: ");
+	Serial.println(decimateFactor);
 	Serial.print("Trigger event: ");
 	Serial.println(triggerEvent);
 	Serial.print("Threshold: ");
 	Serial.println(threshold);
+	Serial.print("Trigger source: ");
+	Serial.println(triggerSource);
+	Serial.print("Hysteresis: ");
+	Serial.println(hysteresis);
+	Serial.print("Pulse mode: ");
+	Serial.println(pulseMode);
+	Serial.print("Pulse width: ");
+	Serial.println(pulseWidth);
+	Serial.print("Holdoff: ");
+	Serial.println(holdoff);
+	Serial.print("Auto timeout: ");
+	Serial.println(autoTimeout / 1000);
+	Serial.print("Framed: ");
+	Serial.println(framed);
+	Serial.print("Compressed: ");
+	Serial.println(compressed);
+	Serial.print("Meter: ");
+	Serial.println(metering);
+	Serial.print("Spectrum: ");
+	Serial.println(spectrumMode);
+	Serial.print("Window: ");
+	Serial.println(spectrumWindow);
+	Serial.print("View before: ");
+	Serial.println(viewBefore);
+	Serial.print("View after: ");
+	Serial.println(viewAfter);
+	Serial.print("View mode: ");
+	Serial.println(viewMode);
+	Serial.print("View step: ");
+	Serial.println(viewStep);
+	Serial.print("Streaming: ");
+	Serial.println(isStreaming);
+	Serial.print("Overruns: ");
+	Serial.println(streamOverruns);
+}
+
+//-----------------------------------------------------------------------------
+// Baud rate
+//-----------------------------------------------------------------------------
+// 'z' switches the link to another rate and keeps it only when a self-test
+// in both directions passes at the new rate:
+//
+//	1. the scope announces "Baud rate: <rate>" at the old rate and
+//	   switches,
+//	2. the host switches and sends the LINKPATTERN bytes of linkPattern,
+//	3. the scope answers with FRAMESYNC0, FRAMESYNCB and the pattern,
+//	4. the host sends the pattern once more,
+//	5. the scope confirms with "Baud rate: <rate>" at the new rate.
+//
+// A wrong byte or LINKTIMEOUT ms without the whole exchange switches back to
+// the old rate and reports it there. Frames, roll mode samples and periodic
+// telemetry are held back while the test runs.
+
+static const uint8_t linkPattern[LINKPATTERN] PROGMEM = {
+	0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC,
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+};
+
+static uint32_t linkFallback;
+static uint8_t linkPosition;
+static unsigned long linkStart;
+
+// Whether the USART makes the rate within BAUDTOLERANCE, with the divisor
+// HardwareSerial picks
+static boolean validBaudRate( uint32_t rate )
+{
+	if ( rate == 0 || rate > BAUDMAX ) return false;
+
+	uint32_t setting = ( F_CPU / 4 / rate - 1 ) / 2;
+	uint32_t actual = F_CPU / 8 / ( setting + 1 );
+	if ( setting > 4095 ) {
+		setting = ( F_CPU / 8 / rate - 1 ) / 2;
+		actual = F_CPU / 16 / ( setting + 1 );
+	}
+	uint32_t deviation = ( actual > rate ) ? actual - rate : rate - actual;
+	return setting <= 4095 && deviation * 1000 <= rate * BAUDTOLERANCE;
+}
+
+static void startLink( uint32_t rate )
+{
+	// Let the last byte at the old rate leave: the Serial TX buffer runs
+	// empty, then the data register, then the shift register within a
+	// character time.
+	while ( Serial.availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1 );
+	while ( !( UCSR0A & _BV(UDRE0) ) );
+	uint32_t character = 10000000UL / baudRate + 1;	// microseconds
+	for ( ; character > 10000; character -= 10000 ) delayMicroseconds( 10000 );
+	delayMicroseconds( character );
+	Serial.begin(rate);
+	baudRate = rate;
+
+	// Whatever arrived was sent at the other rate
+	while ( Serial.available() > 0 ) Serial.read();
+
+	// The roll mode sample rate follows the link rate
+	if (isStreaming) updatePrescaler();
+}
+
+static void endLinkTest( boolean passed )
+{
+	linkTest = false;
+	if ( !passed ) {
+		startLink( linkFallback );
+		error();
+	}
+
+	Serial.print("Baud rate: ");
+	Serial.println(baudRate);
+}
+
+// Runs the self-test on the received bytes, never blocks
+static void checkLink( void )
+{
+	while ( Serial.available() > 0 ) {
+		uint8_t expected = pgm_read_byte( linkPattern + linkPosition % LINKPATTERN );
+		if ( Serial.read() != expected ) {
+			endLinkTest( false );
+			return;
+		}
+
+		if ( ++linkPosition == LINKPATTERN ) {
+			Serial.write( FRAMESYNC0 );
+			Serial.write( FRAMESYNCB );
+			for ( uint8_t i = 0; i < LINKPATTERN; i++ ) {
+				Serial.write( pgm_read_byte( linkPattern + i ) );
+			}
+		}
+		else if ( linkPosition == 2 * LINKPATTERN ) {
+			endLinkTest( true );
+			return;
+		}
+	}
+
+	if ( millis() - linkStart >= LINKTIMEOUT ) endLinkTest( false );
+}
+
+void setBaudRate( uint32_t rate )
+{
+	waitTransmit();
+
+	if ( !validBaudRate( rate ) ) {
+		error();
+		return;
+	}
+
+	Serial.print("Baud rate: ");
+	Serial.println(rate);
+
+	linkFallback = baudRate;
+	startLink( rate );
+
+	linkPosition = 0;
+	linkStart = millis();
+	linkTest = true;
+}
+
+//-----------------------------------------------------------------------------
+// drainStream
+//-----------------------------------------------------------------------------
+// Sends the samples between streamTail and ADCCounter without blocking: no
+// more bytes are written than fit into the free space of the Serial TX
+// buffer. ISR(ADC_vect) only writes ADCCounter and loop() only writes
+// streamTail; interrupts are disabled just for the 16-bit accesses.
+
+void drainStream( void )
+{
+	if ( txBusy ) return;
+
+	cli();
+	uint16_t head = ADCCounter;
+	sei();
+	uint16_t tail = streamTail;
+
+	int room = Serial.availableForWrite();
+
+	while ( room > 0 && tail != head ) {
+		// Largest contiguous run up to the head or the end of the buffer
+		uint16_t n = ( head > tail ) ? head - tail : ADCBUFFERSIZE - tail;
+		if ( n > (uint16_t)room ) n = room;
+
+		Serial.write( (uint8_t *)ADCBuffer + tail, n );
+
+		tail += n;
+		if (tail >= ADCBUFFERSIZE) tail = 0;
+		room -= n;
+	}
+
+	cli();
+	streamTail = tail;
+	sei();
+}
+
+//-----------------------------------------------------------------------------
+// sendFrame
+//-----------------------------------------------------------------------------
+// Sends the frozen capture, oldest sample first. In framed mode the samples
+// are preceded by a sync word and a header and followed by a CRC:
+//
+//	offset	size	field
+//	0	2	sync word FRAMESYNC0, FRAMESYNC1
+//	2	2	sequence number
+//	4	2	triggerIndex
+//	6	2	stopIndex
+//	8	1	ADC prescaler the capture ran at (adcPrescaler())
+//	9	1	trigger mode (triggerEvent, 4 for continuous,
+//			6 for equivalent time), FRAMECHANNELS set when
+//			the channel block follows, FRAMEPACKED when the
+//			samples are packed 10 or 12-bit ones, the
+//			oversampling exponent from bit FRAMEOVERSAMPLE
+//			or, unpacked, the decimation mode from bit
+//			FRAMEDECIMATION
+//	10	2	sample count
+//	12	n	samples
+//	12+n	2	CRC-16/CCITT of bytes 2 to 11+n
+//
+// Packed samples take 5n/4 bytes at 10 bits and 3n/2 bytes at 12 bits, which
+// come with an oversampling exponent above 0; see compress.cpp.
+//
+// Multichannel captures, and captures with the sample clock, whose rate the
+// prescaler does not tell, insert a channel block after byte 11, which
+// moves the samples and the CRC 8 bytes on:
+//
+//	12	1	channel count
+//	13	1	channel of the first sample
+//	14	2	ADC inputs of the channels, 3 bits each from bit 0
+//	16	4	sample rate of each channel in samples/s
+//
+// The samples are interleaved, one per channel in turn.
+//
+// Each segment of a segmented capture is sent as a frame of its own, the
+// frames of a batch back to back. They carry a segment block after the
+// channel block, if any, which moves the samples and the CRC 6 more bytes
+// on:
+//
+//	+0	1	segment number, 0 to count-1
+//	+1	1	segment count
+//	+2	4	micros() at the trigger of the segment
+//
+// A decimated capture (see setDecimation()) ends the header with a
+// decimation block, 2 more bytes:
+//
+//	+0	1	decimation factor, conversions per block
+//	+1	1	samples before the first whole min/max pair, 0 or 1,
+//			0 unless the mode is DECIMATE_PEAK
+//
+// Words are little endian. The CRC is the one computed by _crc_ccitt_update
+// (reflected polynomial 0x8408, initial value 0xFFFF).
+//
+// The frame is handed to the transmit engine and sendFrame() returns at once;
+// txBusy is cleared when the last byte has been handed to the UART.
+
+static uint8_t frameHeader[FRAMEHEADERMAX];
+static uint8_t frameHeaderLength;
+static uint8_t frameTrailer[2];
+
+void putWord( uint8_t *dest, uint16_t word, uint16_t *crc )
+{
+	dest[0] = lowByte(word);
+	dest[1] = highByte(word);
+	*crc = _crc_ccitt_update( *crc, dest[0] );
+	*crc = _crc_ccitt_update( *crc, dest[1] );
+}
+
+void putLong( uint8_t *dest, uint32_t value, uint16_t *crc )
+{
+	putWord( dest, value & 0xFFFF, crc );
+	putWord( dest + 2, value >> 16, crc );
+}
+
+// Fills the header of the frozen capture, starts its CRC and returns its
+// length
+uint8_t buildFrameHeader( uint8_t *header, uint16_t *crc )
+{
+	uint8_t channels = muxChannels;
+
+	*crc = 0xFFFF;
+
+	header[0] = FRAMESYNC0;
+	header[1] = FRAMESYNC1;
+	putWord( header + 2, frameSequence++, crc );
+	putWord( header + 4, frozenTriggerIndex, crc );
+	putWord( header + 6, frozenStopIndex, crc );
+	header[8] = adcPrescaler();
+	*crc = _crc_ccitt_update( *crc, header[8] );
+	header[9] = isEquivalentTime ? 6 : ( isContinuous ? 4 : triggerEvent );
+	if ( channels > 1 || isClocked ) header[9] |= FRAMECHANNELS;
+	if ( memoryMode == MEMORY_SEGMENTED ) header[9] |= FRAMESEGMENTS;
+	if (lowBits) header[9] |= FRAMEPACKED;
+	header[9] |= oversampleShift << FRAMEOVERSAMPLE;
+	header[9] |= frameDecimation() << FRAMEDECIMATION;
+	*crc = _crc_ccitt_update( *crc, header[9] );
+	putWord( header + 10, captureSize, crc );
+
+	uint8_t length = FRAMEHEADER;
+
+	// The rate of a clocked capture does not follow from the prescaler,
+	// it goes in the channel block, of one channel if need be.
+	if ( channels > 1 || isClocked ) {
+		// The oldest sample was taken captureSize - 1 samples before
+		// the one at the stop position.
+		uint16_t inputs = 0;
+		for ( uint8_t i = 0; i < channels; i++ ) {
+			inputs |= (uint16_t)channelList[i] << ( 3 * i );
+		}
+		header[length] = channels;
+		header[length + 1] = ( frozenChannel + 1 + channels - captureSize % channels ) % channels;
+		*crc = _crc_ccitt_update( *crc, header[length] );
+		*crc = _crc_ccitt_update( *crc, header[length + 1] );
+		putWord( header + length + 2, inputs, crc );
+		putLong( header + length + 4, sampleRate() / channels, crc );
+		length += 8;
+	}
+
+	if ( memoryMode == MEMORY_SEGMENTED ) {
+		header[length] = sendingSegment;
+		header[length + 1] = segmentCount;
+		*crc = _crc_ccitt_update( *crc, header[length] );
+		*crc = _crc_ccitt_update( *crc, header[length + 1] );
+		putLong( header + length + 2, segmentTime[sendingSegment], crc );
+		length += 6;
+	}
+
+	if ( frameDecimation() != DECIMATE_OFF ) {
+		putDecimation( header + length, 0, crc );
+		length += 2;
+	}
+
+	return length;
+}
+
+// Decimation mode of the frozen capture. Equivalent time passes store every
+// conversion whatever the mode.
+uint8_t frameDecimation( void )
+{
+	return isEquivalentTime ? DECIMATE_OFF : decimateMode;
+}
+
+// Puts the decimation block for the samples of the frozen capture from the
+// first one on, in time order. The minimum of a pair is stored at the end of
+// a block, which leaves decimateCount at 0, and the maximum with the next
+// conversion; the oldest sample is captureSize - 1 stores before the one at
+// the stop.
+void putDecimation( uint8_t *dest, uint16_t first, uint16_t *crc )
+{
+	uint8_t phase = 0;
+	if ( decimateMode == DECIMATE_PEAK ) {
+		phase = ( ( frozenDecimation == 0 ) ^ captureSize ^ first ) & 1;
+	}
+
+	dest[0] = decimateFactor;
+	dest[1] = phase;
+	*crc = _crc_ccitt_update( *crc, dest[0] );
+	*crc = _crc_ccitt_update( *crc, dest[1] );
+}
+
+// Time the current frame was handed over, for the telemetry
+static unsigned long sendStart;
+
+void sendFrame( void )
+{
+	uint8_t *buffer = (uint8_t *)frozenBuffer;
+	uint16_t size = captureSize;
+	uint16_t stop = frozenStopIndex;
+
+	waitTransmit();
+	txRegions = 0;
+	sendStart = micros();
+
+	// Meter mode sends a record that fits into the Serial TX buffer
+	if (metering) {
+		sendMeasurements();
+		return;
+	}
+
+	// The spectrum replaces the capture it is computed from
+	if (spectrumMode) {
+		sendSpectrum();
+		return;
+	}
+
+	// A view of the capture goes out instead of all of it
+	if ( sendView() ) return;
+
+	// 10 and 12-bit samples are packed by the main loop as well
+	if (lowBits) {
+		sendPackedFrame();
+		return;
+	}
+
+	if ( !framed ) {
+		queueTransmit( buffer + stop, size - stop );
+		queueTransmit( buffer, stop );
+		startTransmit();
+		return;
+	}
+
+	// Compressed frames are encoded by the main loop, unless they would
+	// not be smaller than the plain ones.
+	if ( compressed && sendCompressedFrame() ) return;
+
+	uint16_t crc;
+	frameHeaderLength = buildFrameHeader( frameHeader, &crc );
+
+	// CRC in the order the samples are sent
+	for ( uint16_t i = stop; i < size; i++ ) {
+		crc = _crc_ccitt_update( crc, buffer[i] );
+	}
+	for ( uint16_t i = 0; i < stop; i++ ) {
+		crc = _crc_ccitt_update( crc, buffer[i] );
+	}
+	frameTrailer[0] = lowByte(crc);
+	frameTrailer[1] = highByte(crc);
+
+	queueTransmit( frameHeader, frameHeaderLength );
+	queueTransmit( buffer + stop, size - stop );
+	queueTransmit( buffer, stop );
+	queueTransmit( frameTrailer, sizeof(frameTrailer) );
+	startTransmit();
+}
+
+//-----------------------------------------------------------------------------
+// Transmit engine
+//-----------------------------------------------------------------------------
+// Sends up to TXREGIONS memory regions straight from where they are, without
+// copying them into the Serial TX buffer. The Arduino core owns the USART Data
+// Register Empty interrupt, so ISR(USART_TX_vect) is used instead: on every
+// Transmit Complete it loads the shift register and the data register, which
+// keeps the line busy for two bytes per interrupt. The line then idles for
+// the interrupt latency every two bytes, see "Transmission" in README.md.
+//
+// Serial.write() must not be used while txBusy is set, call waitTransmit()
+// first.
+
+void queueTransmit( const uint8_t *data, uint16_t length )
+{
+	if ( length == 0 || txRegions >= TXREGIONS ) return;
+
+	txRegionStart[txRegions] = data;
+	txRegionLength[txRegions] = length;
+	txRegions++;
+}
+
+void startTransmit( void )
+{
+	if ( txRegions == 0 ) return;
+
+	// Let the Serial TX buffer run empty and the data register free up
+	// before taking over the UART. Serial.flush() can not be used: it
+	// waits for TXC0, which the Transmit Complete interrupt clears.
+	while ( Serial.availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1 );
+	while ( !( UCSR0A & _BV(UDRE0) ) );
+
+	cli();
+	txRegion = 0;
+	txPointer = txRegionStart[0];
+	txRemaining = txRegionLength[0];
+
+	// Clear a pending Transmit Complete flag by writing one to it, then
+	// send the first byte; the interrupt continues from there, if
+	// anything is left.
+	sbi( UCSR0A, TXC0 );
+	UDR0 = *txPointer++;
+	if ( --txRemaining != 0 || nextTransmitRegion() ) {
+		txBusy = true;
+		sbi( UCSR0B, TXCIE0 );
+	}
+	sei();
+}
+
+// Moves on to the next region when one has been sent, false after the last
+boolean nextTransmitRegion( void )
+{
+	if ( ++txRegion >= txRegions ) return false;
+	txPointer = txRegionStart[txRegion];
+	txRemaining = txRegionLength[txRegion];
+	return true;
+}
+
+void waitTransmit( void )
+{
+	// A compressed frame is produced by the caller's context
+	while ( txBusy ) encodeFrame();
+}
+
+//-----------------------------------------------------------------------------
+// Telemetry
+//-----------------------------------------------------------------------------
+// Measures the running scope with micros() (Timer0, 4us resolution):
+//	sample interval		trigger to stop time over the samples in between
+//	trigger to stop		time from the trigger to the last sample
+//	send time		frame handed over until the transmit engine
+//				is done with it
+//	frames per second	frames sent in the last TELEMETRYPERIOD ms
+//	missed			ping-pong captures that had to stop the ADC,
+//				equivalent time passes that missed their edge
+//
+// The binary record (TELEMETRY_RECORD) is little endian:
+//
+//	offset	size	field
+//	0	2	sync word FRAMESYNC0, FRAMESYNCT
+//	2	4	micros() when sent
+//	6	4	sample interval, ns
+//	10	4	trigger to stop, us
+//	14	4	send time of the last frame, us
+//	18	4	longest send time, us
+//	22	2	frames per second
+//	24	2	frames sent
+//	26	2	missed captures
+//	28	2	stream overruns
+//	30	2	CRC-16/CCITT of bytes 2 to 29, as in frames
+
+static unsigned long sendTime;
+static unsigned long sendMax;
+static uint16_t framesSent;
+static unsigned long windowStart;
+static uint16_t windowFrames;
+static uint16_t framesPerSecond;
+static boolean telemetryPeriodic = false;
+
+// Runs the 'x' command
+void runTelemetry( uint8_t mode )
+{
+	telemetryPeriodic = ( mode == TELEMETRY_PERIODIC );
+
+	switch (mode)
+	{
+	case TELEMETRY_TEXT:
+		printTelemetry();
+		break;
+	case TELEMETRY_RECORD:
+	case TELEMETRY_PERIODIC:
+		sendTelemetry();
+		break;
+	default:
+		error();
+	}
+}
+
+// Called by loop() when a frame has been sent
+void recordFrame( void )
+{
+	sendTime = micros() - sendStart;
+	if ( sendTime > sendMax ) sendMax = sendTime;
+	framesSent++;
+}
+
+void updateTelemetry( void )
+{
+	if ( millis() - windowStart < TELEMETRYPERIOD ) return;
+
+	windowStart += TELEMETRYPERIOD;
+	framesPerSecond = framesSent - windowFrames;
+	windowFrames = framesSent;
+
+	// A record would break up a frame or the sample stream
+	if ( telemetryPeriodic && !sending && !txBusy && !isStreaming && !linkTest ) {
+		sendTelemetry();
+	}
+}
+
+// Sample interval in ns from the last capture
+static uint32_t sampleInterval( unsigned long elapsed, uint16_t samples )
+{
+	if ( samples == 0 ) return 0;
+	// Keep elapsed * 1000 within 32 bits, slow captures lose the ns
+	if ( elapsed < 0xFFFFFFFFUL / 1000 ) return elapsed * 1000 / samples;
+	return elapsed / samples * 1000;
+}
+
+void printTelemetry( void )
+{
+	waitTransmit();
+
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long elapsed = teleElapsed;
+	uint16_t samples = teleCaptured;
+	uint16_t missed = teleMissed;
+	uint16_t overruns = streamOverruns;
+	SREG = oldSREG;
+
+	Serial.print("Sample interval ns: ");
+	Serial.println(sampleInterval( elapsed, samples ));
+	Serial.print("Trigger to stop us: ");
+	Serial.println(elapsed);
+	Serial.print("Send time us: ");
+	Serial.println(sendTime);
+	Serial.print("Send time max us: ");
+	Serial.println(sendMax);
+	Serial.print("Frames per second: ");
+	Serial.println(framesPerSecond);
+	Serial.print("Frames sent: ");
+	Serial.println(framesSent);
+	Serial.print("Missed captures: ");
+	Serial.println(missed);
+	Serial.print("Overruns: ");
+	Serial.println(overruns);
+}
+
+void sendTelemetry( void )
+{
+	waitTransmit();
+
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long elapsed = teleElapsed;
+	uint16_t samples = teleCaptured;
+	uint16_t missed = teleMissed;
+	uint16_t overruns = streamOverruns;
+	SREG = oldSREG;
+
+	uint8_t record[TELEMETRYSIZE];
+	uint16_t crc = 0xFFFF;
+
+	record[0] = FRAMESYNC0;
+	record[1] = FRAMESYNCT;
+	putLong( record + 2, micros(), &crc );
+	putLong( record + 6, sampleInterval( elapsed, samples ), &crc );
+	putLong( record + 10, elapsed, &crc );
+	putLong( record + 14, sendTime, &crc );
+	putLong( record + 18, sendMax, &crc );
+	putWord( record + 22, framesPerSecond, &crc );
+	putWord( record + 24, framesSent, &crc );
+	putWord( record + 26, missed, &crc );
+	putWord( record + 28, overruns, &crc );
+	record[30] = lowByte(crc);
+	record[31] = highByte(crc);
+
+	Serial.write( record, sizeof(record) );
+}
+
+#if BENCHMARK == 1
+//-----------------------------------------------------------------------------
+// Timer1 stamps
+//-----------------------------------------------------------------------------
+// Timer1 counts every cycle and wraps at 2^16, except with the sample clock,
+// where it counts from 0 to OCR1A at the timer prescaler. Spans longer than
+// a timer period are not told apart.
+
+static uint16_t benchDivider( void )
+{
+	static const uint16_t dividers[] = { 1, 8, 64, 256, 1024 };
+	return isClocked ? dividers[clockSelect - 1] : 1;
+}
+
+uint16_t benchSpan( uint16_t from, uint16_t to )
+{
+	if (!isClocked) return to - from;
+	uint16_t counts = to >= from ? to - from : to + ( clockCounts - from ) + 1;
+	return counts * benchDivider();
+}
+
+//-----------------------------------------------------------------------------
+// benchLatency
+//-----------------------------------------------------------------------------
+// Called by the ADC ISR with its entry stamp.
+//
+// The entries before the grid starts are left out: the first one after
+// the ADC is enabled starts it, with the sample clock the one after, since
+// the first conversion starts with ADSC instead of the timer.
+//
+// Free running conversions complete on a grid of one conversion period, so
+// the distance of an entry from its point on the grid is its interrupt
+// latency less that of the entry the grid started with. An entry is taken
+// for the nearest point on the grid, and one that is nearer to a later
+// point lost a conversion per period in between. That holds while the
+// latencies spread by less than half a period; the simavr bench in host/
+// sees the conversions themselves.
+//
+// With the sample clock a conversion starts when Timer1 passes 0 and
+// completes 13.5 ADC cycles later, so the stamp tells the latency itself.
+// An ISR that enters after the next period began held OCF1B past its match,
+// and that conversion never started: it shows as an entry before its
+// conversion could have completed. An ISR a whole period late is not seen.
+
+void benchLatency( uint16_t entry )
+{
+	uint8_t adps = ADCSRA & 0x07;
+	uint16_t prescale = adps ? 1 << adps : 2;
+	int32_t late;
+
+	if (benchADCStart) {
+		if ( --benchADCStart == 0 ) benchADCGrid = entry;
+		return;
+	}
+
+	if (isClocked) {
+		late = (int32_t)entry * benchDivider() - 27 * prescale / 2;
+		if ( late < 0 ) {
+			benchMissed++;
+			return;
+		}
+		if ( late > INT16_MAX ) late = INT16_MAX;
+	}
+	else {
+		uint16_t period = ADCCYCLES * prescale;
+		late = (int16_t)( entry - benchADCGrid - period );
+		if ( late > period / 2 ) {
+			uint16_t lost = ( late + period / 2 ) / period;
+			benchMissed += lost;
+			late -= (int32_t)lost * period;
+		}
+		benchADCGrid = entry - late;
+	}
+
+	if ( late < benchLateMin ) benchLateMin = late;
+	if ( late > benchLateMax ) benchLateMax = late;
+}
+
+//-----------------------------------------------------------------------------
+// probeOverhead
+//-----------------------------------------------------------------------------
+// Cycles of the ADC ISR outside its stamps: interrupt response, jump,
+// prologue, the bookkeeping after the exit stamp, epilogue and reti. Reads
+// Timer1 in a loop; an ADC interrupt between two reads makes the gap
+// between them longer by the whole ISR, which is the cycles between its
+// stamps and the overhead. The smallest overhead of up to PROBEROUNDS
+// interrupts is taken, another interrupt in the same gap only adds to it.
+// 0 when no ADC interrupt came.
+
+static uint16_t probeOverhead( void )
+{
+	uint8_t oldSREG = SREG;
+	uint16_t idle = 0xFFFF;
+	uint16_t overhead = 0xFFFF;
+	uint8_t rounds = 0;
+
+	// The 16-bit read of TCNT1 goes through the TEMP register the ISRs
+	// use as well
+	cli();
+	uint16_t last = TCNT1;
+	uint16_t count = benchADCCount;
+	SREG = oldSREG;
+
+	for ( uint16_t i = 0; i < PROBELOOPS && rounds < PROBEROUNDS; i++ ) {
+		cli();
+		uint16_t now = TCNT1;
+		uint16_t seen = benchADCCount;
+		uint16_t inside = benchADCLast;
+		SREG = oldSREG;
+
+		uint16_t gap = benchSpan( last, now );
+		if ( seen == count ) {
+			if ( gap < idle ) idle = gap;
+		}
+		else if ( (uint16_t)( seen - count ) == 1 ) {
+			uint16_t extra = gap - inside;
+			if ( extra < overhead ) overhead = extra;
+			rounds++;
+		}
+		last = now;
+		count = seen;
+	}
+
+	if ( rounds == 0 || idle == 0xFFFF || overhead < idle ) return 0;
+	return overhead - idle;
+}
+
+//-----------------------------------------------------------------------------
+// printBenchmark
+//-----------------------------------------------------------------------------
+// Prints ISR cycle counts gathered since the last reset. All values are in
+// system clock cycles.
+
+void printBenchmark( void )
+{
+	waitTransmit();
+
+	// While the ADC runs, before the counters are copied
+	uint16_t overhead = probeOverhead();
+
+	// Copy the counters atomically, they are updated from the ISRs
+	uint8_t oldSREG = SREG;
+	cli();
+	uint16_t count = benchADCCount;
+	uint32_t cycles = benchADCCycles;
+	uint16_t maxCycles = benchADCMaxCycles;
+	int16_t lateMin = benchLateMin;
+	int16_t lateMax = benchLateMax;
+	uint16_t missed = benchMissed;
+	uint16_t acCount = benchACCount;
+	uint16_t acMaxCycles = benchACMaxCycles;
+	SREG = oldSREG;
+
+	boolean gridded = lateMax >= lateMin;
+
+	Serial.print("ADC ISR count: ");
+	Serial.println(count);
+	Serial.print("ADC ISR avg cycles: ");
+	Serial.println(count ? cycles / count : 0);
+	Serial.print("ADC ISR max cycles: ");
+	Serial.println(maxCycles);
+	// Not between the stamps, 0 when the ADC did not run during the probe
+	Serial.print("ADC ISR overhead: ");
+	Serial.println(overhead);
+	// Longest less shortest interrupt latency. With the sample clock the
+	// latencies are known, from the completed conversion to the stamp.
+	Serial.print("ADC latency spread: ");
+	Serial.println(gridded ? lateMax - lateMin : 0);
+	if (isClocked) {
+		Serial.print("ADC latency max: ");
+		Serial.println(gridded ? lateMax : 0);
+	}
+	Serial.print("ADC missed samples: ");
+	Serial.println(missed);
+	Serial.print("AC ISR count: ");
+	Serial.println(acCount);
+	Serial.print("AC ISR max cycles: ");
+	Serial.println(acMaxCycles);
+
+	// A conversion takes ADCCYCLES ADC clocks. The whole ISR must finish
+	// before the next one completes, otherwise samples are lost. Without
+	// a probe there is no figure.
+	if (overhead) {
+		uint8_t safePrescaler = 128;
+		for ( uint8_t p = 2; p <= 64; p <<= 1 ) {
+			if ( (uint16_t)ADCCYCLES * p > maxCycles + overhead ) {
+				safePrescaler = p;
+				break;
+			}
+		}
+		Serial.print("Min safe prescaler: ");
+		Serial.println(safePrescaler);
+		Serial.print("Max sample rate: ");
+		Serial.println(F_CPU / ( (uint32_t)ADCCYCLES * safePrescaler ));
+	}
+
+	// Spectra per second from the last transform: a full capture at each
+	// prescaler, the transform and the frame on the link
+	Serial.print("Spectrum cycles: ");
+	Serial.println(benchSpectrumCycles);
+	if ( benchSpectrumCycles ) {
+		uint32_t sendCycles = (uint32_t)benchSpectrumBytes * 10 * ( F_CPU / baudRate );
+		for ( uint8_t p = 16; p <= 128; p <<= 1 ) {
+			uint32_t captureCycles = (uint32_t)captureSize * ADCCYCLES * p;
+			Serial.print("Spectrum rate p");
+			Serial.print(p);
+			Serial.print(": ");
+			Serial.println(F_CPU / ( captureCycles + benchSpectrumCycles + sendCycles ));
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// resetBenchmark
+//-----------------------------------------------------------------------------
+void resetBenchmark( void )
+{
+	uint8_t oldSREG = SREG;
+	cli();
+	benchADCCount = 0;
+	benchADCCycles = 0;
+	benchADCMaxCycles = 0;
+	benchADCLast = 0;
+	benchADCStart = 1;
+	benchLateMin = INT16_MAX;
+	benchLateMax = INT16_MIN;
+	benchMissed = 0;
+	benchACCount = 0;
+	benchACMaxCycles = 0;
+	SREG = oldSREG;
 }
+#endif
@@ -0,0 +1,265 @@
+//-----------------------------------------------------------------------------
+// Measure.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "small-scope.h"
+
+//-----------------------------------------------------------------------------
+// Measurements
+//-----------------------------------------------------------------------------
+// Two passes over the frozen capture, oldest sample first, in integer
+// arithmetic. The first one finds the minimum, the maximum and the sums of
+// the samples and of their squares. The second one finds the rising and
+// falling edges: an edge goes from the 10% to the 90% level of the swing (or
+// back), which serves as hysteresis, and is placed where it last crossed the
+// 50% level. From the edges follow
+//
+//	period		first to last rising edge over the periods in between
+//	duty cycle	time above 50% over the same periods
+//	rise time	last sample at or below 10% to first sample at or
+//			above 90%, averaged over the rising edges
+//
+// Times are taken in whole samples and converted with the sample rate of the
+// channel, so the averages over several edges resolve fractions of a sample.
+// Multichannel captures are measured on their first input, 10 and 12-bit
+// captures at their full resolution.
+
+static uint8_t *measureBuffer;
+static uint16_t measureSize;
+static uint16_t measureStop;
+static uint8_t measureBits;
+
+static uint16_t minimum;
+static uint16_t maximum;
+static uint16_t mean;		// 1/16 LSB
+static uint16_t rms;		// 1/16 LSB
+static uint16_t rises;
+static uint32_t period;		// ns
+static uint32_t frequency;	// mHz
+static uint16_t duty;		// 0.01%
+static uint32_t riseTime;	// ns
+
+// Sample at buffer index i, with its low bits
+static uint16_t measureSample( uint16_t i )
+{
+	uint16_t sample = measureBuffer[i];
+	if ( !measureBits ) return sample;
+
+	uint8_t perByte = ( measureBits == 2 ) ? 2 : 1;
+	uint8_t plane = measureBuffer[measureSize + ( i >> perByte )];
+	uint8_t shift = ( i & ( ( 1 << perByte ) - 1 ) ) * measureBits;
+	return ( sample << measureBits ) | ( ( plane >> shift ) & ( ( 1 << measureBits ) - 1 ) );
+}
+
+// Integer square root, rounded down
+uint16_t squareRoot( uint32_t value )
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while ( bit > value ) bit >>= 2;
+	while ( bit ) {
+		if ( value >= root + bit ) {
+			value -= root + bit;
+			root = ( root >> 1 ) + bit;
+		}
+		else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// Samples in the rate units of the channel, to time units per second
+static uint32_t toTime( uint32_t samples, uint16_t count, uint32_t rate, uint32_t units )
+{
+	if ( count == 0 || rate == 0 ) return 0;
+	return (uint64_t)samples * units / ( (uint64_t)rate * count );
+}
+
+//-----------------------------------------------------------------------------
+// measureCapture
+//-----------------------------------------------------------------------------
+// Measures the frozen capture, or the segment selected for sending.
+
+static void measureCapture( void )
+{
+	uint8_t channels = muxChannels;
+
+	measureBuffer = (uint8_t *)frozenBuffer;
+	measureSize = captureSize;
+	measureStop = frozenStopIndex;
+	measureBits = lowBits;
+
+	// Offset of the first sample of the first input, see buildFrameHeader()
+	uint8_t first = ( frozenChannel + 1 + channels - measureSize % channels ) % channels;
+	uint16_t offset = ( channels - first ) % channels;
+	uint16_t count = ( measureSize - offset + channels - 1 ) / channels;
+
+	// Minimum, maximum, mean and RMS
+	uint32_t sum = 0;
+	uint32_t squares = 0;
+	uint8_t squaresHigh = 0;
+
+	minimum = 0xFFFF;
+	maximum = 0;
+	uint16_t i = measureStop + offset;
+	if ( i >= measureSize ) i -= measureSize;
+	for ( uint16_t k = 0; k < count; k++ ) {
+		uint16_t sample = measureSample( i );
+		if ( sample < minimum ) minimum = sample;
+		if ( sample > maximum ) maximum = sample;
+		sum += sample;
+		uint32_t previous = squares;
+		squares += (uint32_t)sample * sample;
+		if ( squares < previous ) squaresHigh++;
+
+		i += channels;
+		if ( i >= measureSize ) i -= measureSize;
+	}
+
+	mean = ( ( sum << 4 ) + count / 2 ) / count;
+	uint64_t meanSquare = ( ( (uint64_t)squaresHigh << 32 ) | squares ) << 8;
+	rms = squareRoot( meanSquare / count );
+
+	// Edges
+	uint16_t swing = maximum - minimum;
+	uint16_t low = minimum + swing / 10;
+	uint16_t high = maximum - swing / 10;
+	uint16_t middle = minimum + swing / 2;
+
+	uint8_t level = LEVEL_UNKNOWN;
+	uint16_t lastLow = 0;
+	uint16_t crossing = 0;
+	uint16_t firstRise = 0;
+	uint16_t lastRise = 0;
+	uint16_t lastFall = 0;
+	boolean fell = false;
+	uint32_t riseSum = 0;
+	uint32_t highSum = 0;
+
+	rises = 0;
+	if ( swing < ( METERSWING << measureBits ) ) count = 0;
+
+	i = measureStop + offset;
+	if ( i >= measureSize ) i -= measureSize;
+	for ( uint16_t k = 0; k < count; k++ ) {
+		uint16_t sample = measureSample( i );
+
+		if ( level != LEVEL_HIGH ) {
+			if ( sample <= low ) {
+				level = LEVEL_LOW;
+				lastLow = k;
+			}
+			if ( sample < middle ) crossing = k + 1;
+			if ( sample >= high ) {
+				if ( level == LEVEL_LOW ) {
+					riseSum += k - lastLow;
+					if ( rises == 0 ) firstRise = crossing;
+					else if (fell) highSum += lastFall - lastRise;
+					lastRise = crossing;
+					rises++;
+				}
+				fell = false;
+				level = LEVEL_HIGH;
+			}
+		}
+		else {
+			if ( sample > middle ) crossing = k + 1;
+			if ( sample <= low ) {
+				lastFall = crossing;
+				fell = ( rises > 0 );
+				lastLow = k;
+				level = LEVEL_LOW;
+			}
+		}
+
+		i += channels;
+		if ( i >= measureSize ) i -= measureSize;
+	}
+
+	uint32_t rate = sampleRate() / channels;
+	uint16_t span = lastRise - firstRise;
+	uint16_t periods = ( rises > 1 ) ? rises - 1 : 0;
+
+	period = toTime( span, periods, rate, 1000000000UL );
+	frequency = span ? (uint64_t)rate * 1000 * periods / span : 0;
+	duty = ( periods && span ) ? highSum * 10000 / span : 0;
+	riseTime = toTime( riseSum, rises, rate, 1000000000UL );
+}
+
+//-----------------------------------------------------------------------------
+// sendMeasurements
+//-----------------------------------------------------------------------------
+// Sends the measurements of the frozen capture instead of its samples, as a
+// METERSIZE byte record (little endian):
+//
+//	offset	size	field
+//	0	2	sync word FRAMESYNC0, FRAMESYNCM
+//	2	2	sequence number, shared with the frames
+//	4	1	resolution in bits
+//	5	1	rising edges found, up to 255
+//	6	2	minimum
+//	8	2	maximum
+//	10	2	peak to peak
+//	12	2	mean, 1/16 LSB
+//	14	2	RMS, 1/16 LSB
+//	16	4	period, ns
+//	20	4	frequency, mHz
+//	24	2	duty cycle, 0.01%
+//	26	4	rise time, ns
+//	30	2	CRC-16/CCITT of bytes 2 to 29, as in frames
+//
+// Period, frequency and duty cycle are 0 with less than two rising edges,
+// the rise time with none. No edges are looked for when the swing is below
+// METERSWING LSB at 8 bits.
+
+void sendMeasurements( void )
+{
+	measureCapture();
+
+	uint8_t record[METERSIZE];
+	uint16_t crc = 0xFFFF;
+
+	record[0] = FRAMESYNC0;
+	record[1] = FRAMESYNCM;
+	putWord( record + 2, frameSequence++, &crc );
+	record[4] = 8 + measureBits;
+	record[5] = ( rises > 255 ) ? 255 : rises;
+	crc = _crc_ccitt_update( crc, record[4] );
+	crc = _crc_ccitt_update( crc, record[5] );
+	putWord( record + 6, minimum, &crc );
+	putWord( record + 8, maximum, &crc );
+	putWord( record + 10, maximum - minimum, &crc );
+	putWord( record + 12, mean, &crc );
+	putWord( record + 14, rms, &crc );
+	putLong( record + 16, period, &crc );
+	putLong( record + 20, frequency, &crc );
+	putWord( record + 24, duty, &crc );
+	putLong( record + 26, riseTime, &crc );
+	record[30] = lowByte(crc);
+	record[31] = highByte(crc);
+
+	Serial.write( record, sizeof(record) );
+}
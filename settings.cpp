@@ -29,6 +29,21 @@
 //-----------------------------------------------------------------------------
 void startADC( void )
 {
+	#if BENCHMARK == 1
+	// A clocked capture starts with the conversion of ADSC, off the timer
+	benchADCStart = isClocked ? 2 : 1;
+	#endif
+	// A multichannel capture goes on with the input after the last stored
+	// sample, so the samples that are left from the previous capture keep
+	// the interleave. In free running mode the first two conversions both
+	// use it, the first is discarded.
+	uint8_t first = stopChannel + 1;
+	if ( first >= muxChannels ) first = 0;
+	ADMUX = ( ADMUX & 0xF8 ) | channelList[first];
+	channelMux = first;
+	channelResult = ( muxChannels > 1 && !isClocked ) ? CHANNEL_DISCARD : first;
+	// A block of the decimation does not span a stop of the ADC either
+	restartDecimation();
 	// Enable ADC
 	sbi(ADCSRA,ADEN);
 	// Start conversion
@@ -54,6 +69,726 @@ void stopAnalogComparator( void )
 	cbi( ACSR,ACIE );
 }
 
+//-----------------------------------------------------------------------------
+// startTrigger()
+//-----------------------------------------------------------------------------
+// Arms the selected trigger source for the next capture, once the holdoff is
+// over.
+void startTrigger( void )
+{
+	if (isEquivalentTime) {
+		// Timer1 Input Capture of the comparator edge, an edge from
+		// before arming does not count
+		TIFR1 = _BV(ICF1);
+		sbi(TIMSK1,ICIE1);
+	}
+	else {
+		// Samples before the ADC was restarted do not count
+		triggerLevel = LEVEL_UNKNOWN;
+		resumeTrigger();
+	}
+}
+void stopTrigger( void )
+{
+	stopAnalogComparator();
+	cbi(TIMSK1,ICIE1);
+	triggerArmed = false;
+	stopTriggerTimer();
+}
+
+// Arms the trigger after the holdoff, also when the ISRs rearm a capture
+void resumeTrigger( void )
+{
+	if (holdoff) {
+		startTriggerTimer( TIMER_HOLDOFF, holdoff );
+	}
+	else {
+		armTrigger();
+	}
+}
+
+// Arms the trigger now and starts the auto trigger timeout
+void armTrigger( void )
+{
+	if ( triggerSource == TRIGGER_DIGITAL ) {
+		triggerArmed = true;
+	}
+	else {
+		startAnalogComparator();
+	}
+
+	if (autoTimeout) {
+		startTriggerTimer( TIMER_AUTO, autoTimeout );
+	}
+	else {
+		stopTriggerTimer();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Trigger timer
+//-----------------------------------------------------------------------------
+// Times the holdoff and the auto trigger timeout with Timer0 Compare Match B,
+// so they end to the Timer0 tick (4us at 16MHz) whatever loop() is doing.
+// ISR(TIMER0_COMPB_vect) does the rest.
+void startTriggerTimer( uint8_t state, uint32_t length )
+{
+	uint8_t oldSREG = SREG;
+	cli();
+	triggerTimer = state;
+	triggerTimerStart = micros();
+	triggerTimerLength = length;
+	// A wait shorter than two ticks ends with the next but one
+	if ( !scheduleTriggerTimer( length ) ) OCR0B = TCNT0 + 2;
+	TIFR0 = _BV(OCF0B);
+	sbi(TIMSK0,OCIE0B);
+	SREG = oldSREG;
+}
+
+void stopTriggerTimer( void )
+{
+	cbi(TIMSK0,OCIE0B);
+	triggerTimer = TIMER_IDLE;
+}
+
+// Sets the next match to the end of a wait with left us to go, or leaves it
+// one Timer0 period on when the wait is longer. Returns false when less than
+// two ticks are left.
+boolean scheduleTriggerTimer( uint32_t left )
+{
+	uint8_t cycles = clockCyclesPerMicrosecond();
+
+	if ( left >= 256UL * TIMERPRESCALER / cycles ) return true;
+
+	uint8_t ticks = left * cycles / TIMERPRESCALER;
+	if ( ticks < 2 ) return false;
+
+	OCR0B = TCNT0 + ticks;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// armCapture()
+//-----------------------------------------------------------------------------
+// Prepares the next capture in captureBuffer and starts the ADC and, when
+// triggered, the Analog Comparator.
+void armCapture( void )
+{
+	stopIndex = Capture::disarmed;
+
+	if (isEquivalentTime) {
+		// The ADC stays enabled and converts on Timer1 only, every
+		// trigger starts the next pass.
+		uint8_t adps = ADCSRA & 0x07;
+		etsPeriod = AUTOCYCLES << ( adps ? adps : 1 );
+		etsStep = etsPeriod / ETSPASSES;
+		etsPhase = 0;
+		etsPosition = captureSize;
+		etsRemaining = ( captureSize + ETSPASSES - 1 ) / ETSPASSES;
+		startTrigger();
+		return;
+	}
+
+	// A segmented capture starts over in the first segment
+	if ( memoryMode == MEMORY_SEGMENTED ) {
+		captureBuffer = ADCBuffer;
+		segment = 0;
+		sendingSegment = 0;
+	}
+
+	// Keep the trigger position when only part of the buffer is used
+	waitDuration = newWaitDuration / ( ADCBUFFERSIZE / captureSize );
+	// Time to prebuffer the next frame
+	waitRemaining = captureSize - waitDuration;
+	startADC();
+
+	if (!isContinuous) {
+		startTrigger();
+	}
+	else {
+		triggerContinuous();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Set memory mode
+//-----------------------------------------------------------------------------
+// Stops the acquisition, splits ADCBuffer for the new mode and rearms.
+//	Mode	Layout
+//	0	Single capture of ADCBUFFERSIZE samples
+//	1	Ping-pong, two captures of ADCBUFFERSIZE/2 samples. The ISR
+//		continues in one half while loop() sends the other.
+//	2	Segmented, segmentCount captures of ADCBUFFERSIZE/segmentCount
+//		samples. The ISR rearms in the next segment as soon as one is
+//		full, loop() sends them all when the last one is.
+// A 10 or 12-bit capture keeps the low bits of its samples in a plane of a
+// quarter or half of their size right behind them, so it holds half as many
+// samples.
+
+// Samples of one capture in the memory mode
+static uint16_t captureSamples( uint8_t mode )
+{
+	uint16_t size = ADCBUFFERSIZE;
+	if ( mode == MEMORY_PINGPONG ) size = ADCBUFFERSIZE / 2;
+	else if ( mode == MEMORY_SEGMENTED ) size = segmentStride;
+	return ( highResolution || oversampling ) ? size / 2 : size;
+}
+
+void setMemoryMode( uint8_t mode )
+{
+	dshow("# setMemoryMode()");
+	dprint(mode);
+
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	stopTrigger();
+	stopADC();
+
+	// Equivalent time passes fill the whole buffer
+	if (isEquivalentTime) mode = 0;
+
+	switch (mode)
+	{
+	case 1:
+		memoryMode = MEMORY_PINGPONG;
+		break;
+	case 2:
+		memoryMode = MEMORY_SEGMENTED;
+		break;
+	case 0:
+	default:
+		memoryMode = MEMORY_SINGLE;
+	}
+	captureSize = isEquivalentTime ? ADCBUFFERSIZE : captureSamples( memoryMode );
+
+	captureBuffer = ADCBuffer;
+	frozenBuffer = ADCBuffer;
+	ADCCounter = 0;
+	freeze = false;
+	captureDone = false;
+	updateResolution();
+	updateFastPath();
+
+	armCapture();
+}
+
+// Splits ADCBuffer into count segments, rounded down to a power of two from 2
+// to SEGMENTSMAX, for the segmented memory mode.
+void setSegments( uint8_t count )
+{
+	dshow("# setSegments()");
+	dprint(count);
+
+	uint8_t segments = 2;
+	while ( segments < SEGMENTSMAX && ( segments << 1 ) <= count ) segments <<= 1;
+
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	stopTrigger();
+	stopADC();
+
+	segmentCount = segments;
+	segmentStride = ADCBUFFERSIZE / segments;
+
+	setMemoryMode( memoryMode );
+}
+
+// Makes segment index of a full segmented capture the frozen capture. All
+// segments have the trigger as many samples before the stop.
+void selectSegment( uint8_t index )
+{
+	index_t stop = segmentStop[index];
+
+	frozenBuffer = ADCBuffer + index * segmentStride;
+	frozenStopIndex = stop;
+	frozenTriggerIndex = Capture::advance( stop, captureSize - waitDuration, captureSize );
+	frozenChannel = segmentChannel[index];
+	frozenDecimation = segmentDecimation[index];
+}
+
+//-----------------------------------------------------------------------------
+// Roll mode
+//-----------------------------------------------------------------------------
+// Starts or stops gapless streaming. While streaming the whole ADCBuffer is
+// a ring that ISR(ADC_vect) fills and drainStream() empties, and the sample
+// rate is limited to what the serial link can carry.
+void setStreaming( boolean streaming )
+{
+	dshow("# setStreaming()");
+	dprint(streaming);
+
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	stopTrigger();
+	stopADC();
+
+	memoryMode = MEMORY_SINGLE;
+	captureBuffer = ADCBuffer;
+	captureSize = streaming ? ADCBUFFERSIZE : captureSamples( MEMORY_SINGLE );
+	frozenBuffer = ADCBuffer;
+	ADCCounter = 0;
+	freeze = false;
+	captureDone = false;
+
+	if (streaming) {
+		streamTail = 0;
+		streamOverruns = 0;
+		isStreaming = true;
+		updateChannels();
+		updateResolution();
+		updateFastPath();
+
+		updatePrescaler();
+		startADC();
+	}
+	else {
+		isStreaming = false;
+		updateChannels();
+		updateResolution();
+		updateFastPath();
+
+		updatePrescaler();
+		armCapture();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Equivalent time sampling
+//-----------------------------------------------------------------------------
+// For repetitive signals. A frame is put together from ETSPASSES passes, each
+// started by its own trigger edge. Timer1 Input Capture takes the time of the
+// comparator edge and Timer1 Compare Match B starts the conversions of the
+// pass AUTOCYCLES ADC clocks apart. The first one is ETSDELAY cycles plus
+// etsStep cycles per pass after the edge, etsStep being the conversion period
+// divided by ETSPASSES. Pass n fills the slots n, n+ETSPASSES, ..., so the
+// frame has one sample per etsStep cycles: 4MHz at prescaler 16.
+//
+// An auto triggered conversion resets the ADC prescaler and samples a fixed
+// 2 ADC clocks and 3 cycles after the compare match, so the slots are exact
+// to the cycle.
+void setEquivalentTime( boolean equivalent )
+{
+	dshow("# setEquivalentTime()");
+	dprint(equivalent);
+
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	stopTrigger();
+	stopADC();
+	cbi(TIMSK1,OCIE1B);
+
+	memoryMode = MEMORY_SINGLE;
+	captureBuffer = ADCBuffer;
+	captureSize = equivalent ? ADCBUFFERSIZE : captureSamples( MEMORY_SINGLE );
+	frozenBuffer = ADCBuffer;
+	ADCCounter = 0;
+	freeze = false;
+	captureDone = false;
+
+	if (equivalent) {
+		// Timer1 is taken over, the sample clock resumes afterwards
+		isEquivalentTime = true;
+		isClocked = false;
+		updateChannels();
+		updateResolution();
+		updateFastPath();
+		etsPosition = captureSize;
+		setADCPrescaler( prescaler < ETSPRESCALER ? ETSPRESCALER : prescaler );
+		initEquivalentTime();
+
+		// The first conversion after enabling the ADC initializes it,
+		// it is discarded since no pass is running.
+		startADC();
+		armCapture();
+	}
+	else {
+		isEquivalentTime = false;
+		cbi(ACSR,ACIC);
+		// Back to Free Running mode or the sample clock
+		initSampleClock();
+		updateChannels();
+		updateResolution();
+		updateFastPath();
+
+		updatePrescaler();
+		armCapture();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Sample clock
+//-----------------------------------------------------------------------------
+// Auto triggers the ADC from Timer1 Compare Match B instead of free running
+// conversions. Timer1 runs in CTC mode with the period closest to the rate,
+// using the smallest timer prescaler with which it fits into 16 bits, so
+// rates are not limited to the power of two steps of the ADC prescaler. An
+// auto triggered conversion resets the ADC prescaler, so the samples are
+// evenly spaced to the cycle. The rate is limited to F_CPU / CLOCKMINPERIOD;
+// 0 returns to free running conversions.
+void setSampleClock( uint32_t rate )
+{
+	dshow("# setSampleClock()");
+	dprint(rate);
+
+	// Timer1 prescalers selected by CS12:0 = 1 to 5
+	static const uint16_t dividers[] = { 1, 8, 64, 256, 1024 };
+	uint8_t select = 0;
+	uint32_t counts = 1;
+
+	if ( rate > F_CPU / CLOCKMINPERIOD ) rate = F_CPU / CLOCKMINPERIOD;
+	if ( rate > 0 ) {
+		counts = ( F_CPU + rate / 2 ) / rate;
+		while ( counts > 65536 && select < 4 ) {
+			select++;
+			counts = ( F_CPU / dividers[select] + rate / 2 ) / rate;
+		}
+		if ( counts > 65536 ) counts = 65536;
+	}
+
+	uint8_t oldSREG = SREG;
+	cli();
+	sampleClock = rate;
+	clockCounts = counts - 1;
+	clockSelect = select + 1;
+	clockCycles = counts * dividers[select];
+
+	#if BENCHMARK == 1
+	// The stamps mean something else from here on
+	resetBenchmark();
+	#endif
+
+	// Equivalent time mode owns Timer1, the clock starts when it ends
+	if (!isEquivalentTime) {
+		initSampleClock();
+		updateFastPath();
+		updatePrescaler();
+		// Free Running mode needs a conversion to be started
+		if ( !isClocked && ( ADCSRA & _BV(ADEN) ) ) sbi(ADCSRA,ADSC);
+	}
+	SREG = oldSREG;
+}
+
+// Returns the largest prescaler not above the requested one whose conversion
+// fits into the sample clock period.
+uint8_t clockedPrescaler( uint8_t Prescaler )
+{
+	uint8_t p = 128;
+	while ( p > 2 && ( p > Prescaler ||
+		(uint32_t)AUTOCYCLES * p + CLOCKMARGIN > clockCycles ) ) {
+		p >>= 1;
+	}
+	return p;
+}
+
+// Sets the ADC prescaler from the prescaler setting within the limits of the
+// current mode.
+void updatePrescaler( void )
+{
+	if (isClocked) {
+		setADCPrescaler( clockedPrescaler(prescaler) );
+	}
+	else if (isStreaming) {
+		setADCPrescaler( streamingPrescaler(prescaler) );
+	}
+	else {
+		setADCPrescaler(prescaler);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// sampleRate()
+//-----------------------------------------------------------------------------
+// Returns the division factor the ADC runs at, which the sample clock and
+// the link rate of roll mode may have changed from prescaler.
+uint8_t adcPrescaler( void )
+{
+	uint8_t adps = ADCSRA & 0x07;
+	return adps ? 1 << adps : 2;
+}
+
+// Returns the cycles from one conversion to the next.
+uint32_t conversionPeriod( void )
+{
+	if (isClocked) return clockCycles;
+
+	uint8_t adps = ADCSRA & 0x07;
+	return (uint32_t)ADCCYCLES << ( adps ? adps : 1 );
+}
+
+// Returns the rate of the samples in the buffer in samples/s, the equivalent
+// rate in equivalent time mode.
+uint32_t sampleRate( void )
+{
+	if (isEquivalentTime) {
+		uint8_t adps = ADCSRA & 0x07;
+		return ( F_CPU >> ( adps ? adps : 1 ) ) * ETSPASSES / AUTOCYCLES;
+	}
+
+	uint32_t rate = F_CPU / conversionPeriod();
+	if (oversampleShift) return rate >> ( oversampleShift << 1 );
+	switch (decimateMode)
+	{
+	case DECIMATE_OFF:
+		return rate;
+	case DECIMATE_PEAK:
+		// Two samples per block
+		return rate >> ( decimateShift - 1 );
+	default:
+		return rate >> decimateShift;
+	}
+}
+
+// Returns the smallest prescaler not below the requested one at which the
+// sample rate does not exceed the link rate of baudRate / 10 bytes/s.
+uint8_t streamingPrescaler( uint8_t Prescaler )
+{
+	uint8_t p = 2;
+	while ( p < 128 && ( p < Prescaler ||
+		(uint32_t)F_CPU * 10 > (uint32_t)ADCCYCLES * p * baudRate ) ) {
+		p <<= 1;
+	}
+	return p;
+}
+
+//-----------------------------------------------------------------------------
+// Set decimation
+//-----------------------------------------------------------------------------
+// The ADC keeps converting at the prescaler rate while only one sample per
+// factor conversions goes into the buffer.
+//	Mode	Stored sample
+//	0	Every conversion
+//	1	First conversion of each block of factor
+//	2	Mean of each block of factor
+//	3	Minimum and maximum of each block of factor
+// The factor is rounded down to a power of two so the mean is a shift and
+// the block counter a mask. Peak detection needs at least 2.
+void setDecimation( uint8_t mode, uint8_t factor )
+{
+	dshow("# setDecimation()");
+	dprint(mode);
+	dprint(factor);
+
+	// Blocks would mix the inputs of a multichannel capture, and the low
+	// bits of a 10 or 12-bit one are stored undecimated
+	if ( channelCount > 1 || highResolution || oversampling ) mode = DECIMATE_OFF;
+
+	uint8_t shift = 0;
+	while ( shift < 7 && ( 2 << shift ) <= factor ) shift++;
+	if ( mode == DECIMATE_PEAK && shift == 0 ) shift = 1;
+
+	uint8_t oldSREG = SREG;
+	cli();
+	switch (mode)
+	{
+	case 1:
+		decimateMode = DECIMATE_SKIP;
+		break;
+	case 2:
+		decimateMode = DECIMATE_AVERAGE;
+		break;
+	case 3:
+		decimateMode = DECIMATE_PEAK;
+		break;
+	case 0:
+	default:
+		decimateMode = DECIMATE_OFF;
+	}
+	decimateShift = shift;
+	decimateFactor = 1 << shift;
+	restartDecimation();
+	decimatePending = 0;
+	updateFastPath();
+	SREG = oldSREG;
+}
+
+// Starts a new block with the next conversion. In peak mode the count starts
+// at the factor, past the last one, so that the first conversion neither
+// stores the maximum of a previous block nor is left out of its own: the mask
+// takes the count on to 1.
+void restartDecimation( void )
+{
+	decimateCount = ( decimateMode == DECIMATE_PEAK ) ? decimateFactor : 0;
+	decimateSum = 0;
+	decimateMin = 255;
+	decimateMax = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Set input channels
+//-----------------------------------------------------------------------------
+// Selects the ADC inputs by a bit mask, bit n for ADCn, up to MAXCHANNELS
+// of them; 0 selects ADCPIN alone. With more than one input ISR(ADC_vect)
+// switches to the next input on every conversion and the samples of the
+// inputs are stored interleaved, in ascending input order. Roll mode and
+// equivalent time mode sample the first input only, and decimation is off.
+void setChannels( uint8_t mask )
+{
+	dshow("# setChannels()");
+	dprint(mask);
+
+	uint8_t list[MAXCHANNELS];
+	uint8_t count = 0;
+
+	for ( uint8_t input = 0; input < 8; input++ ) {
+		if ( !( mask & _BV(input) ) ) continue;
+		if ( count == MAXCHANNELS ) {
+			error();
+			return;
+		}
+		list[count++] = input;
+	}
+	if ( count == 0 ) {
+		list[count++] = ADCPIN & 0x07;
+	}
+
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	stopTrigger();
+	stopADC();
+
+	for ( uint8_t i = 0; i < count; i++ ) channelList[i] = list[i];
+	channelCount = count;
+	// Start the new list at its first input
+	stopChannel = count - 1;
+	if ( count > 1 ) setDecimation( DECIMATE_OFF, decimateFactor );
+
+	if (isEquivalentTime) {
+		setEquivalentTime(true);
+	}
+	else if (isStreaming) {
+		setStreaming(true);
+	}
+	else {
+		updateChannels();
+		updateResolution();
+		updateFastPath();
+
+		captureBuffer = ADCBuffer;
+		frozenBuffer = ADCBuffer;
+		ADCCounter = 0;
+		freeze = false;
+		captureDone = false;
+
+		armCapture();
+	}
+}
+
+// Rotates through the inputs only where the samples are stored as frames
+void updateChannels( void )
+{
+	muxChannels = ( isStreaming || isEquivalentTime ) ? 1 : channelCount;
+}
+
+//-----------------------------------------------------------------------------
+// Sample resolution
+//-----------------------------------------------------------------------------
+// Captures 8 or 10 bits per sample, or 12 bits when oversampling. The ADC
+// result stays left adjusted: ADCH holds the 8 high bits the trigger works
+// with, ADCL the 2 low bits that a 10-bit capture stores besides.
+// Oversampling sums 4^k conversions per sample, which adds k effective bits
+// and divides the sample rate by 4^k; the sums are stored as 12-bit samples.
+// Roll mode and equivalent time mode stay at 8 bits, a multichannel capture
+// is not oversampled and decimation is off at 10 and 12 bits.
+
+// Stops the acquisition and starts it again in the new resolution
+static void restartResolution( void )
+{
+	// Let a frame in flight finish before its memory is reused
+	waitTransmit();
+	sending = false;
+
+	// The capture size changes with the resolution, the ADC has to stop
+	// before the ISR stores low bits behind the samples.
+	stopTrigger();
+	stopADC();
+
+	if ( highResolution || oversampling ) {
+		setDecimation( DECIMATE_OFF, decimateFactor );
+	}
+
+	if (isEquivalentTime) {
+		setEquivalentTime(true);
+	}
+	else if (isStreaming) {
+		setStreaming(true);
+	}
+	else {
+		setMemoryMode( memoryMode );
+	}
+}
+
+void setResolution( uint8_t bits )
+{
+	dshow("# setResolution()");
+	dprint(bits);
+
+	if ( bits != 8 && bits != 10 ) {
+		error();
+		return;
+	}
+
+	highResolution = ( bits == 10 );
+	restartResolution();
+}
+
+void setOversampling( uint8_t shift )
+{
+	dshow("# setOversampling()");
+	dprint(shift);
+
+	if ( shift > OVERSAMPLEMAX ) {
+		error();
+		return;
+	}
+
+	oversampling = shift;
+	restartResolution();
+}
+
+// Stores low bits and oversamples only where the samples are stored as
+// frames. The ADC has to be stopped.
+void updateResolution( void )
+{
+	boolean frames = !isStreaming && !isEquivalentTime;
+
+	oversampleShift = ( frames && muxChannels == 1 ) ? oversampling : 0;
+	if ( !frames ) lowBits = 0;
+	else if (oversampleShift) lowBits = 4;
+	else if ( highResolution || oversampling ) lowBits = 2;
+	else lowBits = 0;
+
+	oversampleSum = 0;
+	oversampleCount = 1 << ( oversampleShift << 1 );
+}
+
+//-----------------------------------------------------------------------------
+// updateFastPath()
+//-----------------------------------------------------------------------------
+// Marks when only the plain capture is needed: the hand scheduled ADC ISR
+// runs then, and the C handler skips the checks of the other modes.
+void updateFastPath( void )
+{
+	if ( memoryMode == MEMORY_SINGLE && !isStreaming && !isClocked &&
+		muxChannels == 1 && lowBits == 0 &&
+		decimateMode == DECIMATE_OFF && !isEquivalentTime &&
+		triggerSource == TRIGGER_COMPARATOR ) {
+		sbi(GPIOR0,FASTPATH);
+	}
+	else {
+		cbi(GPIOR0,FASTPATH);
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Set and modify ADC prescaler
 //-----------------------------------------------------------------------------
@@ -179,3 +914,114 @@ void setTriggerEvent( uint8_t TriggerEvent )
 		sbi(ACSR,ACIS0);
 	}
 }
+
+//-----------------------------------------------------------------------------
+// Set trigger source
+//-----------------------------------------------------------------------------
+//	Source	Trigger
+//	0	Analog Comparator, threshold on thresholdPin
+//	1	Digital, threshold crossing of the ADC samples
+// A capture waiting for its trigger stays armed on the new source.
+void setTriggerSource( uint8_t source )
+{
+	dshow("# setTriggerSource()");
+	dprint(source);
+
+	uint8_t oldSREG = SREG;
+	cli();
+	boolean armed = triggerArmed || ( ACSR & _BV(ACIE) ) ||
+		triggerTimer == TIMER_HOLDOFF;
+	stopTrigger();
+	triggerSource = ( source == 1 ) ? TRIGGER_DIGITAL : TRIGGER_COMPARATOR;
+	updateFastPath();
+	if (armed) startTrigger();
+	SREG = oldSREG;
+}
+
+//-----------------------------------------------------------------------------
+// Set holdoff and auto trigger
+//-----------------------------------------------------------------------------
+// The holdoff is the time in us from the start of a capture (after a frame or,
+// in ping-pong and segmented mode, after the previous capture) to the arming
+// of its trigger. With an auto trigger timeout in ms, a capture whose trigger
+// does not come within the timeout after arming stops like a continuous one.
+// A capture waiting for its trigger starts over with the new setting.
+
+// Interrupts have to be disabled
+static void restartTrigger( void )
+{
+	if ( isEquivalentTime || isContinuous ) return;
+
+	boolean armed = triggerArmed || ( ACSR & _BV(ACIE) ) ||
+		triggerTimer == TIMER_HOLDOFF;
+	stopTrigger();
+	if (armed) resumeTrigger();
+}
+
+void setHoldoff( uint32_t length )
+{
+	dshow("# setHoldoff()");
+	dprint(length);
+
+	uint8_t oldSREG = SREG;
+	cli();
+	holdoff = length;
+	restartTrigger();
+	SREG = oldSREG;
+}
+
+void setAutoTrigger( uint32_t timeout )
+{
+	dshow("# setAutoTrigger()");
+	dprint(timeout);
+
+	uint8_t oldSREG = SREG;
+	cli();
+	autoTimeout = timeout * 1000;
+	restartTrigger();
+	SREG = oldSREG;
+}
+
+//-----------------------------------------------------------------------------
+// Set digital trigger
+//-----------------------------------------------------------------------------
+// Derives the digital trigger from threshold, hysteresis and triggerEvent.
+// The selected crossing happens at the threshold, the opposite one at the
+// threshold minus (rising) or plus (falling) the hysteresis, so noise on a
+// slow edge can not trigger twice. Toggle triggers on both crossings. The
+// new setting applies from the next sample on.
+void setDigitalTrigger( void )
+{
+	dshow("# setDigitalTrigger()");
+
+	uint8_t edges, high, low;
+
+	switch (triggerEvent)
+	{
+	case 0:
+		edges = EDGE_RISING | EDGE_FALLING;
+		break;
+	case 2:
+		edges = EDGE_FALLING;
+		break;
+	case 3:
+	default:
+		edges = EDGE_RISING;
+	}
+
+	if ( edges == EDGE_FALLING ) {
+		low = threshold;
+		high = ( threshold > 255 - hysteresis ) ? 255 : threshold + hysteresis;
+	}
+	else {
+		high = threshold;
+		low = ( threshold < hysteresis ) ? 0 : threshold - hysteresis;
+	}
+
+	uint8_t oldSREG = SREG;
+	cli();
+	triggerEdges = edges;
+	triggerHigh = high;
+	triggerLow = low;
+	SREG = oldSREG;
+}
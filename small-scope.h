@@ -23,22 +23,171 @@
 //-----------------------------------------------------------------------------
 
 #include <Arduino.h>
+#include <util/crc16.h>
 
 //-----------------------------------------------------------------------------
 // Defines and Typedefs
 //-----------------------------------------------------------------------------
 
+#ifndef DEBUG
 #define DEBUG		0
+#endif
+#ifndef BENCHMARK
+#define BENCHMARK	0	// Instrument ISRs with Timer1 cycle counters
+#endif
+#ifndef FASTISR
+#define FASTISR		0	// Hand scheduled ADC ISR for the plain capture
+#endif
 
-#define ADCBUFFERSIZE	1024
+// Named capture configurations, select one with SCOPECONFIG
+#define CONFIG_TINY	0	// 256 samples, 8-bit positions
+#define CONFIG_SMALL	1	// 512 samples
+#define CONFIG_UNO	2	// 1024 samples, ATmega328
+#define CONFIG_MEGA	3	// 4096 samples, ATmega1280/2560
 
-#define ADCPIN		0
+#ifndef SCOPECONFIG
+#define SCOPECONFIG	CONFIG_UNO
+#endif
+
+#if SCOPECONFIG == CONFIG_TINY
+	#define ADCBUFFERSIZE	256
+#elif SCOPECONFIG == CONFIG_SMALL
+	#define ADCBUFFERSIZE	512
+#elif SCOPECONFIG == CONFIG_MEGA
+	#define ADCBUFFERSIZE	4096
+#else
+	#define ADCBUFFERSIZE	1024
+#endif
+
+#define ADCPIN		0	// Input of a single channel capture
+#define MAXCHANNELS	4	// Inputs of a multichannel capture
+#define CHANNEL_DISCARD	0xFF	// Conversion of no known channel
 #define errorPin	13
 #define thresholdPin	3
 
-#define BAUDRATE	500000	// Baud rate of UART in bps
-#define COMMANDDELAY	2	// ms to wait for the filling of Serial buffer
-#define COMBUFFERSIZE	4	// Size of buffer for incoming numbers
+#define BAUDRATE	500000	// Baud rate of UART in bps at start up
+#define BAUDMAX		( F_CPU / 8 )	// Fastest rate of the USART, with U2X
+#define BAUDTOLERANCE	25	// Largest rate error in 1/1000, 115200 is 21
+#define LINKPATTERN	16	// Bytes of the link self-test pattern
+#define LINKTIMEOUT	500	// ms for the host to echo the pattern
+#define COMMANDDELAY	2	// ms of silence that ends an unterminated command
+#define COMMANDDIGITS	9	// Most digits of a command argument
+#define ERRORBLINK	200	// ms the error LED stays on
+
+// Command parser states
+#define PARSE_IDLE	0	// Waiting for a command letter
+#define PARSE_ARGUMENT	1	// Collecting a terminated argument
+#define PARSE_LENGTH	2	// Waiting for the digit count after '#'
+#define PARSE_COUNTED	3	// Collecting a length-prefixed argument
+
+// Memory modes
+#define MEMORY_SINGLE	0	// Whole ADCBuffer is one capture
+#define MEMORY_PINGPONG	1	// Two alternating halves of ADCBuffer
+#define MEMORY_SEGMENTED	2	// segmentCount captures sent as one batch
+#define SEGMENTSMAX	8	// Most segments of a segmented capture
+
+// Decimation modes
+#define DECIMATE_OFF	0	// Every conversion is stored
+#define DECIMATE_SKIP	1	// One of N conversions is stored
+#define DECIMATE_AVERAGE	2	// Mean of N conversions is stored
+#define DECIMATE_PEAK	3	// Min/max pair of N conversions is stored
+#define DECIMATEMAX	128	// Largest decimation factor
+
+// Trigger sources
+#define TRIGGER_COMPARATOR	0	// Analog comparator against thresholdPin
+#define TRIGGER_DIGITAL	1	// Threshold crossing of the ADC samples
+
+// Digital trigger levels
+#define LEVEL_UNKNOWN	0	// No sample outside the hysteresis band yet
+#define LEVEL_LOW	1
+#define LEVEL_HIGH	2
+
+// Crossings that trigger, from the trigger event
+#define EDGE_FALLING	0x01
+#define EDGE_RISING	0x02
+
+// Pulse width qualification
+#define PULSE_OFF	0	// Trigger on the edge itself
+#define PULSE_WIDER	1	// Pulse of more than pulseWidth samples
+#define PULSE_NARROWER	2	// Pulse of less than pulseWidth samples
+#define PULSE_UNMEASURED	0xFFFF	// Start of the pulse not seen
+
+// Trigger timer, Timer0 Compare Match B
+#define TIMER_IDLE	0
+#define TIMER_HOLDOFF	1	// Trigger is armed when the holdoff is over
+#define TIMER_AUTO	2	// Capture is forced when no trigger came in time
+#define TIMERPRESCALER	64	// Timer0 prescaler of the Arduino core
+#define AUTOTIMEOUTMAX	4294967UL	// ms, longest auto trigger timeout in 32-bit us
+
+// Equivalent time sampling
+#define ETSPASSES	56	// Passes, and so triggers, that make up a frame
+#define ETSPRESCALER	16	// Smallest prescaler, the ISRs need the time
+#define ETSDELAY	256	// Cycles from the trigger edge to the first slot
+#define ETSMARGIN	16	// Least cycles to the first conversion of a pass
+
+// Sample clock
+#define CLOCKMINPERIOD	160	// Shortest period in cycles, the ADC ISR fits
+#define CLOCKMARGIN	24	// Cycles to clear OCF1B after a conversion
+
+// 10 and 12-bit captures
+#define OVERSAMPLEMAX	2	// Largest k of 4^k conversions per sample
+
+// Transmit engine
+#define TXREGIONS	4	// Memory regions that make up one transmission
+
+// Framed output
+#define FRAMESYNC0	0xA5	// First byte of frame sync word
+#define FRAMESYNC1	0x5A	// Second byte of frame sync word
+#define FRAMESYNCZ	0x5C	// Second byte of compressed frame sync word
+#define FRAMESYNCT	0x54	// Second byte of telemetry record sync word
+#define FRAMESYNCM	0x4D	// Second byte of measurement record sync word
+#define FRAMESYNCF	0x46	// Second byte of spectrum frame sync word
+#define FRAMESYNCB	0x42	// Second byte of link self-test sync word
+#define FRAMESYNCV	0x56	// Second byte of view frame sync word
+#define FRAMECHANNELS	0x80	// Trigger mode flag of a channel block
+#define FRAMEPACKED	0x40	// Trigger mode flag of packed 10 or 12-bit samples
+#define FRAMESEGMENTS	0x20	// Trigger mode flag of a segment block
+#define FRAMEOVERSAMPLE	3	// Trigger mode bit of the oversampling exponent
+#define FRAMEDECIMATION	3	// Trigger mode bit of the decimation mode, unpacked
+#define FRAMEHEADER	12	// Bytes of the frame header
+#define FRAMEHEADERMAX	28	// Bytes of the frame header with all blocks
+
+// Telemetry
+#define TELEMETRY_TEXT	0	// Print the telemetry report
+#define TELEMETRY_RECORD	1	// Send one binary telemetry record
+#define TELEMETRY_PERIODIC	2	// Send a record every TELEMETRYPERIOD ms
+#define TELEMETRYPERIOD	1000	// ms, also the frame rate window
+#define TELEMETRYSIZE	32	// Bytes of a telemetry record
+
+// Meter mode
+#define METERSIZE	32	// Bytes of a measurement record
+#define METERSWING	4	// Least swing in 8-bit LSB to look for edges
+
+// Spectrum mode
+#define SPECTRUM_OFF	0
+#define SPECTRUM_LINEAR	1	// 16-bit magnitudes
+#define SPECTRUM_LOG	2	// 8-bit magnitudes in 1/8 octaves
+#define WINDOW_RECTANGULAR	0
+#define WINDOW_HANN	1
+#define FFTMAX		512	// Largest transform, samples
+#define FFTLIMIT	13573	// Largest value a butterfly takes, 32767 / 2.414
+#define SPECTRUMHEADER	13	// Bytes of the spectrum frame header
+
+// Views of the capture
+#define VIEW_FULL	0	// Every sample of the view
+#define VIEW_STRIDE	1	// First sample of every viewStep samples
+#define VIEW_PEAK	2	// Min/max pair of every viewStep samples
+#define VIEWSTEPMAX	255	// Largest reduction step
+#define VIEWHEADER	16	// Bytes of the view frame header
+#define VIEWHEADERMAX	24	// Bytes of the view frame header with both blocks
+
+// Compressed frame codes, the top two bits select the code
+#define CODE_RUN	0x00	// 00nnnnnn: n+1 repeats of the previous sample
+#define CODE_PAIR	0x40	// 01aaabbb: two 3-bit signed deltas
+#define CODE_DELTA	0x80	// 10dddddd: one 6-bit signed delta
+#define CODE_LITERAL	0xC0	// 11nnnnnn: n+1 raw samples follow
+#define RUNMAX		64	// Longest run of one CODE_RUN
+#define LITERALMAX	32	// Longest literal, fits into the Serial TX buffer
 
 #if DEBUG == 1
 	#define dprint(expression) Serial.print("# "); Serial.print( #expression ); Serial.print( ": " ); Serial.println( expression )
@@ -48,6 +197,25 @@
 	#define dshow(expression)
 #endif
 
+// ADC clock cycles per free running conversion
+#define ADCCYCLES	13
+// ADC clock cycles between auto triggered conversions, 13.5 rounded up
+#define AUTOCYCLES	14
+// Timer1 reads of the probe for the ADC ISR cycles the stamps do not see,
+// and the ADC interrupts it takes at most
+#define PROBELOOPS	20000
+#define PROBEROUNDS	64
+
+// C handler of the ADC interrupt when the hand scheduled one is in front
+#define ADC_C_vect	__vector_adc_c
+// GPIOR0 bit set while only the plain capture is needed
+#define FASTPATH	0
+
+// The ATmega1280/2560 name the vectors of the first USART differently
+#if !defined(USART_TX_vect) && defined(USART0_TX_vect)
+#define USART_TX_vect	USART0_TX_vect
+#endif
+
 // Defines for setting and clearing register bits
 #ifndef cbi
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
@@ -56,6 +224,56 @@
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 #endif
 
+//-----------------------------------------------------------------------------
+// Capture geometry
+//-----------------------------------------------------------------------------
+// The index types and the wrap arithmetic of the capture ring are chosen at
+// compile time from ADCBUFFERSIZE, so a build pays only for the range it
+// needs: 8-bit positions up to 256 samples, masks instead of compares for
+// power of two sizes.
+
+template <bool Small> struct UnsignedIndex { typedef uint16_t type; };
+template <> struct UnsignedIndex<true> { typedef uint8_t type; };
+template <bool Small> struct SignedIndex { typedef int16_t type; };
+template <> struct SignedIndex<true> { typedef int8_t type; };
+
+template <uint16_t Size>
+struct CaptureGeometry
+{
+	static constexpr uint16_t size = Size;
+	static constexpr bool powerOfTwo = ( Size & ( Size - 1 ) ) == 0;
+
+	// Position in the buffer
+	typedef typename UnsignedIndex< ( Size <= 256 ) >::type index_t;
+	// Stop position, also holds the disarmed value
+	typedef typename UnsignedIndex< ( Size < 255 ) >::type stop_t;
+	// Prebuffer count down, from -Size to Size
+	typedef typename SignedIndex< ( Size <= 127 ) >::type wait_t;
+
+	// Stop position that is never reached
+	static constexpr stop_t disarmed = Size + 1;
+
+	// Position after i in a ring of limit entries, limit being Size or an
+	// equal part of it
+	static inline index_t next( index_t i, uint16_t limit )
+	{
+		if ( powerOfTwo ) return ( i + 1 ) & ( limit - 1 );
+		return ( i + 1 >= limit ) ? 0 : i + 1;
+	}
+
+	// Position n entries after i, n not above limit
+	static inline index_t advance( uint16_t i, uint16_t n, uint16_t limit )
+	{
+		i += n;
+		return ( i >= limit ) ? i - limit : i;
+	}
+};
+
+typedef CaptureGeometry<ADCBUFFERSIZE> Capture;
+typedef Capture::index_t index_t;
+typedef Capture::stop_t stop_t;
+typedef Capture::wait_t wait_t;
+
 //-----------------------------------------------------------------------------
 // Global Constants
 //-----------------------------------------------------------------------------
@@ -66,38 +284,238 @@
 void initPins(void);
 void initADC(void);
 void initAnalogComparator(void);
+void initEquivalentTime(void);
+void initSampleClock(void);
+#if BENCHMARK == 1
+void initBenchmark(void);
+#endif
 
 void startADC( void );
 void stopADC( void );
 void startAnalogComparator( void );
 void stopAnalogComparator( void );
+void startTrigger( void );
+void stopTrigger( void );
+void resumeTrigger( void );
+void armTrigger( void );
+void startTriggerTimer( uint8_t state, uint32_t length );
+void stopTriggerTimer( void );
+boolean scheduleTriggerTimer( uint32_t left );
 
 void setADCPrescaler( uint8_t prescaler );
 void setVoltageReference( uint8_t reference );
 void setTriggerEvent( uint8_t event );
+void setTriggerSource( uint8_t source );
+void setDigitalTrigger( void );
+void setHoldoff( uint32_t length );
+void setAutoTrigger( uint32_t timeout );
+void setMemoryMode( uint8_t mode );
+void setSegments( uint8_t count );
+void selectSegment( uint8_t index );
+void armCapture( void );
+void setDecimation( uint8_t mode, uint8_t factor );
+void restartDecimation(void);
+void setChannels( uint8_t mask );
+void setResolution( uint8_t bits );
+void setOversampling( uint8_t shift );
+void updateResolution( void );
+void updateChannels( void );
+void updateFastPath( void );
+void setStreaming( boolean streaming );
+void setEquivalentTime( boolean equivalent );
+uint32_t sampleRate( void );
+uint32_t conversionPeriod( void );
+uint8_t adcPrescaler( void );
+void setSampleClock( uint32_t rate );
+uint8_t clockedPrescaler( uint8_t prescaler );
+void updatePrescaler( void );
+uint8_t streamingPrescaler( uint8_t prescaler );
 
 void error (void);
-// Fills the given buffer with bufferSize chars from a Serial object
-void fillBuffer( \
-	char *buffer, \
-	byte bufferSize, \
-	HardwareSerial* serial = &Serial );
+void updateError (void);
+void readCommands(void);
+void setBaudRate( uint32_t rate );
+void runCommand( char command, uint32_t argument );
 void printStatus(void);
+void sendFrame(void);
+void drainStream(void);
+void queueTransmit( const uint8_t *data, uint16_t length );
+void startTransmit(void);
+boolean nextTransmitRegion(void);
+void waitTransmit(void);
+void putWord( uint8_t *dest, uint16_t word, uint16_t *crc );
+uint8_t buildFrameHeader( uint8_t *header, uint16_t *crc );
+uint8_t frameDecimation(void);
+void putDecimation( uint8_t *dest, uint16_t first, uint16_t *crc );
+
+void runTelemetry( uint8_t mode );
+void updateTelemetry(void);
+void recordFrame(void);
+void printTelemetry(void);
+void sendTelemetry(void);
+void putLong( uint8_t *dest, uint32_t value, uint16_t *crc );
+
+boolean sendCompressedFrame(void);
+void sendPackedFrame(void);
+void encodeFrame(void);
+
+void sendMeasurements(void);
+uint16_t squareRoot( uint32_t value );
+void sendSpectrum(void);
+void setViewReduction( uint8_t mode, uint32_t step );
+boolean sendView(void);
+#if BENCHMARK == 1
+void printBenchmark(void);
+void resetBenchmark(void);
+uint16_t benchSpan( uint16_t from, uint16_t to );
+void benchLatency( uint16_t entry );
+#endif
 
 //-----------------------------------------------------------------------------
 // Global Variables
 //-----------------------------------------------------------------------------
 extern volatile uint16_t waitDuration;
-extern volatile  int16_t waitRemaining;
-extern volatile uint16_t stopIndex;
-extern volatile uint16_t triggerIndex;
-extern volatile uint16_t ADCCounter;
+extern volatile   wait_t waitRemaining;
+extern volatile   stop_t stopIndex;
+extern volatile  index_t triggerIndex;
+extern volatile  index_t ADCCounter;
 extern volatile  uint8_t ADCBuffer[ADCBUFFERSIZE];
 extern volatile  boolean freeze;
+extern volatile  boolean captureDone;
+extern volatile  uint8_t * volatile captureBuffer;
+extern volatile uint16_t captureSize;
+extern volatile  uint8_t * volatile frozenBuffer;
+extern volatile  index_t frozenStopIndex;
+extern volatile  index_t frozenTriggerIndex;
+extern           uint8_t frozenChannel;
+extern           uint8_t frozenDecimation;
+extern           boolean isContinuous;
+extern volatile  boolean isStreaming;
+extern volatile  index_t streamTail;
+extern volatile uint16_t streamOverruns;
+extern volatile  boolean isEquivalentTime;
+extern volatile  uint8_t etsPhase;
+extern volatile uint16_t etsPosition;
+extern volatile uint16_t etsRemaining;
+extern volatile  uint8_t etsStep;
+extern volatile uint16_t etsPeriod;
+extern volatile  boolean isClocked;
+extern          uint32_t sampleClock;
+extern          uint16_t clockCounts;
+extern           uint8_t clockSelect;
+extern          uint32_t clockCycles;
+extern volatile unsigned long teleTrigger;
+extern volatile uint16_t teleSamples;
+extern volatile unsigned long teleElapsed;
+extern volatile uint16_t teleCaptured;
+extern volatile uint16_t teleMissed;
+extern           boolean framed;
+extern           boolean compressed;
+extern           boolean metering;
+extern          uint32_t baudRate;
+extern           boolean linkTest;
+extern           uint8_t spectrumMode;
+extern           uint8_t spectrumWindow;
+extern          uint16_t viewBefore;
+extern          uint16_t viewAfter;
+extern           uint8_t viewMode;
+extern           uint8_t viewStep;
+extern           boolean sending;
+extern volatile  boolean txBusy;
+extern const     uint8_t * volatile txPointer;
+extern volatile uint16_t txRemaining;
+extern volatile  uint8_t txRegion;
+extern           uint8_t txRegions;
+extern const     uint8_t *txRegionStart[TXREGIONS];
+extern          uint16_t txRegionLength[TXREGIONS];
+extern          uint16_t frameSequence;
 
 extern           uint8_t prescaler;
 extern           uint8_t triggerEvent;
 extern           uint8_t threshold;
+extern           uint8_t hysteresis;
+extern volatile  uint8_t triggerSource;
+extern volatile  boolean triggerArmed;
+extern volatile  uint8_t triggerLevel;
+extern volatile  uint8_t triggerHigh;
+extern volatile  uint8_t triggerLow;
+extern volatile  uint8_t triggerEdges;
+extern volatile  uint8_t pulseMode;
+extern volatile uint16_t pulseWidth;
+extern volatile uint16_t pulseCount;
+extern          uint32_t holdoff;
+extern          uint32_t autoTimeout;
+extern volatile  uint8_t triggerTimer;
+extern volatile unsigned long triggerTimerStart;
+extern volatile uint32_t triggerTimerLength;
+extern           uint8_t memoryMode;
+extern           uint8_t segmentCount;
+extern          uint16_t segmentStride;
+extern volatile  uint8_t segment;
+extern volatile  index_t segmentStop[SEGMENTSMAX];
+extern volatile  uint8_t segmentChannel[SEGMENTSMAX];
+extern volatile  uint8_t segmentDecimation[SEGMENTSMAX];
+extern volatile unsigned long segmentTime[SEGMENTSMAX];
+extern           uint8_t sendingSegment;
+extern volatile  uint8_t decimateMode;
+extern volatile  uint8_t decimateFactor;
+extern volatile  uint8_t decimateShift;
+extern volatile  uint8_t decimateCount;
+extern volatile uint16_t decimateSum;
+extern volatile  uint8_t decimateMin;
+extern volatile  uint8_t decimateMax;
+extern volatile  uint8_t decimatePending;
+extern volatile  uint8_t stopDecimation;
+extern           uint8_t channelCount;
+extern           uint8_t channelList[MAXCHANNELS];
+extern volatile  uint8_t muxChannels;
+extern volatile  uint8_t channelMux;
+extern volatile  uint8_t channelResult;
+extern volatile  uint8_t stopChannel;
+extern           boolean highResolution;
+extern           uint8_t oversampling;
+extern volatile  uint8_t lowBits;
+extern volatile  uint8_t oversampleShift;
+extern volatile  uint8_t oversampleCount;
+extern volatile uint16_t oversampleSum;
+extern          uint16_t newWaitDuration;
+
+#if BENCHMARK == 1
+extern volatile uint16_t benchADCCount;
+extern volatile uint32_t benchADCCycles;
+extern volatile uint16_t benchADCMaxCycles;
+extern volatile uint16_t benchADCLast;
+extern volatile uint16_t benchADCGrid;
+extern volatile  uint8_t benchADCStart;
+extern volatile  int16_t benchLateMin;
+extern volatile  int16_t benchLateMax;
+extern volatile uint16_t benchMissed;
+extern volatile uint16_t benchACCount;
+extern volatile uint16_t benchACMaxCycles;
+extern          uint32_t benchSpectrumCycles;
+extern          uint16_t benchSpectrumBytes;
+#endif
 
-extern              char commandBuffer[COMBUFFERSIZE+1];
+//-----------------------------------------------------------------------------
+// Telemetry
+//-----------------------------------------------------------------------------
+// Takes the time stamp of a trigger that has just set stopIndex, and the
+// number of samples up to it: waitDuration, or a lap more when stopIndex is
+// passed while the prebuffer is still filling.
+static inline void stampTrigger( void )
+{
+	teleTrigger = micros();
+	teleSamples = waitDuration;
+	if ( waitRemaining >= (wait_t)waitDuration ) teleSamples += captureSize;
+}
 
+// Arms a continuous capture. Its trigger is the sample at which the prebuffer
+// will be full, so the capture ends when the whole buffer has been written
+// anew; the time stamp is taken now, captureSize samples before the end.
+static inline void triggerContinuous( void )
+{
+	triggerIndex = Capture::advance( ADCCounter, waitRemaining, captureSize );
+	stopIndex = Capture::advance( triggerIndex, waitDuration, captureSize );
+	teleTrigger = micros();
+	teleSamples = captureSize;
+}
@@ -33,21 +33,127 @@
 //-----------------------------------------------------------------------------
 
 volatile uint16_t waitDuration;
-volatile  int16_t waitRemaining;
-volatile uint16_t stopIndex;
-volatile uint16_t triggerIndex;
-volatile uint16_t ADCCounter;
+volatile   wait_t waitRemaining;
+volatile   stop_t stopIndex;
+volatile  index_t triggerIndex;
+volatile  index_t ADCCounter;
 volatile  uint8_t ADCBuffer[ADCBUFFERSIZE];
 volatile  boolean freeze;
+volatile  boolean captureDone;
+volatile  uint8_t * volatile captureBuffer;
+volatile uint16_t captureSize;
+volatile  uint8_t * volatile frozenBuffer;
+volatile  index_t frozenStopIndex;
+volatile  index_t frozenTriggerIndex;
+          uint8_t frozenChannel;
+          uint8_t frozenDecimation;
 
           uint8_t prescaler;
           uint8_t triggerEvent;
           uint8_t threshold;
-
-             char commandBuffer[COMBUFFERSIZE+1];
+          uint8_t hysteresis;
+volatile  uint8_t triggerSource;
+volatile  boolean triggerArmed;
+volatile  uint8_t triggerLevel;
+volatile  uint8_t triggerHigh;
+volatile  uint8_t triggerLow;
+volatile  uint8_t triggerEdges;
+volatile  uint8_t pulseMode;
+volatile uint16_t pulseWidth;
+volatile uint16_t pulseCount;
+         uint32_t holdoff;
+         uint32_t autoTimeout;
+volatile  uint8_t triggerTimer;
+volatile unsigned long triggerTimerStart;
+volatile uint32_t triggerTimerLength;
+          uint8_t memoryMode;
+          uint8_t segmentCount;
+         uint16_t segmentStride;
+volatile  uint8_t segment;
+volatile  index_t segmentStop[SEGMENTSMAX];
+volatile  uint8_t segmentChannel[SEGMENTSMAX];
+volatile  uint8_t segmentDecimation[SEGMENTSMAX];
+volatile unsigned long segmentTime[SEGMENTSMAX];
+          uint8_t sendingSegment;
+volatile  uint8_t decimateMode;
+volatile  uint8_t decimateFactor;
+volatile  uint8_t decimateShift;
+volatile  uint8_t decimateCount;
+volatile uint16_t decimateSum;
+volatile  uint8_t decimateMin;
+volatile  uint8_t decimateMax;
+volatile  uint8_t decimatePending;
+volatile  uint8_t stopDecimation;
+          uint8_t channelCount;
+          uint8_t channelList[MAXCHANNELS];
+volatile  uint8_t muxChannels;
+volatile  uint8_t channelMux;
+volatile  uint8_t channelResult;
+volatile  uint8_t stopChannel;
+          boolean highResolution;
+          uint8_t oversampling;
+volatile  uint8_t lowBits;
+volatile  uint8_t oversampleShift;
+volatile  uint8_t oversampleCount;
+volatile uint16_t oversampleSum;
 
          uint16_t newWaitDuration;
           boolean isContinuous;
+volatile  boolean isStreaming;
+volatile  index_t streamTail;
+volatile uint16_t streamOverruns;
+volatile  boolean isEquivalentTime;
+volatile  uint8_t etsPhase;
+volatile uint16_t etsPosition;
+volatile uint16_t etsRemaining;
+volatile  uint8_t etsStep;
+volatile uint16_t etsPeriod;
+volatile  boolean isClocked;
+         uint32_t sampleClock;
+         uint16_t clockCounts;
+          uint8_t clockSelect;
+         uint32_t clockCycles;
+volatile unsigned long teleTrigger;
+volatile uint16_t teleSamples;
+volatile unsigned long teleElapsed;
+volatile uint16_t teleCaptured;
+volatile uint16_t teleMissed;
+          boolean framed;
+          boolean compressed;
+          boolean metering;
+         uint32_t baudRate;
+          boolean linkTest;
+          uint8_t spectrumMode;
+          uint8_t spectrumWindow;
+         uint16_t viewBefore;
+         uint16_t viewAfter;
+          uint8_t viewMode;
+          uint8_t viewStep;
+          boolean sending;
+volatile  boolean txBusy;
+const     uint8_t * volatile txPointer;
+volatile uint16_t txRemaining;
+volatile  uint8_t txRegion;
+          uint8_t txRegions;
+const     uint8_t *txRegionStart[TXREGIONS];
+         uint16_t txRegionLength[TXREGIONS];
+         uint16_t frameSequence;
+
+#if BENCHMARK == 1
+volatile uint16_t benchADCCount;
+volatile uint32_t benchADCCycles;
+volatile uint16_t benchADCMaxCycles;
+volatile uint16_t benchADCLast;		// cycles of the latest ADC ISR
+volatile uint16_t benchADCGrid;		// stamp of the latest conversion
+volatile  uint8_t benchADCStart;	// conversions before the grid starts
+volatile  int16_t benchLateMin;
+volatile  int16_t benchLateMax;
+volatile uint16_t benchMissed;
+volatile uint16_t benchACCount;
+volatile uint16_t benchACMaxCycles;
+         uint32_t benchSpectrumCycles;
+         uint16_t benchSpectrumBytes;
+#endif
 
 //-----------------------------------------------------------------------------
 // Main routines
@@ -57,25 +163,94 @@ volatile  boolean freeze;
 //
 void setup (void) {		// Setup of the microcontroller
 	// Open serial port with a baud rate of BAUDRATE b/s
-	Serial.begin(BAUDRATE);
+	baudRate = BAUDRATE;
+	linkTest = false;
+	Serial.begin(baudRate);
 
 	dshow("# setup()");
 	// Clear buffers
 	memset( (void *)ADCBuffer, 0, sizeof(ADCBuffer) );
-	memset( (void *)commandBuffer, 0, sizeof(commandBuffer) );
 	ADCCounter = 0;
 
-	waitDuration = 768;
+	waitDuration = ADCBUFFERSIZE / 4 * 3;
 	newWaitDuration = waitDuration;
-	stopIndex = ADCBUFFERSIZE + 1;
+	stopIndex = Capture::disarmed;
 	freeze = false;
+	captureDone = false;
+
+	memoryMode = MEMORY_SINGLE;
+	segmentCount = 4;
+	segmentStride = ADCBUFFERSIZE / 4;
+	segment = 0;
+	sendingSegment = 0;
+	captureBuffer = ADCBuffer;
+	captureSize = ADCBUFFERSIZE;
+	frozenBuffer = ADCBuffer;
 
 	prescaler = 32;
 	triggerEvent = 2;
 
 	threshold = 128;
+	hysteresis = 4;
+
+	triggerSource = TRIGGER_COMPARATOR;
+	triggerArmed = false;
+	triggerLevel = LEVEL_UNKNOWN;
+	pulseMode = PULSE_OFF;
+	pulseWidth = 0;
+	pulseCount = PULSE_UNMEASURED;
+	setDigitalTrigger();
+
+	holdoff = 0;
+	autoTimeout = 0;
+	triggerTimer = TIMER_IDLE;
+
+	channelCount = 1;
+	channelList[0] = ADCPIN;
+	muxChannels = 1;
+	channelMux = 0;
+	channelResult = 0;
+	stopChannel = 0;
+	frozenChannel = 0;
+	stopDecimation = 0;
+	frozenDecimation = 0;
+
+	highResolution = false;
+	oversampling = 0;
+	lowBits = 0;
+	oversampleShift = 0;
+	oversampleCount = 1;
+	oversampleSum = 0;
+
+	setDecimation( DECIMATE_OFF, 1 );
 
 	isContinuous = false;
+	isStreaming = false;
+	streamTail = 0;
+	streamOverruns = 0;
+	isEquivalentTime = false;
+	etsPosition = ADCBUFFERSIZE;
+	isClocked = false;
+	sampleClock = 0;
+
+	teleTrigger = 0;
+	teleSamples = 0;
+	teleElapsed = 0;
+	teleCaptured = 0;
+	teleMissed = 0;
+
+	framed = false;
+	compressed = false;
+	metering = false;
+	spectrumMode = SPECTRUM_OFF;
+	spectrumWindow = WINDOW_RECTANGULAR;
+	viewBefore = 0;
+	viewAfter = 0;
+	setViewReduction( VIEW_FULL, 1 );
+	frameSequence = 0;
+	sending = false;
+	txBusy = false;
+	txRegions = 0;
 
 	// Activate interrupts
 	sei();
@@ -83,6 +258,9 @@ void setup (void) {		// Setup of the microcontroller
 	initPins();
 	initADC();
 	initAnalogComparator();
+	#if BENCHMARK == 1
+	initBenchmark();
+	#endif
 }
 
 void loop (void) {
@@ -95,37 +273,65 @@ void loop (void) {
 	Serial.println( ADCSRB, BIN );
 	#endif
 
+	// In roll mode send whatever the ISR has produced so far
+	if ( isStreaming && !linkTest ) {
+		drainStream();
+	}
+
 	// If freeze flag is set, then it is time to send the buffer to the serial port
-	if ( freeze )
+	if ( freeze && !sending && !linkTest )
 	{
 		dshow("# Frozen");
 
 		//ADCBuffer[triggerIndex] = 0;
 		//ADCBuffer[stopIndex] = 255;
 
-		// Send the buffer to serial
-		Serial.write( (uint8_t *)ADCBuffer + stopIndex, ADCBUFFERSIZE - stopIndex );
-		Serial.write( (uint8_t *)ADCBuffer, stopIndex );
-
-		freeze = false;
-
-		stopIndex = ADCBUFFERSIZE + 1;
-
-		if (newWaitDuration != waitDuration) {
-			waitDuration = newWaitDuration;
-		}
-		// Time to prebuffer the next frame
-		waitRemaining = ADCBUFFERSIZE - waitDuration;
+		// A segmented capture is sent one segment after the other
+		if ( memoryMode == MEMORY_SEGMENTED ) selectSegment( sendingSegment );
 
+		// Start sending the buffer to serial, commands are parsed while
+		// the transmit engine works.
+		sendFrame();
+		sending = true;
+	}
 
-		startADC();
+	// Encode as much of a compressed frame as the Serial TX buffer takes
+	encodeFrame();
 
-		if (!isContinuous) {
-			startAnalogComparator();
-		}
-		else {
-			stopIndex = ADCCounter + waitDuration;
-			if (stopIndex >= ADCBUFFERSIZE) stopIndex -= ADCBUFFERSIZE;
+	// When the frame is out, release the buffer
+	if ( sending && !txBusy )
+	{
+		sending = false;
+		recordFrame();
+
+		// A segmented capture stays frozen until the last segment of the
+		// batch has been sent
+		boolean batch = ( memoryMode == MEMORY_SEGMENTED && ++sendingSegment < segmentCount );
+
+		// In ping-pong mode the ISR has already rearmed on the other half
+		// and keeps capturing, unless that half filled up during sending.
+		cli();
+		boolean running = ( memoryMode == MEMORY_PINGPONG && !captureDone );
+		if (running) freeze = false;
+		sei();
+
+		if ( !running && !batch ) {
+			if (captureDone) {
+				// The other half is complete, send it next and rearm on
+				// the half that was just sent.
+				frozenBuffer = captureBuffer;
+				frozenStopIndex = stopIndex;
+				frozenTriggerIndex = triggerIndex;
+				frozenChannel = stopChannel;
+				frozenDecimation = stopDecimation;
+				captureBuffer = ( captureBuffer == ADCBuffer ) ? ADCBuffer + ADCBUFFERSIZE / 2 : ADCBuffer;
+				captureDone = false;
+			}
+			else {
+				freeze = false;
+			}
+
+			armCapture();
 		}
 
 		#if DEBUG == 1
@@ -133,109 +339,308 @@ void loop (void) {
 		#endif
 	}
 
-	if ( Serial.available() > 0 ) {
-		// Read the incoming byte
-		char theChar = Serial.read();
-			// Parse character
-		switch (theChar) {
-			case 's':			// 's' for starting ADC conversions
-
-				// Clear buffer
-				memset( (void *)ADCBuffer, 0, sizeof(ADCBuffer) );
-
-				startADC();
-				startAnalogComparator();
-				break;
-			case 'S':			// 'S' for stopping ADC conversions
-				stopAnalogComparator();
-				stopADC();
-				break;
-			case 'p':			// 'p' for new prescaler setting
-			case 'P': {
-				// Wait for COMMANDDELAY ms to be sure that the Serial buffer is filled
-				delay(COMMANDDELAY);
-
-				fillBuffer( commandBuffer, COMBUFFERSIZE );
-
-				// Convert buffer to integer
-				uint8_t newP = atoi( commandBuffer );
-
-				prescaler = newP;
-				setADCPrescaler(newP);
-				}
-				break;
-
-			case 'r':			// 'r' for new voltage reference setting
-			case 'R': {
-				// Wait for COMMANDDELAY ms to be sure that the Serial buffer is filled
-				delay(COMMANDDELAY);
-
-				fillBuffer( commandBuffer, COMBUFFERSIZE );
-
-				// Convert buffer to integer
-				uint8_t newR = atoi( commandBuffer );
-
-				setVoltageReference(newR);
-				}
-				break;
+	// Parse the bytes that have arrived, commands run as soon as they
+	// are complete.
+	readCommands();
 
-			case 'e':			// 'e' for new trigger event setting
-			case 'E': {
-				// Wait for COMMANDDELAY ms to be sure that the Serial buffer is filled
-				delay(COMMANDDELAY);
+	// Turn off the error LED when its time is up
+	updateError();
 
-				fillBuffer( commandBuffer, COMBUFFERSIZE );
+	// Frame rate window and periodic telemetry records
+	updateTelemetry();
+}
 
-				// Convert buffer to integer
-				uint8_t newE = atoi( commandBuffer );
+//-----------------------------------------------------------------------------
+// runCommand
+//-----------------------------------------------------------------------------
+// Executes a command letter with its numeric argument, 0 when none was given.
+//
+void runCommand (char command, uint32_t argument) {
+	switch (command) {
+		case 's':			// 's' for starting ADC conversions
+
+			if (isStreaming) {
+				// Roll mode has no trigger: the ring starts over
+				// empty, the stale samples are never drained.
+				setStreaming(true);
+			}
+			else {
+				// Clear buffer
+				waitTransmit();
+				memset( (void *)ADCBuffer, 0, sizeof(ADCBuffer) );
 
+				// The first capture prebuffers like every other one.
+				// Equivalent time passes enable the ADC here.
+				if (isEquivalentTime) startADC();
+				armCapture();
+			}
+			break;
+		case 'S':			// 'S' for stopping ADC conversions
+			stopTrigger();
+			stopADC();
+			break;
+		case 'p':			// 'p' for new prescaler setting
+		case 'P': {
+			uint8_t newP = argument;
+
+			prescaler = newP;
+			if (isEquivalentTime) {
+				// Restart the passes with the new timing
+				setEquivalentTime(true);
+			}
+			else {
+				updatePrescaler();
+			}
+			}
+			break;
+
+		case 'r':			// 'r' for new voltage reference setting
+		case 'R': {
+			uint8_t newR = argument;
+
+			setVoltageReference(newR);
+			}
+			break;
+
+		case 'e':			// 'e' for new trigger event setting
+		case 'E': {
+			uint8_t newE = argument;
+
+			if (newE == 5){
+				if (isEquivalentTime) setEquivalentTime(false);
+				setStreaming(true);
+			}
+			else if (newE == 6){
+				isContinuous = false;
+				if (isStreaming) setStreaming(false);
+				setEquivalentTime(true);
+			}
+			else {
 				if (newE == 4){
+					// The comparator would still move the
+					// trigger, a capture waiting for it stops
+					// when the buffer has been written anew.
+					cli();
 					isContinuous = true;
+					stopTrigger();
+					if ( stopIndex == Capture::disarmed ) triggerContinuous();
+					sei();
 				}
 				else {
 					isContinuous = false;
 					triggerEvent = newE;
 					setTriggerEvent(newE);
+					setDigitalTrigger();
 				}
-				}
-				break;
-
-			case 'w':			// 'w' for new wait setting
-			case 'W': {
-				// Wait for COMMANDDELAY ms to be sure that the Serial buffer is filled
-				delay(COMMANDDELAY);
-
-				fillBuffer( commandBuffer, COMBUFFERSIZE );
-
-				// Convert buffer to integer
-				uint16_t newW = atoi( commandBuffer );
-
-				newWaitDuration = newW;
-				}
-				break;
-
-			case 't':			// 't' for new threshold setting
-			case 'T': {
-				// Wait for COMMANDDELAY ms to be sure that the Serial buffer is filled
-				delay(COMMANDDELAY);
-
-				fillBuffer( commandBuffer, COMBUFFERSIZE );
-
-				// Convert buffer to integer
-				uint8_t newT = atoi( commandBuffer );
-
-				threshold = newT;
-				analogWrite( thresholdPin, threshold );
-				}
-				break;
-
-			case 'd':			// 'd' for display status
-			case 'D':
-				printStatus();
-				break;
+				if (isStreaming) setStreaming(false);
+				if (isEquivalentTime) setEquivalentTime(false);
+			}
+			}
+			break;
+
+		case 'w':			// 'w' for new wait setting
+		case 'W': {
+			uint16_t newW = argument > ADCBUFFERSIZE ? ADCBUFFERSIZE : argument;
+
+			newWaitDuration = newW;
+			}
+			break;
+
+		case 't':			// 't' for new threshold setting
+		case 'T': {
+			uint8_t newT = argument;
+
+			threshold = newT;
+			analogWrite( thresholdPin, threshold );
+			setDigitalTrigger();
+			}
+			break;
+
+		case 'g':			// 'g' for trigger source setting
+		case 'G': {
+			uint8_t newG = argument;
+
+			// 0 analog comparator, 1 digital
+			setTriggerSource(newG);
+			}
+			break;
+
+		case 'h':			// 'h' for new trigger hysteresis setting
+		case 'H': {
+			uint8_t newH = argument;
+
+			hysteresis = newH;
+			setDigitalTrigger();
+			}
+			break;
+
+		case 'q':			// 'q' for pulse width qualification
+		case 'Q': {
+			uint8_t newQ = argument;
+
+			// 0 off, 1 wider than, 2 narrower than pulseWidth
+			pulseMode = ( newQ > PULSE_NARROWER ) ? PULSE_OFF : newQ;
+			}
+			break;
+
+		case 'u':			// 'u' for new pulse width setting
+		case 'U': {
+			uint16_t newU = argument >= PULSE_UNMEASURED ? PULSE_UNMEASURED - 1 : argument;
+
+			cli();
+			pulseWidth = newU;
+			sei();
+			}
+			break;
+
+		case 'c':			// 'c' for new sample clock setting
+		case 'C':
+			// Sample rate in Hz, 0 for free running conversions
+			setSampleClock(argument);
+			break;
+
+		case 'm':			// 'm' for new memory mode setting
+		case 'M': {
+			uint8_t newM = argument;
+
+			setMemoryMode(newM);
+			}
+			break;
+
+		case 'l':			// 'l' for new sample resolution setting
+		case 'L': {
+			uint8_t newL = argument;
+
+			// 8 or 10 bits
+			setResolution(newL);
+			}
+			break;
+
+		case 'o':			// 'o' for new oversampling setting
+		case 'O': {
+			uint8_t newO = argument;
+
+			// 4^newO conversions per sample
+			setOversampling(newO);
+			}
+			break;
+
+		case 'k':			// 'k' for new segment count setting
+		case 'K': {
+			uint8_t newK = argument;
+
+			// Segments of the segmented memory mode
+			setSegments(newK);
+			}
+			break;
+
+		case 'j':			// 'j' for new trigger holdoff setting
+		case 'J':
+			// Microseconds, 0 for none
+			setHoldoff(argument);
+			break;
+
+		case 'y':			// 'y' for new auto trigger timeout setting
+		case 'Y': {
+			uint32_t newY = argument > AUTOTIMEOUTMAX ? AUTOTIMEOUTMAX : argument;
+
+			// Milliseconds, 0 waits for the trigger forever
+			setAutoTrigger(newY);
+			}
+			break;
+
+		case 'v':			// 'v' for new spectrum window setting
+		case 'V': {
+			uint8_t newV = argument;
+
+			// 0 rectangular, 1 Hann
+			spectrumWindow = ( newV > WINDOW_HANN ) ? WINDOW_RECTANGULAR : newV;
+			}
+			break;
+
+		case 'a':			// 'a' for new decimation mode setting
+		case 'A':
+			setDecimation( argument, decimateFactor );
+			break;
+
+		case 'n':			// 'n' for new decimation factor setting
+		case 'N':
+			setDecimation( decimateMode, argument > DECIMATEMAX ? DECIMATEMAX : argument );
+			break;
+
+		case 'i':			// 'i' for new input channel setting
+		case 'I': {
+			uint8_t newI = argument;
+
+			// Bit mask of the ADC inputs, 0 for ADCPIN alone
+			setChannels(newI);
+			}
+			break;
+
+		case 'f':			// 'f' for output format setting
+		case 'F': {
+			uint8_t newF = argument;
+
+			// 0 raw, 1 framed, 2 framed and compressed, 3 measurements,
+			// 4 spectrum, 5 spectrum in 8-bit log bins
+			framed = ( newF != 0 );
+			compressed = ( newF == 2 );
+			metering = ( newF == 3 );
+			spectrumMode = ( newF == 4 ) ? SPECTRUM_LINEAR : ( newF == 5 ) ? SPECTRUM_LOG : SPECTRUM_OFF;
+			}
+			break;
+
+		case '<': {			// '<' for new view start setting
+			uint16_t newBefore = argument > ADCBUFFERSIZE ? ADCBUFFERSIZE : argument;
+
+			// Samples before the trigger, "<0>0" sends whole captures
+			viewBefore = newBefore;
+			}
+			break;
+
+		case '>': {			// '>' for new view end setting
+			uint16_t newAfter = argument > ADCBUFFERSIZE ? ADCBUFFERSIZE : argument;
+
+			// Samples from the trigger on
+			viewAfter = newAfter;
+			}
+			break;
+
+		case '/':			// '/' for new view stride setting
+			// One sample of every argument samples
+			setViewReduction( VIEW_STRIDE, argument );
+			break;
+
+		case '|':			// '|' for new view min/max setting
+			// Min/max pair of every argument samples
+			setViewReduction( VIEW_PEAK, argument );
+			break;
+
+		case 'z':			// 'z' for new baud rate setting
+		case 'Z':
+			// Baud rate in bps, kept when the host passes the self-test
+			setBaudRate(argument);
+			break;
+
+		case 'd':			// 'd' for display status
+		case 'D':
+			printStatus();
+			break;
+
+		case 'x':			// 'x' for runtime telemetry
+		case 'X':
+			runTelemetry(argument);
+			break;
+
+		#if BENCHMARK == 1
+		case 'b':			// 'b' for benchmark report
+		case 'B':
+			printBenchmark();
+			resetBenchmark();
+			break;
+		#endif
 
-			default:
-				error();
-		}
+		default:
+			error();
 	}
 }
@@ -0,0 +1,347 @@
+//-----------------------------------------------------------------------------
+// Spectrum.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "small-scope.h"
+
+//-----------------------------------------------------------------------------
+// Spectrum
+//-----------------------------------------------------------------------------
+// The magnitude spectrum of the frozen capture is computed where the capture
+// is, there is no memory for a copy:
+//
+//	1. The capture is rotated so the oldest sample comes first and the
+//	   newest N samples of the first input are moved to the front. N is
+//	   the largest power of two, up to FFTMAX, that fits twice into the
+//	   capture.
+//	2. The samples are widened to 16 bits, last one first, less their
+//	   mean and times 32, optionally windowed. Read as complex numbers the
+//	   N real samples are N/2 points, even samples the real parts.
+//	3. A radix-2 decimation in time FFT of the N/2 points runs in place in
+//	   Q15 arithmetic. Before each stage all values are halved until none
+//	   is above FFTLIMIT, so no butterfly overflows (block floating point).
+//	4. The N/2 point spectrum is split into the spectrum of the N real
+//	   samples, bins 0 to N/2-1, and their magnitudes replace it.
+//
+// Only the 8 high bits of 10 and 12-bit samples are used.
+
+static const int16_t sineTable[FFTMAX / 4 + 1] PROGMEM = {
+	0, 402, 804, 1206, 1608, 2009, 2410, 2811,
+	3212, 3612, 4011, 4410, 4808, 5205, 5602, 5998,
+	6393, 6786, 7179, 7571, 7962, 8351, 8739, 9126,
+	9512, 9896, 10278, 10659, 11039, 11417, 11793, 12167,
+	12539, 12910, 13279, 13645, 14010, 14372, 14732, 15090,
+	15446, 15800, 16151, 16499, 16846, 17189, 17530, 17869,
+	18204, 18537, 18868, 19195, 19519, 19841, 20159, 20475,
+	20787, 21096, 21403, 21705, 22005, 22301, 22594, 22884,
+	23170, 23452, 23731, 24007, 24279, 24547, 24811, 25072,
+	25329, 25582, 25832, 26077, 26319, 26556, 26790, 27019,
+	27245, 27466, 27683, 27896, 28105, 28310, 28510, 28706,
+	28898, 29085, 29268, 29447, 29621, 29791, 29956, 30117,
+	30273, 30424, 30571, 30714, 30852, 30985, 31113, 31237,
+	31356, 31470, 31580, 31685, 31785, 31880, 31971, 32057,
+	32137, 32213, 32285, 32351, 32412, 32469, 32521, 32567,
+	32609, 32646, 32678, 32705, 32728, 32745, 32757, 32765,
+	32767,
+};
+
+// 8 log2(1 + (m + 1/2) / 32) rounded, the fraction of a log bin
+static const uint8_t logTable[32] PROGMEM = {
+	0, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 4, 4, 4, 4, 5,
+	5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 8, 8, 8,
+};
+
+static uint16_t fftSize;
+static uint8_t fftExponent;
+static uint16_t binCount;
+static uint8_t binBits;
+
+static uint8_t spectrumHeader[SPECTRUMHEADER];
+static uint8_t spectrumTrailer[2];
+
+// sin( 2 pi i / FFTMAX ) in Q15
+static int16_t fftSin( uint16_t i )
+{
+	const uint16_t quarter = FFTMAX / 4;
+
+	i &= FFTMAX - 1;
+	if ( i <= quarter ) return pgm_read_word( sineTable + i );
+	if ( i <= 2 * quarter ) return pgm_read_word( sineTable + 2 * quarter - i );
+	if ( i <= 3 * quarter ) return -(int16_t)pgm_read_word( sineTable + i - 2 * quarter );
+	return -(int16_t)pgm_read_word( sineTable + 4 * quarter - i );
+}
+
+static int16_t fftCos( uint16_t i )
+{
+	return fftSin( i + FFTMAX / 4 );
+}
+
+// Reverses the bytes from first up to, not including, last
+static void reverse( uint8_t *first, uint8_t *last )
+{
+	while ( first < --last ) {
+		uint8_t swap = *first;
+		*first++ = *last;
+		*last = swap;
+	}
+}
+
+// Steps 1 and 2, returns the samples as N/2 complex numbers
+static int16_t *loadSamples( void )
+{
+	uint8_t *buffer = (uint8_t *)frozenBuffer;
+	uint16_t size = captureSize;
+	uint16_t stop = frozenStopIndex;
+	uint8_t channels = muxChannels;
+
+	// Rotate left by stop
+	reverse( buffer, buffer + stop );
+	reverse( buffer + stop, buffer + size );
+	reverse( buffer, buffer + size );
+
+	// Offset of the first sample of the first input, see buildFrameHeader()
+	uint8_t first = ( frozenChannel + 1 + channels - size % channels ) % channels;
+	uint16_t offset = ( channels - first ) % channels;
+	uint16_t count = ( size - offset + channels - 1 ) / channels;
+
+	uint16_t n = FFTMAX;
+	while ( n > count || 2 * n > size ) n >>= 1;
+	fftSize = n;
+
+	// The newest n samples of the first input, moved forward
+	uint16_t j = offset + ( count - n ) * channels;
+	uint32_t sum = 0;
+	for ( uint16_t k = 0; k < n; k++ ) {
+		buffer[k] = buffer[j];
+		sum += buffer[k];
+		j += channels;
+	}
+	int16_t mean = ( ( sum << 5 ) + n / 2 ) / n;
+
+	// Widened backwards, sample k becomes bytes 2k and 2k+1
+	int16_t *data = (int16_t *)buffer;
+	uint16_t step = FFTMAX / n;
+	for ( uint16_t k = n; k-- > 0; ) {
+		int16_t x = ( (int16_t)buffer[k] << 5 ) - mean;
+		if ( spectrumWindow == WINDOW_HANN ) {
+			int16_t w = ( 32767 - fftCos( k * step ) ) >> 1;
+			x = ( (int32_t)x * w ) >> 15;
+		}
+		data[k] = x;
+	}
+
+	return data;
+}
+
+// Halves all values until none is above FFTLIMIT
+static void limitRange( int16_t *data, uint16_t values )
+{
+	for (;;) {
+		int16_t peak = 0;
+		for ( uint16_t i = 0; i < values; i++ ) {
+			int16_t v = data[i] < 0 ? -data[i] : data[i];
+			if ( v > peak ) peak = v;
+		}
+		if ( peak <= FFTLIMIT ) return;
+
+		for ( uint16_t i = 0; i < values; i++ ) data[i] >>= 1;
+		fftExponent++;
+	}
+}
+
+// Step 3 over m complex points, real and imaginary parts interleaved
+static void transform( int16_t *data, uint16_t m )
+{
+	// Bit reversed order
+	for ( uint16_t i = 1, j = 0; i < m; i++ ) {
+		uint16_t bit = m >> 1;
+		for ( ; j & bit; bit >>= 1 ) j ^= bit;
+		j ^= bit;
+		if ( i < j ) {
+			int16_t swap = data[2 * i];
+			data[2 * i] = data[2 * j];
+			data[2 * j] = swap;
+			swap = data[2 * i + 1];
+			data[2 * i + 1] = data[2 * j + 1];
+			data[2 * j + 1] = swap;
+		}
+	}
+
+	for ( uint16_t length = 2; length <= m; length <<= 1 ) {
+		limitRange( data, 2 * m );
+
+		uint16_t half = length >> 1;
+		uint16_t step = FFTMAX / length;
+		for ( uint16_t j = 0; j < half; j++ ) {
+			// e^( -2 pi i j / length )
+			int16_t wr = fftCos( j * step );
+			int16_t wi = -fftSin( j * step );
+			for ( uint16_t i = j; i < m; i += length ) {
+				int16_t *a = data + 2 * i;
+				int16_t *b = data + 2 * ( i + half );
+				int16_t tr = ( (int32_t)wr * b[0] - (int32_t)wi * b[1] ) >> 15;
+				int16_t ti = ( (int32_t)wr * b[1] + (int32_t)wi * b[0] ) >> 15;
+				b[0] = a[0] - tr;
+				b[1] = a[1] - ti;
+				a[0] += tr;
+				a[1] += ti;
+			}
+		}
+	}
+}
+
+static uint16_t magnitude( int32_t re, int32_t im )
+{
+	return squareRoot( (uint32_t)( re * re ) + (uint32_t)( im * im ) );
+}
+
+// Step 4, leaves the halved magnitudes of bins 0 to m-1 as words at the front
+static void magnitudes( int16_t *data, uint16_t m )
+{
+	uint16_t step = FFTMAX / ( 2 * m );
+
+	// Bin 0 is the sum of the real and imaginary part of point 0
+	data[0] = magnitude( ( (int32_t)data[0] + data[1] ) >> 1, 0 );
+
+	for ( uint16_t k = 1; k <= m / 2; k++ ) {
+		int16_t *z = data + 2 * k;
+		int16_t *y = data + 2 * ( m - k );
+
+		// Even samples e = ( Z[k] + conj Z[m-k] ) / 2, odd samples
+		// o = ( Z[k] - conj Z[m-k] ) / 2j
+		int32_t er = ( (int32_t)z[0] + y[0] ) >> 1;
+		int32_t ei = ( (int32_t)z[1] - y[1] ) >> 1;
+		int32_t or_ = ( (int32_t)z[1] + y[1] ) >> 1;
+		int32_t oi = ( (int32_t)y[0] - z[0] ) >> 1;
+
+		// t = o e^( -2 pi i k / 2m ), X[k] = e + t, X[m-k] = conj( e - t )
+		int16_t wr = fftCos( k * step );
+		int16_t wi = -fftSin( k * step );
+		int32_t tr = ( wr * or_ - wi * oi ) >> 15;
+		int32_t ti = ( wr * oi + wi * or_ ) >> 15;
+
+		z[0] = magnitude( ( er + tr ) >> 1, ( ei + ti ) >> 1 );
+		y[0] = magnitude( ( er - tr ) >> 1, ( ei - ti ) >> 1 );
+	}
+
+	// Each magnitude sits in the real part of its point
+	uint16_t *bins = (uint16_t *)data;
+	for ( uint16_t k = 1; k < m; k++ ) bins[k] = data[2 * k];
+}
+
+// 8 log2( bin 2^exponent ), 0 for an empty bin
+static uint8_t logBin( uint16_t bin, uint8_t exponent )
+{
+	if ( bin == 0 ) return 0;
+
+	uint8_t msb = 15;
+	while ( !( bin & 0x8000 ) ) {
+		bin <<= 1;
+		msb--;
+	}
+	// The 5 bits below the top one
+	uint16_t value = 8 * ( msb + exponent ) + pgm_read_byte( logTable + ( ( bin >> 10 ) & 0x1F ) );
+	return value > 255 ? 255 : value;
+}
+
+//-----------------------------------------------------------------------------
+// sendSpectrum
+//-----------------------------------------------------------------------------
+// Replaces the frozen capture by its spectrum and sends it instead of the
+// samples. The frame (little endian) is
+//
+//	offset	size	field
+//	0	2	sync word FRAMESYNC0, FRAMESYNCF
+//	2	2	sequence number, shared with the frames
+//	4	2	bin count, N/2
+//	6	1	window, WINDOW_RECTANGULAR or WINDOW_HANN
+//	7	1	bits per bin, 16 or 8
+//	8	1	exponent e
+//	9	4	sample rate of the input in samples/s, bin k is at
+//		k rate / N Hz
+//	13	n	bins
+//	13+n	2	CRC-16/CCITT of bytes 2 to 12+n, as in frames
+//
+// With 16 bits a bin B is the magnitude |X| = B 2^e / 32 of the DFT of the
+// samples (less their mean, times the window) in LSB, a sine of amplitude A
+// LSB gives A N / 2 without window. With 8 bits a bin L is the magnitude in
+// 1/8 octaves, |X| = 2^( L / 8 ) / 32, that is 0.753 L - 30.1 dB above
+// 1 LSB. The spectrum goes out through the transmit engine.
+
+void sendSpectrum( void )
+{
+	#if BENCHMARK == 1
+	unsigned long start = micros();
+	#endif
+
+	fftExponent = 0;
+	int16_t *data = loadSamples();
+	uint16_t m = fftSize / 2;
+	transform( data, m );
+	magnitudes( data, m );
+
+	// The split halved the magnitudes
+	fftExponent++;
+	binCount = m;
+
+	uint16_t *bins = (uint16_t *)data;
+	uint8_t *bytes = (uint8_t *)data;
+	if ( spectrumMode == SPECTRUM_LOG ) {
+		binBits = 8;
+		for ( uint16_t k = 0; k < m; k++ ) bytes[k] = logBin( bins[k], fftExponent );
+	}
+	else {
+		// Words are little endian like the AVR
+		binBits = 16;
+	}
+	uint16_t length = m * ( binBits / 8 );
+
+	#if BENCHMARK == 1
+	benchSpectrumCycles = ( micros() - start ) * clockCyclesPerMicrosecond();
+	benchSpectrumBytes = SPECTRUMHEADER + length + sizeof(spectrumTrailer);
+	#endif
+
+	uint16_t crc = 0xFFFF;
+	spectrumHeader[0] = FRAMESYNC0;
+	spectrumHeader[1] = FRAMESYNCF;
+	putWord( spectrumHeader + 2, frameSequence++, &crc );
+	putWord( spectrumHeader + 4, binCount, &crc );
+	spectrumHeader[6] = spectrumWindow;
+	spectrumHeader[7] = binBits;
+	spectrumHeader[8] = fftExponent;
+	for ( uint8_t i = 6; i < 9; i++ ) {
+		crc = _crc_ccitt_update( crc, spectrumHeader[i] );
+	}
+	putLong( spectrumHeader + 9, sampleRate() / muxChannels, &crc );
+
+	for ( uint16_t i = 0; i < length; i++ ) {
+		crc = _crc_ccitt_update( crc, bytes[i] );
+	}
+	spectrumTrailer[0] = lowByte(crc);
+	spectrumTrailer[1] = highByte(crc);
+
+	queueTransmit( spectrumHeader, sizeof(spectrumHeader) );
+	queueTransmit( bytes, length );
+	queueTransmit( spectrumTrailer, sizeof(spectrumTrailer) );
+	startTransmit();
+}
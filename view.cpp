@@ -0,0 +1,218 @@
+//-----------------------------------------------------------------------------
+// View.cpp
+//-----------------------------------------------------------------------------
+// Copyright 2015 Marvin Sinister
+//
+// This file is part of small-scope.
+//
+//	small-scope is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	small-scope is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with small-scope.  If not, see <http://www.gnu.org/licenses/>.
+//
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "small-scope.h"
+
+//-----------------------------------------------------------------------------
+// Views
+//-----------------------------------------------------------------------------
+// A view is the part of the frozen capture from viewBefore samples before
+// the trigger to viewAfter samples after it, cut off at both ends of the
+// capture. Only the view is sent, reduced by viewMode:
+//
+//	VIEW_FULL	every sample
+//	VIEW_STRIDE	the first sample of every viewStep samples
+//	VIEW_PEAK	the minimum and the maximum of every viewStep samples
+//
+// The reduction is done in place, from the first sample of the view on: a
+// block is read before its samples are written, and the outputs never
+// overtake the inputs. A frame without a view has to be sent whole, so
+// views only apply to 8-bit captures of one input, as decimation does.
+
+static uint8_t viewHeader[VIEWHEADERMAX];
+static uint8_t viewTrailer[2];
+
+//-----------------------------------------------------------------------------
+// setViewReduction
+//-----------------------------------------------------------------------------
+// Sets the reduction of the view, a step below 2 sends every sample.
+
+void setViewReduction( uint8_t mode, uint32_t step )
+{
+	if ( step > VIEWSTEPMAX ) step = VIEWSTEPMAX;
+	if ( step < 2 || mode > VIEW_PEAK ) mode = VIEW_FULL;
+
+	viewMode = mode;
+	viewStep = ( mode == VIEW_FULL ) ? 1 : step;
+}
+
+// Reduces length samples from buffer index start on, returns the samples
+// left there
+static uint16_t reduceView( uint8_t *buffer, uint16_t size, uint16_t start, uint16_t length )
+{
+	if ( viewMode == VIEW_FULL ) return length;
+
+	uint16_t in = start;
+	uint16_t out = start;
+	uint16_t count = 0;
+	uint8_t block = 0;
+	uint8_t minimum = 255;
+	uint8_t maximum = 0;
+
+	for ( uint16_t k = 0; k < length; k++ ) {
+		uint8_t sample = buffer[in];
+		if ( ++in >= size ) in = 0;
+
+		if ( viewMode == VIEW_STRIDE ) {
+			if ( block == 0 ) {
+				buffer[out] = sample;
+				if ( ++out >= size ) out = 0;
+				count++;
+			}
+		}
+		else {
+			if ( sample < minimum ) minimum = sample;
+			if ( sample > maximum ) maximum = sample;
+
+			// A last block of one sample puts its maximum one place
+			// past the view, which an even capture size keeps off
+			// the first output.
+			if ( block == viewStep - 1 || k == length - 1 ) {
+				buffer[out] = minimum;
+				if ( ++out >= size ) out = 0;
+				buffer[out] = maximum;
+				if ( ++out >= size ) out = 0;
+				count += 2;
+				minimum = 255;
+				maximum = 0;
+			}
+		}
+
+		if ( ++block == viewStep ) block = 0;
+	}
+
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+// sendView
+//-----------------------------------------------------------------------------
+// Sends the view of the frozen capture, or the segment selected for sending,
+// and returns false when there is none to send. In framed mode it is a frame
+// of its own (little endian):
+//
+//	offset	size	field
+//	0	2	sync word FRAMESYNC0, FRAMESYNCV
+//	2	2	sequence number, shared with the frames
+//	4	2	trigger, in samples after the oldest one of the capture
+//	6	2	first sample of the view, counted the same way
+//	8	1	ADC prescaler the capture ran at (adcPrescaler())
+//	9	1	trigger mode as in frames, FRAMESEGMENTS set when the
+//			segment block of the frames follows at offset 16,
+//			which moves the samples and the CRC 6 bytes on, and
+//			the decimation mode from bit FRAMEDECIMATION
+//	10	2	samples of the capture in the view
+//	12	1	reduction, viewMode
+//	13	1	step, viewStep
+//	14	2	sample count n
+//	16	n	samples, min/max pairs with VIEW_PEAK
+//	16+n	2	CRC-16/CCITT of bytes 2 to 15+n, as in frames
+//
+// A decimated capture adds the decimation block of the frames after the
+// segment block, 2 more bytes, with the pairs counted from the first sample
+// of the view.
+//
+// Without framing only the samples are sent, and views are never
+// compressed.
+
+boolean sendView( void )
+{
+	if ( viewBefore + viewAfter == 0 || muxChannels > 1 || lowBits ) return false;
+
+	uint8_t *buffer = (uint8_t *)frozenBuffer;
+	uint16_t size = captureSize;
+	uint16_t stop = frozenStopIndex;
+
+	// Trigger and view in time order, oldest sample first
+	uint16_t trigger = frozenTriggerIndex + size - stop;
+	if ( trigger >= size ) trigger -= size;
+	uint16_t first = ( viewBefore < trigger ) ? trigger - viewBefore : 0;
+	uint16_t end = ( viewAfter < size - trigger ) ? trigger + viewAfter : size;
+	uint16_t length = end - first;
+
+	uint16_t start = stop + first;
+	if ( start >= size ) start -= size;
+	uint16_t count = reduceView( buffer, size, start, length );
+
+	// The samples left may wrap around the end of the buffer
+	uint16_t head = ( count < size - start ) ? count : size - start;
+
+	if ( !framed ) {
+		queueTransmit( buffer + start, head );
+		queueTransmit( buffer, count - head );
+		startTransmit();
+		return true;
+	}
+
+	uint16_t crc = 0xFFFF;
+
+	viewHeader[0] = FRAMESYNC0;
+	viewHeader[1] = FRAMESYNCV;
+	putWord( viewHeader + 2, frameSequence++, &crc );
+	putWord( viewHeader + 4, trigger, &crc );
+	putWord( viewHeader + 6, first, &crc );
+	viewHeader[8] = adcPrescaler();
+	viewHeader[9] = isEquivalentTime ? 6 : ( isContinuous ? 4 : triggerEvent );
+	if ( memoryMode == MEMORY_SEGMENTED ) viewHeader[9] |= FRAMESEGMENTS;
+	viewHeader[9] |= frameDecimation() << FRAMEDECIMATION;
+	crc = _crc_ccitt_update( crc, viewHeader[8] );
+	crc = _crc_ccitt_update( crc, viewHeader[9] );
+	putWord( viewHeader + 10, length, &crc );
+	viewHeader[12] = viewMode;
+	viewHeader[13] = viewStep;
+	crc = _crc_ccitt_update( crc, viewHeader[12] );
+	crc = _crc_ccitt_update( crc, viewHeader[13] );
+	putWord( viewHeader + 14, count, &crc );
+
+	uint8_t headerLength = VIEWHEADER;
+	if ( memoryMode == MEMORY_SEGMENTED ) {
+		viewHeader[headerLength] = sendingSegment;
+		viewHeader[headerLength + 1] = segmentCount;
+		crc = _crc_ccitt_update( crc, viewHeader[headerLength] );
+		crc = _crc_ccitt_update( crc, viewHeader[headerLength + 1] );
+		putLong( viewHeader + headerLength + 2, segmentTime[sendingSegment], &crc );
+		headerLength += 6;
+	}
+
+	if ( frameDecimation() != DECIMATE_OFF ) {
+		putDecimation( viewHeader + headerLength, first, &crc );
+		headerLength += 2;
+	}
+
+	for ( uint16_t i = start; i < start + head; i++ ) {
+		crc = _crc_ccitt_update( crc, buffer[i] );
+	}
+	for ( uint16_t i = 0; i < count - head; i++ ) {
+		crc = _crc_ccitt_update( crc, buffer[i] );
+	}
+	viewTrailer[0] = lowByte(crc);
+	viewTrailer[1] = highByte(crc);
+
+	queueTransmit( viewHeader, headerLength );
+	queueTransmit( buffer + start, head );
+	queueTransmit( buffer, count - head );
+	queueTransmit( viewTrailer, sizeof(viewTrailer) );
+	startTransmit();
+	return true;
+}